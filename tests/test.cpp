@@ -1,6 +1,7 @@
 #include <sstream>
 #include <xmlrenderer/xmlrenderer.hpp>
 #include <cassert>
+#include <clocale>
 #define BOOST_TEST_MODULE XmlRendererTest
 #include <boost/test/unit_test.hpp>
 
@@ -444,6 +445,17 @@ BOOST_AUTO_TEST_CASE(subview_insert) {
 		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<root> <foo/><b data-notb=\"42\" id=\"content\">notb = 42</b><bar/></root>\n"
     );
 
+	// children of placeholder are fallback content, inserted view replaces them
+	ctx.put("fallback", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\">"
+			"<div id=\"content\">fallback <f:i>#{numberofthebeast}</f:i><ul c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><li>x</li></ul></div></root>");
+	rnd.create_array("items").add();
+	const std::string inserted = ctx.get("fallback").insert("content", "innertestek", "").render(rnd).xml().to_string();
+	BOOST_CHECK_EQUAL(inserted, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<root><b data-notb=\"42\" id=\"content\">notb = 42</b></root>\n");
+	BOOST_CHECK_EQUAL(inserted, ctx.get("fallback").insert("content", "innertestek", "").render_dom(rnd).xml().to_string());
+	BOOST_CHECK_EQUAL(ctx.get("fallback").render(rnd).xml().to_string(), ctx.get("fallback").render_dom(rnd).xml().to_string());
+	std::string streamed;
+	ctx.get("fallback").insert("content", "innertestek", "").render(rnd, streamed);
+	BOOST_CHECK_EQUAL(streamed, inserted);
 }
 
 BOOST_AUTO_TEST_CASE(xslt) {
@@ -459,3 +471,1107 @@ BOOST_AUTO_TEST_CASE(xslt) {
 	const Glib::ustring sf2 = const_cast<xmlpp::Document*>(&f2.get_fragment().get_document())->write_to_string_formatted();
 	BOOST_CHECK_EQUAL(sf1, sf2);
 }
+
+BOOST_AUTO_TEST_CASE(expression_cache) {
+	BOOST_TEST_CHECKPOINT("Test 17: parsed expressions cache");
+
+	webpp::xml::render::context rnd;
+	auto e1 = webpp::xml::expressions::intern_expression("testval is true and testval2 = 42");
+	auto e2 = webpp::xml::expressions::intern_expression("testval is true and testval2 = 42");
+	BOOST_CHECK_EQUAL(e1.get(), e2.get());
+	BOOST_CHECK_THROW(webpp::xml::expressions::intern_expression("testval is"), std::runtime_error);
+
+	rnd.create_value("testval", true);
+	rnd.create_value("testval2", 42);
+	BOOST_CHECK_EQUAL(true, webpp::xml::expressions::evaluate_test_expression("testval is true and testval2 = 42", rnd));
+	rnd.create_value("testval2", 43);
+	BOOST_CHECK_EQUAL(false, webpp::xml::expressions::evaluate_test_expression("testval is true and testval2 = 42", rnd));
+}
+
+BOOST_AUTO_TEST_CASE(expression_compiled) {
+	BOOST_TEST_CHECKPOINT("Test 18: expressions compiled for stack machine");
+
+	webpp::xml::render::context rnd;
+	rnd.create_value("flag", true);
+	rnd.create_value("age", 18);
+	rnd.create_value("price", 2.5);
+	rnd.create_value("name", "asdf");
+	auto& array = rnd.create_array("users");
+	array.add().find("name").create_value("foo");
+	array.add().find("name").create_value("asdf");
+
+	const std::vector<std::string> tests {
+		"flag is true", "flag is not true and age >= 18", "age < 18 or flag is false", "not (age = 18)",
+		"price > 2.0", "name = 'asdf'", "name != 'asdf' or missing is null", "name in users as name", "'bar' in users as name",
+		"users.size() = 2", "users is not empty and (age > 10 and age <= 18)", "if flag is true then age else name"
+	};
+	for(const auto& i : tests) {
+		const auto& e = webpp::xml::expressions::intern_compiled_expression(i);
+		BOOST_CHECK_MESSAGE(!e.test_code().empty() || !e.value_code().empty(), "not compiled: " + i);
+		if(!e.test_code().empty())
+			BOOST_CHECK_EQUAL(e.evaluate(rnd), e.expression()->evaluate(rnd));
+	}
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_string_expression("if flag is true then age else name", rnd), "18");
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_string_expression("if age > 20 then age else name", rnd), "asdf");
+	// expressions resolved once are evaluated without global table
+	const auto& resolved = webpp::xml::expressions::intern_compiled_expression("age < 18 or flag is false");
+	BOOST_CHECK_EQUAL(resolved.source(), "age < 18 or flag is false");
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_test_expression(resolved, rnd), false);
+
+	// errors are reported by expression tree
+	texcept(webpp::xml::expressions::evaluate_test_expression("age is true", rnd), webpp::stacked_exception, "Expression error: render::value<i>::is_true(): '18' is not a boolean\n1. At token is_true(value = variable(age))\n");
+
+	// exceptions of lambdas are not caught by machine, lambda is not called again by tree
+	int calls = 0;
+	rnd.create_lambda("failing", [&calls]() -> bool { ++calls; throw std::runtime_error("lambda failed"); });
+	BOOST_CHECK_THROW(webpp::xml::expressions::evaluate_test_expression("failing is true", rnd), std::exception);
+	BOOST_CHECK_EQUAL(calls, 1);
+}
+
+BOOST_AUTO_TEST_CASE(typed_values) {
+	BOOST_TEST_CHECKPOINT("Test 19: typed values in expressions");
+
+	webpp::xml::render::context rnd;
+	rnd.create_value("age", 18);
+	rnd.create_value("price", 2.5);
+	rnd.create_value("name", Glib::ustring("asdf"));
+	rnd.create_lambda("lambda", [] { return Glib::ustring("qwer"); });
+
+	BOOST_CHECK(rnd.get("age").get_value().type() == webpp::xml::render::value_type::integer);
+	BOOST_CHECK_EQUAL(rnd.get("age").get_value().get_integer(), 18);
+	BOOST_CHECK(rnd.get("price").get_value().type() == webpp::xml::render::value_type::real);
+	BOOST_CHECK_EQUAL(rnd.get("price").get_value().get_real(), 2.5);
+	BOOST_CHECK(rnd.get("name").get_value().type() == webpp::xml::render::value_type::string);
+	BOOST_CHECK_EQUAL(rnd.get("name").get_value().get_string(), "asdf");
+	BOOST_CHECK(rnd.get("lambda").get_value().type() == webpp::xml::render::value_type::string);
+	BOOST_CHECK_EQUAL(rnd.get("lambda").get_value().get_string(), "qwer");
+
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("age >= 18 and price < 3.0 and name = 'asdf'", rnd));
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("age != 17 and price > 2.25 and lambda != name", rnd));
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_string_expression("price", rnd), "2.5");
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_string_expression("if age = 18 then 'x' else name", rnd), "x");
+	BOOST_CHECK_THROW(webpp::xml::expressions::evaluate_test_expression("name >= 18", rnd), std::exception);
+}
+
+BOOST_AUTO_TEST_CASE(constant_folding) {
+	BOOST_TEST_CHECKPOINT("Test 20: constant folding in fragments");
+
+	webpp::xml::context ctx(".");
+	webpp::xml::render::context rnd, constants;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+	ctx.create_constant("feature", true);
+	ctx.create_constant("limit", 10);
+
+	std::string folded;
+	BOOST_CHECK(bool(webpp::xml::expressions::fold_test_expression("1 = 1 and 'a' != 'b'", constants, folded)));
+	BOOST_CHECK(bool(!webpp::xml::expressions::fold_test_expression("1 = 1 and 'a' = 'b'", constants, folded)));
+	BOOST_CHECK(bool(boost::logic::indeterminate(webpp::xml::expressions::fold_test_expression("1 = 1 and (x is true or (y in list as name and not (z < 2.5)))", constants, folded))));
+	BOOST_CHECK_EQUAL(folded, "x is true or y in list as name and not (z < 2.5)");
+	BOOST_CHECK(bool(boost::logic::indeterminate(webpp::xml::expressions::fold_test_expression("1 = 2 or name = 'it\\'s a\\x2dz'", constants, folded))));
+	BOOST_CHECK_EQUAL(folded, "name = 'it\\'s a\\x2dz'");
+	rnd.create_value("name", Glib::ustring("it's a-z"));
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression(folded, rnd));
+	constants.create_value("separator", Glib::ustring("a-b"));
+	BOOST_CHECK(bool(boost::logic::indeterminate(webpp::xml::expressions::fold_test_expression("name != separator", constants, folded))));
+	BOOST_CHECK_EQUAL(folded, "name != 'a\\x2d\\x62'");
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression(folded, rnd));
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_string_expression("if 'a' = 'a' then 'yes' else 'no'", rnd), "yes");
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::intern_expression("if 'a' = 'a' then 'yes' else 'no'")->to_source(), "'yes'");
+	// operand which is not constant is kept, its errors are reported
+	BOOST_CHECK(bool(boost::logic::indeterminate(webpp::xml::expressions::fold_test_expression("missing.var = 1 or 1 = 1", constants, folded))));
+	BOOST_CHECK_EQUAL(folded, "missing.var = 1 or 1 = 1");
+	BOOST_CHECK(constants.lookup(webpp::xml::render::path("missing.var")) == nullptr);
+	BOOST_CHECK_THROW(webpp::xml::expressions::evaluate_test_expression("missing.var = 1 or 1 = 1", rnd), std::exception);
+	BOOST_CHECK_THROW(webpp::xml::expressions::evaluate_test_expression("missing.var = 1 and 1 = 0", rnd), std::exception);
+	BOOST_CHECK(bool(boost::logic::indeterminate(webpp::xml::expressions::fold_test_expression("x is true and 1 = 1", constants, folded))));
+	BOOST_CHECK_EQUAL(folded, "x is true");
+	// array constant has no value to substitute, expression is left for render
+	constants.create_array("choices").add().create_value(1);
+	BOOST_CHECK(bool(boost::logic::indeterminate(webpp::xml::expressions::fold_test_expression("name = choices", constants, folded))));
+	BOOST_CHECK_EQUAL(folded, "name = choices");
+	BOOST_CHECK(bool(boost::logic::indeterminate(webpp::xml::expressions::fold_test_expression("if 1 = 1 then choices else 'b'", constants, folded))));
+	BOOST_CHECK_EQUAL(folded, "choices");
+
+	ctx.put("testek", "<rootnode xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\"><b c:visible-if=\"feature is true\">A</b><i c:visible-if=\"feature is not true\">B<u c:visible-if=\"missing is true\"/></i><u c:visible-if=\"1 = 1 and count &gt; limit\">C</u></rootnode>");
+	const xmlpp::Element* root = ctx.get("testek").get_fragment().get_document().get_root_node();
+	BOOST_CHECK_EQUAL(root->get_children().size(), 2);
+	BOOST_CHECK(root->get_children().front()->get_name() == "b");
+	BOOST_CHECK(dynamic_cast<const xmlpp::Element*>(root->get_children().front())->get_attributes().empty());
+	BOOST_CHECK_EQUAL(dynamic_cast<const xmlpp::Element*>(root->get_children().back())->get_attributes().front()->get_value(), "count > '10'");
+
+	rnd.create_value("count", 9);
+	BOOST_CHECK_EQUAL(ctx.get("testek").render(rnd).xml().to_string(), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<rootnode><b>A</b><u>C</u></rootnode>\n");
+	rnd.create_value("count", 1);
+	BOOST_CHECK_EQUAL(ctx.get("testek").render(rnd).xml().to_string(), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<rootnode><b>A</b></rootnode>\n");
+
+	// root element is never removed
+	ctx.put("testek", "<rootnode xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" c:visible-if=\"feature is false\"/>");
+	texcept(ctx.get("testek").render(rnd), webpp::stacked_exception, "response resulted in empty document");
+
+	// outer repeat is not folded, its errors are reported
+	ctx.put("testek", "<rootnode xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\"><b c:repeat=\"outer\" c:repeat-array=\"items\" c:visible-if=\"feature is false\"/></rootnode>");
+	BOOST_CHECK_EQUAL(ctx.get("testek").get_fragment().get_document().get_root_node()->get_children().size(), 1);
+	texcept(ctx.get("testek").render(rnd), webpp::stacked_exception, "repeat attribute set, but repeat_variable or repeat_array is not set");
+}
+
+BOOST_AUTO_TEST_CASE(expression_in_index) {
+	BOOST_TEST_CHECKPOINT("Test 21: indexed 'in' operator");
+
+	webpp::xml::render::context rnd;
+	auto& users = rnd.create_array("users");
+	for(int i = 0; i < 100; ++i) {
+		auto& user = users.add();
+		user.find("name").create_value("user" + boost::lexical_cast<std::string>(i));
+		user.find("id").create_value(i);
+	}
+	rnd.create_value("name", Glib::ustring("user42"));
+
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("name in users as name", rnd));
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("'user99' in users as name", rnd));
+	BOOST_CHECK(!webpp::xml::expressions::evaluate_test_expression("'user100' in users as name", rnd));
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("42 in users as id", rnd));
+	BOOST_CHECK(!webpp::xml::expressions::evaluate_test_expression("100 in users as id", rnd));
+
+	// index is rebuilt after array or its elements change
+	users.add().find("name").create_value("user100");
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("'user100' in users as name", rnd));
+	users.elements().front()->find("name").create_value("root");
+	BOOST_CHECK(!webpp::xml::expressions::evaluate_test_expression("'user0' in users as name", rnd));
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("'root' in users as name", rnd));
+
+	// values which change outside render context are not indexed
+	int external = 7;
+	auto& refs = rnd.create_array("refs");
+	refs.add().find("v").create_value<const int, const int&>(external);
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("7 in refs as v", rnd));
+	external = 8;
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("8 in refs as v", rnd));
+
+	// element without value (last user has no id): found before it is reached, error otherwise
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("42 in users as id", rnd));
+	BOOST_CHECK_THROW(webpp::xml::expressions::evaluate_test_expression("100 in users as id", rnd), std::exception);
+}
+
+// value counting its conversions to string
+struct counted_output {
+	int* calls;
+};
+
+std::ostream& operator<<(std::ostream& os, const counted_output& v) {
+	++*v.calls;
+	return os << "x";
+}
+
+BOOST_AUTO_TEST_CASE(expression_memo) {
+	BOOST_TEST_CHECKPOINT("Test 22: memoized expressions");
+
+	webpp::xml::render::context rnd;
+	int calls = 0;
+	rnd.create_value("counted", counted_output { &calls });
+	for(int i = 0; i < 3; ++i)
+		BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("counted = 'x'", rnd));
+	BOOST_CHECK_EQUAL(calls, 1);
+
+	// rebinding loop variable recomputes only expressions using it
+	auto& items = rnd.create_array("items");
+	for(int i = 0; i < 4; ++i)
+		items.add().find("flag").create_value(i % 2 == 0);
+	int index = 0;
+	items.reset();
+	while(items.has_next()) {
+		rnd.import_subtree("item", items.next());
+		BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_test_expression("item.flag is true", rnd), index % 2 == 0);
+		BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("counted = 'x'", rnd));
+		++index;
+	}
+	BOOST_CHECK_EQUAL(calls, 1);
+
+	// modified values are recomputed
+	rnd.create_value("counted", counted_output { &calls });
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_string_expression("counted", rnd), "x");
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("counted = 'x'", rnd));
+	BOOST_CHECK_EQUAL(calls, 3);
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_string_expression("counted", rnd), "x");
+	BOOST_CHECK_EQUAL(calls, 3);
+
+	rnd.push_prefix("items");
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("counted is null", rnd));
+	rnd.pop_prefix();
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("counted is not null", rnd));
+
+	// clock is per context: reads and changes of other trees do not advance it
+	const std::size_t clock = rnd.clock();
+	webpp::xml::render::context other;
+	other.create_value("counted", 1);
+	rnd.get("not.yet.created");
+	BOOST_CHECK(webpp::xml::expressions::evaluate_test_expression("counted = 'x'", rnd));
+	BOOST_CHECK_EQUAL(rnd.clock(), clock);
+	rnd.create_value("unrelated", 1);
+	BOOST_CHECK(rnd.clock() != clock);
+	BOOST_CHECK_EQUAL(calls, 3);
+}
+
+BOOST_AUTO_TEST_CASE(repeat_invariants) {
+	BOOST_TEST_CHECKPOINT("Test 23: loop invariant expressions in repeats");
+
+	webpp::xml::context ctx(".");
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+
+	int calls = 0;
+	rnd.create_value("counted", counted_output { &calls });
+	rnd.create_value("title", Glib::ustring("t"));
+	auto& items = rnd.create_array("items");
+	for(int i = 0; i < 3; ++i)
+		items.add().find("name").create_value("n" + boost::lexical_cast<std::string>(i));
+
+	ctx.put("testek", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\">"
+			"<ul c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><f:li c:visible-if=\"counted != title\" f:title=\"#{counted}\">#{item.name}:#{item-index}</f:li></ul>"
+			"<f:p c:repeat=\"outer\" c:repeat-array=\"items\" c:repeat-variable=\"item\" c:visible-if=\"item-index != 1\">#{counted}#{item.name}</f:p></root>");
+	BOOST_CHECK_EQUAL(ctx.get("testek").render(rnd).xml().to_string(), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<root><ul><li title=\"x\">n0:0</li><li title=\"x\">n1:1</li><li title=\"x\">n2:2</li></ul><p>xn0</p><p>xn2</p></root>\n");
+	BOOST_CHECK_EQUAL(calls, 2); // once for c:visible-if, once for #{counted}
+	BOOST_CHECK(rnd.repeat_scopes().empty());
+
+	// referenced variables are not memoized, they are evaluated once per repeat only by hoisting
+	int reference_calls = 0;
+	const counted_output referenced { &reference_calls };
+	rnd.create_reference("referenced", referenced);
+	ctx.put("testek", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\"><ul c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><li>#{referenced}</li></ul></root>");
+	BOOST_CHECK_EQUAL(ctx.get("testek").render(rnd).xml().to_string(), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<root><ul><li>x</li><li>x</li><li>x</li></ul></root>\n");
+	BOOST_CHECK_EQUAL(reference_calls, 1);
+
+	// changes of context during repeat are not hidden by results of previous items
+	rnd.create_lambda("retitle", [&rnd] { rnd.create_value("title", Glib::ustring("u")); return Glib::ustring("!"); });
+	ctx.put("testek", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\">"
+			"<ul c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><f:li f:title=\"#{title}\">#{item.name}#{retitle}</f:li></ul></root>");
+	BOOST_CHECK_EQUAL(ctx.get("testek").render(rnd).xml().to_string(), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<root><ul><li title=\"t\">n0!</li><li title=\"u\">n1!</li><li title=\"u\">n2!</li></ul></root>\n");
+	rnd.create_value("title", Glib::ustring("t"));
+
+	// changes of imported subtrees and arrays do not advance clock of context, they are noticed too
+	webpp::xml::render::context other;
+	other.create_value("data.label", Glib::ustring("a"));
+	rnd.import_subtree("shared", other.get("data"));
+	rnd.create_lambda("relabel", [&other] { other.create_value("data.label", Glib::ustring("b")); return Glib::ustring("!"); });
+	rnd.create_lambda("append", [&items] { items.add().find("name").create_value(Glib::ustring("added")); return Glib::ustring("!"); });
+	ctx.put("testek", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\">"
+			"<ul c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><f:li f:title=\"#{shared.label}\">#{item.name}#{relabel}</f:li></ul>"
+			"<ol c:repeat=\"inner\" c:repeat-array=\"others\" c:repeat-variable=\"other\"><li c:visible-if=\"items.size() = 3\">#{append}</li></ol></root>");
+	auto& others = rnd.create_array("others");
+	others.add();
+	others.add();
+	BOOST_CHECK_EQUAL(ctx.get("testek").render(rnd).xml().to_string(), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<root><ul><li title=\"a\">n0!</li><li title=\"b\">n1!</li><li title=\"b\">n2!</li></ul><ol><li>!</li></ol></root>\n");
+
+	// repeat scope is closed on error
+	ctx.put("testek", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\"><ul c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><li c:visible-if=\"item.missing is true\"/></ul></root>");
+	BOOST_CHECK_THROW(ctx.get("testek").render(rnd), std::exception);
+	BOOST_CHECK(rnd.repeat_scopes().empty());
+}
+
+BOOST_AUTO_TEST_CASE(compiled_paths) {
+	BOOST_TEST_CHECKPOINT("Test 24: compiled variable paths");
+
+	using webpp::xml::render::path;
+	using webpp::xml::render::symbol;
+
+	const path p("user.address.city");
+	BOOST_CHECK_EQUAL(p.segments().size(), 3);
+	BOOST_CHECK_EQUAL(p.segments()[1].name, "address");
+	BOOST_CHECK(p.segments()[0] == symbol("user"));
+	BOOST_CHECK_EQUAL(p.segments()[0].hash, symbol::hash_of("user"));
+	BOOST_CHECK(path("").empty());
+	BOOST_CHECK_EQUAL(path("a.").segments().size(), 1);
+	BOOST_CHECK_EQUAL(path("a..b").segments().size(), 3);
+	const path joined(path("user"), path("address.city"));
+	BOOST_CHECK_EQUAL(joined.name(), "user.address.city");
+	BOOST_CHECK(joined.segments() == p.segments());
+
+	webpp::xml::render::context rnd;
+	rnd.create_value("user.address.city", Glib::ustring("Brno"));
+	BOOST_CHECK_EQUAL(&rnd.get(p), &rnd.get("user.address.city"));
+	BOOST_CHECK_EQUAL(&rnd.get(path("a..b")), &rnd.get("a..b"));
+	BOOST_CHECK_EQUAL(rnd.get(p).get_value().output(), "Brno");
+
+	rnd.push_prefix("user");
+	BOOST_CHECK_EQUAL(rnd.get(path("address.city")).get_value().output(), "Brno");
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_string_expression("address.city", rnd), "Brno");
+	rnd.push_prefix(path("address"));
+	BOOST_CHECK_EQUAL(rnd.current_prefix(), "user.address.");
+	BOOST_CHECK_EQUAL(rnd.get(path("city")).get_value().output(), "Brno");
+	rnd.pop_prefix();
+	BOOST_CHECK_EQUAL(rnd.current_prefix(), "user.");
+	rnd.pop_prefix();
+	BOOST_CHECK(rnd.get(path("address.city")).empty());
+}
+
+BOOST_AUTO_TEST_CASE(static_expressions) {
+	BOOST_TEST_CHECKPOINT("Test 25: expressions written in C++");
+
+	using namespace webpp::xml::expressions::statics;
+	webpp::xml::render::context rnd;
+	rnd.create_value("age", 21);
+	rnd.create_value("name", Glib::ustring("joe"));
+	rnd.create_value("ratio", 0.5);
+	rnd.create_value("admin", false);
+	rnd.create_value("copy", Glib::ustring("joe"));
+	auto& groups = rnd.create_array("groups");
+	groups.add().find("name").create_value(Glib::ustring("staff"));
+	groups.add().find("name").create_value(Glib::ustring("joe"));
+
+	BOOST_CHECK((var("age") >= 18).evaluate(rnd));
+	BOOST_CHECK(!(var("age") < 18).evaluate(rnd));
+	BOOST_CHECK((var("name") == "joe").evaluate(rnd));
+	BOOST_CHECK(("joe" == var("name")).evaluate(rnd));
+	BOOST_CHECK((var("name") == var("copy")).evaluate(rnd));
+	BOOST_CHECK((var("ratio") < 1.0).evaluate(rnd));
+	BOOST_CHECK((var("admin").is_not_true() && var("missing").is_null()).evaluate(rnd));
+	BOOST_CHECK((!var("admin").is_not_true() || var("groups").is_not_empty()).evaluate(rnd));
+	BOOST_CHECK(in(var("name"), var("groups"), "name").evaluate(rnd));
+	BOOST_CHECK(!in(std::string("root"), var("groups"), "name").evaluate(rnd));
+	BOOST_CHECK((var("age") > static_cast<short>(20)).evaluate(rnd));
+	BOOST_CHECK((var("age") == static_cast<unsigned char>(21)).evaluate(rnd));
+
+	// same results as parsed expressions
+	BOOST_CHECK_EQUAL(((var("age") > 20 && var("name") != "bob") || var("admin").is_true()).evaluate(rnd),
+		webpp::xml::expressions::evaluate_test_expression("((age > 20) and (name != 'bob')) or (admin is true)", rnd));
+	BOOST_CHECK_EQUAL((var("age") == "21").evaluate(rnd), webpp::xml::expressions::evaluate_test_expression("age = '21'", rnd));
+
+	BOOST_CHECK_THROW((var("missing") == 1).evaluate(rnd), std::runtime_error);
+	BOOST_CHECK_THROW(var("age").is_true().evaluate(rnd), std::exception);
+	BOOST_CHECK_THROW(in(1, var("age")).evaluate(rnd), std::runtime_error);
+
+	// operators are not candidates for other types
+	const std::string joe("joe");
+	BOOST_CHECK(joe == "joe");
+	BOOST_CHECK(std::vector<int>(1, 2) < std::vector<int>(1, 3));
+}
+
+BOOST_AUTO_TEST_CASE(expression_profiler) {
+	BOOST_TEST_CHECKPOINT("Test 26: expression profiler");
+
+	using webpp::xml::expressions::profiler;
+	webpp::xml::render::context rnd;
+	rnd.create_value("age", 21);
+
+	profiler::reset();
+	webpp::xml::expressions::evaluate_test_expression("age > 20", rnd);
+	BOOST_CHECK(profiler::results().empty());
+
+	profiler::enable();
+	for(int i = 0; i < 3; ++i)
+		webpp::xml::expressions::evaluate_test_expression("age > 20", rnd);
+	BOOST_CHECK_EQUAL(webpp::xml::expressions::evaluate_string_expression("age", rnd), "21");
+	BOOST_CHECK_THROW(webpp::xml::expressions::evaluate_test_expression("missing > 20", rnd), std::exception);
+	profiler::enable(false);
+
+	const profiler::results_t results = profiler::results();
+	BOOST_REQUIRE_EQUAL(results.size(), 3);
+	BOOST_CHECK_EQUAL(results.at("age > 20").evaluations, 3);
+	BOOST_CHECK_EQUAL(results.at("age > 20").exceptions, 0);
+	BOOST_CHECK_EQUAL(results.at("age").evaluations, 1);
+	BOOST_CHECK_EQUAL(results.at("missing > 20").exceptions, 1);
+
+	std::ostringstream report;
+	profiler::report(report, 2);
+	const std::string table = report.str();
+	BOOST_CHECK_EQUAL(std::count(table.begin(), table.end(), '\n'), 3);
+	profiler::reset();
+	BOOST_CHECK(profiler::results().empty());
+}
+
+BOOST_AUTO_TEST_CASE(format_tokens) {
+	BOOST_TEST_CHECKPOINT("Test 27: tokenized format strings");
+
+	using webpp::xml::taglib::format_string;
+	const format_string f("user #{user.name} - #{user.abuse|%.2f}!");
+	BOOST_REQUIRE_EQUAL(f.segments().size(), 5);
+	BOOST_CHECK(f.segments()[0].type == format_string::kind::literal);
+	BOOST_CHECK_EQUAL(f.segments()[0].text, "user ");
+	BOOST_CHECK(f.segments()[1].type == format_string::kind::expression);
+	BOOST_CHECK_EQUAL(f.segments()[1].name, "user.name");
+	BOOST_CHECK_EQUAL(f.segments()[1].expression, &webpp::xml::expressions::intern_compiled_expression("user.name"));
+	BOOST_CHECK(f.segments()[3].type == format_string::kind::formatted);
+	BOOST_CHECK_EQUAL(f.segments()[3].format.source(), "%.2f");
+	BOOST_CHECK_EQUAL(f.segments()[3].name, "user.abuse");
+	BOOST_CHECK_EQUAL(f.segments()[4].text, "!");
+	BOOST_CHECK(format_string("#{a").segments().back().type == format_string::kind::error);
+	BOOST_CHECK_EQUAL(&format_string::intern("#{a}"), &format_string::intern("#{a}"));
+
+	webpp::xml::render::context rnd;
+	rnd.create_value("user.name", Glib::ustring("joe"));
+	rnd.create_value("user.abuse", 0.5);
+	BOOST_CHECK_EQUAL(f.render(rnd), "user joe - 0.50!");
+	BOOST_CHECK_EQUAL(format_string("plain").render(rnd), "plain");
+	BOOST_CHECK_EQUAL(format_string("zażółć #{user.name} gęślą jaźń #{user.abuse|%.1f} Ёж").render(rnd), "zażółć joe gęślą jaźń 0.5 Ёж");
+	BOOST_CHECK_THROW(format_string("#{user.name} #{x|}").render(rnd), std::runtime_error);
+	BOOST_CHECK(format_string("#{(}").segments()[0].expression == nullptr);
+	BOOST_CHECK_THROW(format_string("#{(}").render(rnd), std::exception);
+}
+
+BOOST_AUTO_TEST_CASE(format_specs) {
+	BOOST_TEST_CHECKPOINT("Test 28: compiled format specs");
+
+	using webpp::xml::render::format_spec;
+	using webpp::xml::render::value;
+	const value<double> price(1234.5678);
+	const value<int> count(-42), mask(255);
+	const value<Glib::ustring> name("zażółć");
+	auto write = [](const format_spec& spec, const webpp::xml::render::value_base& v) { std::string out; spec.write(v, out); return out; };
+
+	BOOST_CHECK(format_spec("%.2f zl").compiled());
+	BOOST_CHECK_EQUAL(write(format_spec("%.2f zl"), price), "1234.57 zl");
+	BOOST_CHECK_EQUAL(write(format_spec("%10.1e"), price), "   1.2e+03");
+	BOOST_CHECK_EQUAL(write(format_spec("[%-6d]"), count), "[-42   ]");
+	BOOST_CHECK_EQUAL(write(format_spec("%06d"), count), "-00042");
+	BOOST_CHECK_EQUAL(write(format_spec("%#x 100%%"), mask), "0xff 100%");
+	BOOST_CHECK_EQUAL(write(format_spec("<%s>"), name), "<zażółć>");
+
+	// not compiled or not matching value type, same output as boost::format
+	BOOST_CHECK(!format_spec("%1%").compiled());
+	BOOST_CHECK_EQUAL(write(format_spec("%1%"), count), "-42");
+	BOOST_CHECK_EQUAL(write(format_spec("%.2f"), count), (boost::format("%.2f") % -42).str());
+	BOOST_CHECK_EQUAL(write(format_spec("%x"), count), (boost::format("%x") % -42).str());
+	BOOST_CHECK_EQUAL(write(format_spec("%d"), price), (boost::format("%d") % 1234.5678).str());
+	BOOST_CHECK_THROW(write(format_spec("%d %d"), count), std::exception);
+
+	// decimal point does not follow C locale (checked only where such locale is installed)
+	for(const char* name : { "de_DE.UTF-8", "cs_CZ.UTF-8", "fr_FR.UTF-8" }) {
+		if(std::setlocale(LC_NUMERIC, name) == nullptr)
+			continue;
+		BOOST_CHECK_EQUAL(write(format_spec("%.2f zl"), price), "1234.57 zl");
+		BOOST_CHECK_EQUAL(write(format_spec("%10.1e"), price), "   1.2e+03");
+		std::setlocale(LC_NUMERIC, "C");
+		break;
+	}
+}
+
+// taglib with one tag, which writes which version of taglib rendered it
+template<int Version>
+struct versioned_taglib {
+	struct version : webpp::xml::tag {
+		virtual void render(xmlpp::Element* dst, const xmlpp::Element*, webpp::xml::render::context&) const {
+			dst->set_name("v");
+			dst->add_child_text(boost::lexical_cast<std::string>(Version));
+		}
+	};
+
+	template<typename TagsT, typename XmlnsesT>
+	static void process(TagsT& tags, XmlnsesT&) {
+		tags[std::make_pair(Glib::ustring("webpp://test"), Glib::ustring("version"))].reset(new version);
+	}
+};
+
+BOOST_AUTO_TEST_CASE(fragment_node_info) {
+	BOOST_TEST_CHECKPOINT("Test 29: interned namespaces and control attributes");
+
+	using webpp::xml::namespace_id;
+	using webpp::xml::control_id;
+	BOOST_CHECK(webpp::xml::intern_namespace("") == namespace_id::none);
+	BOOST_CHECK(webpp::xml::intern_namespace("webpp://html5") == namespace_id::html5);
+	BOOST_CHECK(webpp::xml::intern_namespace("webpp://control") == namespace_id::control);
+	BOOST_CHECK(webpp::xml::intern_namespace("webpp://format") == namespace_id::custom);
+	BOOST_CHECK(webpp::xml::intern_namespace("http://www.w3.org/2000/svg") == namespace_id::foreign);
+
+	webpp::xml::context ctx(".");
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+	ctx.put("testek", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\">"
+			"<ul id=\"list\" c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><li c:repeat-once=\"yes\" f:title=\"#{item}\">x</li></ul><f:text c:visible-if=\"item = 1\">t</f:text></root>");
+	const webpp::xml::fragment& fragment = ctx.get("testek").get_fragment();
+	const xmlpp::Element* root = fragment.get_document().get_root_node();
+	BOOST_REQUIRE_EQUAL(fragment.info(root).children.size(), 2);
+
+	const xmlpp::Element* ul = dynamic_cast<const xmlpp::Element*>(fragment.info(root).children.front());
+	const auto& ul_info = fragment.info(ul);
+	BOOST_CHECK(ul_info.ns == namespace_id::xml);
+	BOOST_CHECK(ul_info.has_id);
+	BOOST_CHECK_EQUAL(ul_info.id, "list");
+	BOOST_REQUIRE_EQUAL(ul_info.attributes.size(), 4);
+	BOOST_CHECK(ul_info.attributes[1].control == control_id::repeat);
+	BOOST_CHECK(ul_info.attributes[2].control == control_id::repeat_array);
+
+	const auto& li_info = fragment.info(dynamic_cast<const xmlpp::Element*>(ul_info.children.front()));
+	BOOST_CHECK(li_info.repeat_once);
+	BOOST_CHECK(li_info.attributes[1].ns == namespace_id::custom);
+	BOOST_CHECK(li_info.attributes[1].handler != nullptr);
+	BOOST_CHECK(li_info.attributes[1].compiled != nullptr); // tokenized format
+	BOOST_CHECK(li_info.attributes[0].compiled == nullptr);
+
+	const auto& text_info = fragment.info(dynamic_cast<const xmlpp::Element*>(fragment.info(root).children.back()));
+	BOOST_CHECK(text_info.ns == namespace_id::custom);
+	BOOST_CHECK(text_info.xmlns_handler != nullptr);
+	BOOST_CHECK(text_info.tag_handler == nullptr);
+	BOOST_CHECK(text_info.compiled != nullptr);
+	BOOST_REQUIRE_EQUAL(text_info.attributes.size(), 1);
+	BOOST_CHECK(text_info.attributes[0].control == control_id::visible_if);
+	BOOST_CHECK_EQUAL(text_info.attributes[0].expression, &webpp::xml::expressions::intern_compiled_expression("item = 1"));
+	BOOST_CHECK(li_info.attributes[0].expression == nullptr);
+
+	// handlers replaced by taglib loaded later are not used by loaded fragments
+	ctx.load_taglib<versioned_taglib<1>>();
+	ctx.put("versioned", "<root xmlns=\"webpp://xml\" xmlns:t=\"webpp://test\"><t:version/></root>");
+	webpp::xml::render::context rnd;
+	std::string streamed;
+	ctx.get("versioned").render(rnd, streamed);
+	BOOST_CHECK_EQUAL(streamed, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<root><v>1</v></root>\n");
+	ctx.load_taglib<versioned_taglib<2>>();
+	BOOST_CHECK_EQUAL(ctx.get("versioned").render(rnd).to_string(), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<root><v>2</v></root>\n");
+	streamed.clear();
+	ctx.get("versioned").render(rnd, streamed);
+	BOOST_CHECK_EQUAL(streamed, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<root><v>2</v></root>\n");
+	BOOST_CHECK_EQUAL(ctx.get("versioned").render_dom(rnd).to_string(), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<root><v>2</v></root>\n");
+}
+
+BOOST_AUTO_TEST_CASE(fragment_program) {
+	BOOST_TEST_CHECKPOINT("Test 30: fragment program renders the same output as DOM walk");
+
+	webpp::xml::context ctx(".");
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+
+	ctx.put("testek", "<!-- before --><root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\" xmlns:h=\"webpp://html5\">"
+			"<p c:visible-if=\"flag is true\">shown</p><p c:visible-if=\"flag is not true\">hidden</p>"
+			"<ul c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><li c:repeat-once=\"yes\">head</li><f:li f:title=\"#{item.name}\">#{item-index}: #{item.name}</f:li></ul>"
+			"<div c:repeat=\"outer\" c:repeat-array=\"items\" c:repeat-variable=\"item\" c:visible-if=\"item.level &gt; 1\" f:class=\"l#{item.level}\"><c:insert name=\"inner\" value-prefix=\"item\" /></div>"
+			"<h:section id=\"content\" /><span id=\"missing\">x</span></root><!-- after -->");
+	ctx.put("inner", "<f:b xmlns=\"webpp://xml\" xmlns:f=\"webpp://format\" xmlns:c=\"webpp://control\" c:visible-if=\"name != 'skipped'\">#{name}</f:b>");
+
+	rnd.create_value("flag", true);
+	rnd.create_value("featured.name", std::string("featured"));
+	auto& items = rnd.create_array("items");
+	const char* names[] = { "first", "skipped", "third" };
+	for(int i = 0; i < 3; ++i) {
+		auto& item = items.add();
+		item.find("name").create_value(std::string(names[i]));
+		item.find("level").create_value(i + 1);
+	}
+
+	auto program = ctx.get("testek").insert("content", "inner", "featured").render(rnd).xml().to_string();
+	BOOST_CHECK_EQUAL(program, ctx.get("testek").insert("content", "inner", "featured").render_dom(rnd).xml().to_string());
+	BOOST_CHECK_EQUAL(ctx.get("testek").render(rnd).xml().to_string(), ctx.get("testek").render_dom(rnd).xml().to_string());
+	BOOST_CHECK(program.find("<div class=\"l2\"/><div class=\"l3\"><b>third</b></div>") != std::string::npos);
+
+	// errors are the same too
+	ctx.put("testek", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" c:visible-if=\"flag is not true\"/>");
+	texcept(ctx.get("testek").render(rnd), webpp::stacked_exception, "response resulted in empty document");
+	texcept(ctx.get("testek").render_dom(rnd), webpp::stacked_exception, "response resulted in empty document");
+	ctx.put("testek", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\"><p c:repeat=\"sideways\"/></root>");
+	texcept(ctx.get("testek").render(rnd), webpp::stacked_exception, "repeat must be one of (inner,outer), not 'sideways' in line '1', tag 'p'");
+	texcept(ctx.get("testek").render_dom(rnd), webpp::stacked_exception, "repeat must be one of (inner,outer), not 'sideways' in line '1', tag 'p'");
+}
+
+// taglib with handlers which know only output document
+struct dom_only_taglib {
+	struct badge : webpp::xml::tag {
+		virtual void render(xmlpp::Element* dst, const xmlpp::Element* src, webpp::xml::render::context& ctx) const {
+			dst->set_name("span");
+			dst->set_attribute("class", "badge " + src->get_attribute("kind")->get_value());
+			dst->add_child_text(ctx.get("user.name").get_value().output() + " & co");
+			dst->add_child("i")->set_attribute("title", "<\"quoted\">");
+		}
+	};
+
+	struct inline_text : webpp::xml::tag {
+		virtual void render(xmlpp::Element* dst, const xmlpp::Element*, webpp::xml::render::context&) const {
+			xmlpp::Element* parent = dst->get_parent();
+			parent->remove_child(dst);
+			parent->add_child_text("[inline]");
+		}
+	};
+
+	template<typename TagsT, typename XmlnsesT>
+	static void process(TagsT& tags, XmlnsesT&) {
+		tags[std::make_pair(Glib::ustring("webpp://test"), Glib::ustring("badge"))].reset(new badge);
+		tags[std::make_pair(Glib::ustring("webpp://test"), Glib::ustring("inline"))].reset(new inline_text);
+	}
+};
+
+BOOST_AUTO_TEST_CASE(streamed_render) {
+	BOOST_TEST_CHECKPOINT("Test 31: streamed render writes the same text as output document");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+	ctx.load_taglib<dom_only_taglib>();
+
+	rnd.create_value("user.name", std::string("a<b>&\"c' \t\r\n zażółć ]]>"));
+	auto& items = rnd.create_array("items");
+	for(int i = 0; i < 3; ++i)
+		items.add().find("level").create_value(i);
+
+	auto compare = [&](const std::string& name, const int encoding) {
+		std::string streamed;
+		ctx.get(name).render(rnd, streamed, encoding);
+		auto output = ctx.get(name).render(rnd);
+		BOOST_CHECK_EQUAL(streamed, encoding ? output.xhtml5(encoding).to_string() : output.to_string());
+	};
+
+	ctx.put("escaping", "<!DOCTYPE root [<!ENTITY foo \"bar\">]><!-- before --><root xmlns=\"webpp://xml\" xmlns:f=\"webpp://format\" a=\"x&amp;y&lt;&gt;&quot;'\t&#10;\">"
+			"<f:p f:title=\"#{user.name}\">#{user.name}<!-- #{user.name} --><![CDATA[#{user.name}]]></f:p>x &foo; &amp; &#13; <![CDATA[ <&> ]]><!-- c --><?pi data?>"
+			"<e/><e><!-- only comment --></e><f:text>#{user.name}</f:text><f:p/></root><!-- after -->");
+	compare("escaping", 0);
+	compare("escaping", webpp::xml::fragment_output::REMOVE_COMMENTS);
+
+	// namespaces are declared at root, after its start was written
+	ctx.put("namespaces", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" xmlns:h=\"webpp://html5\" id=\"r\">text"
+			"<p c:repeat=\"outer\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><s:svg xmlns:s=\"http://www.w3.org/2000/svg\" c:visible-if=\"item.level &gt; 0\"/></p>"
+			"<h:div/><s:g xmlns:s=\"http://www.w3.org/2000/svg\"/></root>");
+	compare("namespaces", 0);
+
+	// handlers without streamed variant render to temporary element
+	ctx.put("handlers", "<root xmlns=\"webpp://xml\" xmlns:t=\"webpp://test\"><t:badge kind=\"gold\"/><p><t:inline/></p>x<t:inline/></root>");
+	compare("handlers", 0);
+
+	compare("boilerplate", webpp::xml::fragment_output::DOCTYPE | webpp::xml::fragment_output::REMOVE_XML_DECLARATION);
+	compare("boilerplate", webpp::xml::fragment_output::DOCTYPE | webpp::xml::fragment_output::REMOVE_XML_DECLARATION | webpp::xml::fragment_output::REMOVE_COMMENTS);
+
+	// view insertions and errors
+	ctx.put("inner", "<f:b xmlns=\"webpp://xml\" xmlns:f=\"webpp://format\" id=\"own\">#{name}</f:b>");
+	ctx.put("outer", "<root xmlns=\"webpp://xml\"><div id=\"content\" class=\"c\"/></root>");
+	rnd.create_value("view.name", std::string("view"));
+	std::ostringstream streamed;
+	ctx.get("outer").insert("content", "inner", "view").render(rnd, streamed);
+	BOOST_CHECK_EQUAL(streamed.str(), ctx.get("outer").insert("content", "inner", "view").render(rnd).to_string());
+
+	std::string ignored;
+	ctx.put("invisible", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" c:visible-if=\"items is empty\"/>");
+	texcept(ctx.get("invisible").render(rnd, ignored), webpp::stacked_exception, "response resulted in empty document");
+	ctx.put("conflict", "<root xmlns=\"webpp://html5\"><p xmlns=\"http://example.org/foreign\"/></root>");
+	texcept(ctx.get("conflict").render(rnd, ignored), webpp::stacked_exception, "Could not add namespace declaration with URI=http://example.org/foreign, prefix=");
+}
+
+BOOST_AUTO_TEST_CASE(static_blobs) {
+	BOOST_TEST_CHECKPOINT("Test 32: static subtrees are serialized when fragment is loaded");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+
+	// whole content of static root is one blob
+	const auto& boilerplate = ctx.get("boilerplate").get_fragment().get_program();
+	BOOST_REQUIRE_EQUAL(boilerplate.blobs.size(), 1u);
+	BOOST_CHECK(boilerplate.blobs[0].html5);
+	BOOST_CHECK(boilerplate.blobs[0].content.find("<script src=\"js/main.js\"/>") != std::string::npos);
+	BOOST_CHECK(boilerplate.blobs[0].without_comments.find("<!--") == std::string::npos);
+
+	// dynamic elements split static children into blobs, static parts of dynamic elements are blobs too
+	ctx.put("mixed", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\" xmlns:h=\"webpp://html5\">"
+			"<head><title>static &amp; <b>bold</b></title><!-- comment --></head>"
+			"<ul c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><li>item</li><f:li>#{item.name}</f:li><li><!-- only comment --></li></ul>"
+			"<p id=\"content\">inserted</p><h:footer><h:p>#{not.formatted}</h:p></h:footer></root>");
+	const auto& mixed = ctx.get("mixed").get_fragment().get_program();
+	BOOST_REQUIRE_EQUAL(mixed.blobs.size(), 5u);
+	BOOST_CHECK_EQUAL(mixed.blobs[0].content, "<head><title>static &amp; <b>bold</b></title><!-- comment --></head>");
+	BOOST_CHECK_EQUAL(mixed.blobs[0].without_comments, "<head><title>static &amp; <b>bold</b></title></head>");
+	BOOST_CHECK_EQUAL(mixed.blobs[1].content, "<li>item</li>");
+	BOOST_CHECK_EQUAL(mixed.blobs[2].without_comments, "<li/>");
+	BOOST_CHECK_EQUAL(mixed.blobs[3].content, "inserted");
+	BOOST_CHECK_EQUAL(mixed.blobs[4].content, "<footer><p>#{not.formatted}</p></footer>");
+	BOOST_CHECK(mixed.blobs[4].html5 && !mixed.blobs[0].html5);
+
+	auto& items = rnd.create_array("items");
+	items.add().find("name").create_value(std::string("first"));
+	items.add().find("name").create_value(std::string("second"));
+	ctx.put("inner", "<b xmlns=\"webpp://xml\">view</b>");
+	for(const int encoding : { 0, static_cast<int>(webpp::xml::fragment_output::REMOVE_COMMENTS) }) {
+		std::string streamed;
+		ctx.get("mixed").insert("content", "inner", "view").render(rnd, streamed, encoding);
+		auto output = ctx.get("mixed").insert("content", "inner", "view").render(rnd);
+		BOOST_CHECK_EQUAL(streamed, encoding ? output.xhtml5(encoding).to_string() : output.to_string());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(chunked_render) {
+	BOOST_TEST_CHECKPOINT("Test 33: chunked output refers to static blobs of fragment");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+
+	const std::string table(200, 'x');
+	// svg namespace is declared at root after static chunk is added
+	ctx.put("chunked", "<root xmlns=\"webpp://xml\" xmlns:f=\"webpp://format\"><f:h1>#{title}</f:h1><div class=\"static\">" + table + "</div>"
+			"<p>short</p><f:p f:title=\"#{title}\"/><s:svg xmlns:s=\"http://www.w3.org/2000/svg\"/><div>" + table + "</div></root>");
+	rnd.create_value("title", std::string("<chunked>"));
+
+	std::string expected;
+	ctx.get("chunked").render(rnd, expected);
+	webpp::xml::chunked_output output;
+	for(int round = 0; round < 2; ++round) {
+		output.clear();
+		ctx.get("chunked").render(rnd, output);
+		BOOST_CHECK_EQUAL(output.to_string(), expected);
+		BOOST_CHECK_EQUAL(output.size(), expected.size());
+	}
+
+	// long blobs are not copied, short ones are part of dynamic chunks
+	const auto& blobs = ctx.get("chunked").get_fragment().get_program().blobs;
+	std::size_t references = 0;
+	for(const auto& c : output.chunks()) {
+		for(const auto& blob : blobs) {
+			if(c.data == blob.content.data()) {
+				BOOST_CHECK_EQUAL(c.size, blob.content.size());
+				BOOST_CHECK(blob.content.size() >= webpp::xml::chunked_output::min_static_chunk);
+				++references;
+			}
+		}
+	}
+	BOOST_CHECK_EQUAL(output.chunks().size(), 5u); // dynamic chunks around two static ones
+	BOOST_CHECK_EQUAL(references, 2u);
+	BOOST_CHECK(output.chunks()[0].size < 200 && std::string(output.chunks()[0].data, output.chunks()[0].size).find("xmlns:s=") != std::string::npos);
+
+	// static chunks stay valid when their fragment is replaced
+	ctx.put("chunked", "<root xmlns=\"webpp://xml\"/>");
+	BOOST_CHECK_EQUAL(output.to_string(), expected);
+
+	std::ostringstream stream;
+	ctx.get("boilerplate").render(rnd, stream, webpp::xml::fragment_output::DOCTYPE);
+	BOOST_CHECK_EQUAL(stream.str(), ctx.get("boilerplate").render(rnd).xhtml5(webpp::xml::fragment_output::DOCTYPE).to_string());
+}
+
+BOOST_AUTO_TEST_CASE(progressive_render) {
+	BOOST_TEST_CHECKPOINT("Test 34: progressive render passes output to sink in parts");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+
+	ctx.put("list", "<html xmlns=\"webpp://html5\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\"><head><title>list</title></head>"
+			"<body><ul><f:li c:repeat=\"outer\" c:repeat-array=\"items\" c:repeat-variable=\"item\">#{item.name}</f:li></ul>"
+			"<p c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><f:span f:title=\"#{item-index}\">#{item.name}</f:span></p></body></html>");
+	auto& items = rnd.create_array("items");
+	for(int i = 0; i < 1000; ++i)
+		items.add().find("name").create_value("item " + boost::lexical_cast<std::string>(i));
+
+	std::string expected;
+	ctx.get("list").render(rnd, expected, webpp::xml::fragment_output::DOCTYPE);
+	std::vector<std::string> parts;
+	std::string joined;
+	std::size_t largest = 0;
+	ctx.get("list").render(rnd, [&](boost::string_ref part) {
+		parts.push_back(part.to_string());
+		joined += parts.back();
+		largest = std::max(largest, part.size());
+	}, 1024, webpp::xml::fragment_output::DOCTYPE);
+	BOOST_CHECK_EQUAL(joined, expected);
+	BOOST_CHECK(parts.size() > 10);
+	BOOST_CHECK(largest < 2048);
+	// content before repeat is passed first
+	BOOST_CHECK(parts[0].find("<title>list</title>") != std::string::npos && parts[0].find("item 0") == std::string::npos);
+
+	// namespace used after root was passed is declared where it is used
+	ctx.put("late", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\"><p c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\">x</p>"
+			"<s:svg xmlns:s=\"http://www.w3.org/2000/svg\"><s:g/></s:svg><s:svg xmlns:s=\"http://www.w3.org/2000/svg\"/></root>");
+	std::string late;
+	ctx.get("late").render(rnd, [&](boost::string_ref part) { late.append(part.data(), part.size()); }, 64);
+	BOOST_CHECK(late.find("<root><p>") != std::string::npos);
+	BOOST_CHECK(late.find("<s:svg xmlns:s=\"http://www.w3.org/2000/svg\"><s:g/></s:svg><s:svg xmlns:s=\"http://www.w3.org/2000/svg\"/></root>") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(output_cache) {
+	BOOST_TEST_CHECKPOINT("Test 35: output cache reuses text rendered from the same values");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+	ctx.enable_output_cache(600);
+	ctx.put("cached", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\">"
+			"<f:p c:visible-if=\"user.admin is true\">#{user.name}</f:p>"
+			"<f:li c:repeat=\"outer\" c:repeat-array=\"items\" c:repeat-variable=\"item\">#{item-index}: #{item}</f:li><div id=\"content\"/></root>");
+	ctx.put("inner", "<f:b xmlns:f=\"webpp://format\">#{name}</f:b>");
+	const auto& stats = ctx.get_output_cache()->stats();
+
+	auto fill = [](webpp::xml::render::context& rnd, const bool admin, const std::string& name, const int items) {
+		rnd.create_value("user.admin", admin);
+		rnd.create_value("user.name", std::string(name));
+		rnd.create_value("user.email", std::string("unused@example.org"));
+		auto& array = rnd.create_array("items");
+		for(int i = 0; i < items; ++i)
+			array.add().create_value(i * 10);
+	};
+	auto render = [&](webpp::xml::render::context& rnd) {
+		std::string output;
+		ctx.get("cached").render(rnd, output);
+		BOOST_CHECK_EQUAL(output, ctx.get("cached").render(rnd).to_string().raw());
+		return output;
+	};
+
+	webpp::xml::render::context first, second, third;
+	fill(first, true, "admin", 2);
+	const std::string output = render(first);
+	BOOST_CHECK_EQUAL(stats.misses, 1u);
+	// the same values read in other context, value which is not read differs
+	fill(second, true, "admin", 2);
+	second.create_value("user.email", std::string("other@example.org"));
+	BOOST_CHECK_EQUAL(render(second), output);
+	BOOST_CHECK_EQUAL(stats.hits, 1u);
+	// array item differs
+	fill(third, true, "admin", 2);
+	auto& items = third.get("items").get_array();
+	items.reset();
+	items.next().create_value(99);
+	render(third);
+	BOOST_CHECK_EQUAL(stats.misses, 2u);
+
+	// other branch reads other values
+	webpp::xml::render::context guest1, guest2;
+	fill(guest1, false, "guest", 1);
+	fill(guest2, false, "other name is not read", 1);
+	BOOST_CHECK_EQUAL(render(guest1), render(guest2));
+	BOOST_CHECK_EQUAL(stats.misses, 3u);
+	BOOST_CHECK_EQUAL(stats.hits, 2u);
+	BOOST_CHECK_EQUAL(stats.entries, 3u);
+
+	// view insertions are part of key, their values are read with prefix
+	std::string view1, view2;
+	first.create_value("featured.name", std::string("featured"));
+	ctx.get("cached").insert("content", "inner", "featured").render(first, view1);
+	second.create_value("featured.name", std::string("changed"));
+	ctx.get("cached").insert("content", "inner", "featured").render(second, view2);
+	BOOST_CHECK(view1.find("<b id=\"content\">featured</b>") != std::string::npos && view2.find("<b id=\"content\">changed</b>") != std::string::npos);
+	BOOST_CHECK_EQUAL(stats.misses, 5u);
+
+	// least recently used outputs are dropped to fit size limit
+	BOOST_CHECK(stats.bytes <= 600 && stats.entries < 5);
+	ctx.put("other", "<root/>");
+	BOOST_CHECK_EQUAL(stats.entries, 0u);
+	BOOST_CHECK_EQUAL(stats.bytes, 0u);
+
+	// results remembered by earlier render of the same context do not hide its reads from the key
+	webpp::xml::render::context rendered, other_user;
+	fill(rendered, true, "rendered", 1);
+	ctx.get("cached").render(rendered);
+	std::string rendered_output, other_output;
+	ctx.get("cached").render(rendered, rendered_output);
+	fill(other_user, true, "other user", 1);
+	ctx.get("cached").render(other_user, other_output);
+	BOOST_CHECK(rendered_output.find("<p>rendered</p>") != std::string::npos);
+	BOOST_CHECK(other_output.find("<p>other user</p>") != std::string::npos);
+	BOOST_CHECK_EQUAL(stats.hits, 2u);
+
+	// entries are matched by stored values, not only by their hashes
+	using webpp::xml::render::path;
+	webpp::xml::render::context left, right;
+	left.create_value("user.id", 1);
+	left.create_value("user.name", std::string("1"));
+	right.create_value("user.name", std::string("1"));
+	right.create_value("user.id", 1);
+	std::string left_values, right_values;
+	left.get(path("user")).serialize(left_values);
+	right.get(path("user")).serialize(right_values);
+	BOOST_CHECK_EQUAL(left_values, right_values);
+	right.create_value("user.id", std::string("1"));
+	right_values.clear();
+	right.get(path("user")).serialize(right_values);
+	BOOST_CHECK(left_values != right_values);
+}
+
+BOOST_AUTO_TEST_CASE(insert_cache) {
+	BOOST_TEST_CHECKPOINT("Test 36: insert cache reuses inserted fragments rendered from the same values");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+	ctx.enable_insert_cache(4096);
+	ctx.put("list", "<html xmlns=\"webpp://html5\" xmlns:c=\"webpp://control\"><body>"
+			"<div c:repeat=\"outer\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><c:insert name=\"card\" value-prefix=\"item\" /></div>"
+			"<div id=\"content\"/></body></html>");
+	ctx.put("card", "<div xmlns=\"webpp://html5\" xmlns:f=\"webpp://format\" xmlns:c=\"webpp://control\" xmlns:s=\"http://www.w3.org/2000/svg\""
+			" c:visible-if=\"visible is true\"><f:p f:class=\"#{kind}\">#{name}</f:p><s:svg><s:circle/></s:svg></div>");
+	const auto& stats = ctx.get_insert_cache()->stats();
+
+	auto& items = rnd.create_array("items");
+	for(int i = 0; i < 6; ++i) {
+		auto& item = items.add();
+		item.find("visible").create_value(i != 4);
+		item.find("name").create_value(std::string(i == 2 ? "changed" : "card"));
+		item.find("kind").create_value(std::string("plain"));
+	}
+	rnd.create_value("view.visible", true);
+	rnd.create_value("view.name", std::string("featured"));
+	rnd.create_value("view.kind", std::string("view"));
+
+	for(const int encoding : { 0, static_cast<int>(webpp::xml::fragment_output::REMOVE_COMMENTS) }) {
+		std::string cached;
+		ctx.get("list").insert("content", "card", "view").render(rnd, cached, encoding);
+		auto output = ctx.get("list").insert("content", "card", "view").render(rnd);
+		BOOST_CHECK_EQUAL(cached, encoding ? output.xhtml5(encoding).to_string() : output.to_string());
+	}
+	// identical rows are rendered once, changed and invisible rows have own entries
+	BOOST_CHECK_EQUAL(stats.misses, 8u);
+	BOOST_CHECK_EQUAL(stats.hits, 6u);
+
+	// values read by inserted fragment are compared
+	rnd.get("view.name").create_value(std::string("other"));
+	std::string changed;
+	ctx.get("list").insert("content", "card", "view").render(rnd, changed);
+	BOOST_CHECK(changed.find(">other<") != std::string::npos);
+	BOOST_CHECK_EQUAL(stats.misses, 9u);
+
+	// hashing array read by inserted fragment does not move cursor of repeat over it
+	ctx.put("count", "<f:span xmlns:f=\"webpp://format\" xmlns:c=\"webpp://control\" c:visible-if=\"items is not empty\">#{view.kind}</f:span>");
+	ctx.put("rows", "<ul xmlns=\"webpp://html5\" xmlns:c=\"webpp://control\">"
+			"<li c:repeat=\"outer\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><c:insert name=\"count\" value-prefix=\"\" /></li></ul>");
+	const std::size_t hits = stats.hits;
+	std::string rows;
+	ctx.get("rows").render(rnd, rows);
+	std::size_t spans = 0;
+	for(std::size_t i = rows.find("view</span>"); i != std::string::npos; i = rows.find("view</span>", i + 1))
+		++spans;
+	BOOST_CHECK_EQUAL(spans, 6u);
+	BOOST_CHECK_EQUAL(stats.hits, hits + 5);
+
+	ctx.put("other", "<root/>");
+	BOOST_CHECK_EQUAL(stats.entries, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(bound_insertions) {
+	BOOST_TEST_CHECKPOINT("Test 37: prepared fragment binds insertions once and renders them again");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+	ctx.put("page", "<root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\"><div id=\"header\"/>"
+			"<p c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><c:insert name=\"item\" value-prefix=\"item\" /></p><div id=\"footer\"/></root>");
+	ctx.put("item", "<f:i xmlns:f=\"webpp://format\">#{name}</f:i>");
+	ctx.put("header", "<h xmlns=\"webpp://xml\"><div id=\"menu\"/></h>");
+	ctx.put("menu", "<f:m xmlns:f=\"webpp://format\">#{title}</f:m>");
+	auto& items = rnd.create_array("items");
+	items.add().find("name").create_value(std::string("first"));
+	items.add().find("name").create_value(std::string("second"));
+	rnd.create_value("menu.title", std::string("menu"));
+
+	auto page = ctx.get("page");
+	page.insert("header", "header", "").insert("menu", "menu", "menu");
+	const std::string expected = page.render_dom(rnd).to_string();
+	BOOST_CHECK(expected.find("<h id=\"header\"><m id=\"menu\">menu</m></h>") != std::string::npos);
+	for(int i = 0; i < 3; ++i) {
+		BOOST_CHECK_EQUAL(page.render(rnd).to_string(), expected);
+		std::string streamed;
+		page.render(rnd, streamed);
+		BOOST_CHECK_EQUAL(streamed, expected);
+	}
+
+	// insert() after render binds again
+	rnd.create_value("featured.name", std::string("first"));
+	page.insert("footer", "item", "featured");
+	BOOST_CHECK_EQUAL(page.render(rnd).to_string(), page.render_dom(rnd).to_string());
+	BOOST_CHECK(page.render(rnd).to_string().find("<i id=\"footer\">first</i>") != std::string::npos);
+
+	// missing view is reported when it is rendered
+	page.insert("footer", "missing", "");
+	BOOST_CHECK_THROW(page.render(rnd), std::exception);
+
+	// fragments without view insertions are bound once for context, until fragments change
+	auto kept = ctx.get("page");
+	const std::string original = kept.render(rnd).to_string();
+	BOOST_CHECK(original.find("<i>first</i>") != std::string::npos);
+	ctx.put("item", "<f:u xmlns:f=\"webpp://format\">#{name}</f:u>");
+	const std::string changed = ctx.get("page").render(rnd).to_string();
+	BOOST_CHECK(changed.find("<u>first</u>") != std::string::npos && changed.find("<i>") == std::string::npos);
+	// prepared fragment kept across reload still owns fragments it was bound to
+	BOOST_CHECK_EQUAL(kept.render(rnd).to_string(), original);
+}
+
+BOOST_AUTO_TEST_CASE(output_documents) {
+	BOOST_TEST_CHECKPOINT("Test 38: output documents are reused by next outputs");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+	ctx.put("page", "<!-- before --><html xmlns=\"webpp://html5\" xmlns:f=\"webpp://format\"><f:p f:title=\"#{title}\">#{title}</f:p></html>");
+	rnd.create_value("title", std::string("first"));
+
+	const xmlDoc* document;
+	Glib::ustring first;
+	{
+		auto output = ctx.get("page").render(rnd);
+		document = output.document().cobj();
+		first = output.xhtml5(webpp::xml::fragment_output::DOCTYPE).to_string();
+	}
+	rnd.create_value("title", std::string("second"));
+	auto output = ctx.get("page").render(rnd);
+	// document is empty again, names are interned in its dictionary
+	BOOST_CHECK_EQUAL(output.document().cobj(), document);
+	BOOST_CHECK(document->intSubset == nullptr && document->dict != nullptr);
+	BOOST_CHECK(xmlDictOwns(document->dict, output.document().get_root_node()->cobj()->name) == 1);
+	BOOST_CHECK(xmlDictOwns(document->dict, output.document().get_root_node()->cobj()->children->name) == 1);
+	std::string streamed;
+	ctx.get("page").render(rnd, streamed);
+	BOOST_CHECK_EQUAL(output.to_string(), streamed);
+	BOOST_CHECK(first.find("<!DOCTYPE html>") != Glib::ustring::npos && first.find("first") != Glib::ustring::npos);
+}
+
+BOOST_AUTO_TEST_CASE(render_without_comments) {
+	BOOST_TEST_CHECKPOINT("Test 39: render leaves comments out");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+	const int encoding = webpp::xml::fragment_output::DOCTYPE | webpp::xml::fragment_output::REMOVE_XML_DECLARATION | webpp::xml::fragment_output::REMOVE_COMMENTS;
+	BOOST_CHECK_EQUAL(ctx.get("boilerplate").render(rnd, encoding).to_string(), readfile("boilerplate-nocomment.output"));
+	BOOST_CHECK_EQUAL(ctx.get("boilerplate").render(rnd, encoding & ~webpp::xml::fragment_output::REMOVE_COMMENTS).to_string(), readfile("boilerplate.output"));
+
+	// comments of inserted fragments are left out too
+	ctx.put("outer", "<!-- outer --><root xmlns=\"webpp://xml\" xmlns:c=\"webpp://control\"><!-- a --><c:insert name=\"inner\" value-prefix=\"\" /><div id=\"content\"/></root>");
+	ctx.put("inner", "<p xmlns=\"webpp://xml\"><!-- b -->text</p>");
+	const Glib::ustring output = ctx.get("outer").insert("content", "inner", "").render(rnd, webpp::xml::fragment_output::REMOVE_COMMENTS).to_string();
+	BOOST_CHECK_EQUAL(output, ctx.get("outer").insert("content", "inner", "").render(rnd).xhtml5(webpp::xml::fragment_output::REMOVE_COMMENTS).to_string());
+	BOOST_CHECK(output.find("<!--") == Glib::ustring::npos);
+
+	// comments written by namespace handlers are left out too
+	ctx.put("formatted", "<root xmlns=\"webpp://xml\" xmlns:f=\"webpp://format\"><f:p><!-- #{title} -->p</f:p><f:text><!-- t -->text</f:text></root>");
+	rnd.create_value("title", std::string("title"));
+	const Glib::ustring formatted = ctx.get("formatted").render(rnd, webpp::xml::fragment_output::REMOVE_COMMENTS).to_string();
+	std::string streamed;
+	ctx.get("formatted").render(rnd, streamed, webpp::xml::fragment_output::REMOVE_COMMENTS);
+	BOOST_CHECK_EQUAL(formatted, ctx.get("formatted").render(rnd).xhtml5(webpp::xml::fragment_output::REMOVE_COMMENTS).to_string());
+	BOOST_CHECK_EQUAL(formatted, streamed);
+	BOOST_CHECK(formatted.find("<!--") == Glib::ustring::npos);
+}
+
+BOOST_AUTO_TEST_CASE(html5_serialization) {
+	BOOST_TEST_CHECKPOINT("Test 40: HTML5 serialization");
+
+	webpp::xml::context ctx(boost::filesystem::path(__FILE__).parent_path().string());
+	webpp::xml::render::context rnd;
+	ctx.load_taglib<webpp::xml::taglib::basic>();
+	ctx.put("page", "<html xmlns=\"webpp://html5\" xmlns:c=\"webpp://control\" xmlns:f=\"webpp://format\" xmlns:s=\"http://www.w3.org/2000/svg\">"
+			"<head><meta charset=\"utf-8\"/><script>if(a &lt; b &amp;&amp; c) {}</script><style>a &gt; b {}</style></head>"
+			"<body><br/><div/><input type=\"checkbox\" checked=\"checked\" value=\"\"/>"
+			"<p c:repeat=\"inner\" c:repeat-array=\"items\" c:repeat-variable=\"item\"><f:input f:value=\"#{item}\"/><input disabled=\"disabled\"/></p>"
+			"<f:script>var t = '#{title}' &lt; 1;</f:script><f:p f:title=\"#{title}\">#{title}</f:p><s:svg><s:circle/></s:svg></body></html>");
+	rnd.create_value("title", std::string("x & y"));
+	auto& items = rnd.create_array("items");
+	items.add().create_value(std::string("first"));
+
+	const int encoding = webpp::xml::fragment_output::HTML5 | webpp::xml::fragment_output::DOCTYPE;
+	std::string streamed;
+	ctx.get("page").render(rnd, streamed, encoding);
+	BOOST_CHECK_EQUAL(streamed, "<!DOCTYPE html>\n"
+			"<html xmlns=\"http://www.w3.org/1999/xhtml\" xmlns:s=\"http://www.w3.org/2000/svg\"><head><meta charset=\"utf-8\">"
+			"<script>if(a < b && c) {}</script><style>a > b {}</style></head><body><br><div></div><input type=\"checkbox\" checked=\"checked\" value=\"\">"
+			"<p><input value=\"first\"><input disabled=\"disabled\"></p><script>var t = 'x & y' < 1;</script><p title=\"x &amp; y\">x &amp; y</p>"
+			"<s:svg><s:circle/></s:svg></body></html>\n");
+	BOOST_CHECK_EQUAL(ctx.get("page").render(rnd, encoding).to_string(), streamed);
+
+	std::string minimized;
+	ctx.get("page").render(rnd, minimized, encoding | webpp::xml::fragment_output::MINIMIZE_ATTRIBUTES);
+	BOOST_CHECK(minimized.find("<input type=\"checkbox\" checked value><p><input value=\"first\"><input disabled></p>") != std::string::npos);
+	BOOST_CHECK_EQUAL(ctx.get("page").render(rnd, encoding | webpp::xml::fragment_output::MINIMIZE_ATTRIBUTES).to_string(), minimized);
+
+	// formatted text can not end script
+	rnd.create_value("title", std::string("</script><script>alert(1)</script>"));
+	std::string injected;
+	ctx.get("page").render(rnd, injected, encoding);
+	BOOST_CHECK(injected.find("<script>var t = '<\\/script><script>alert(1)<\\/script>' < 1;</script>") != std::string::npos);
+	BOOST_CHECK_EQUAL(ctx.get("page").render(rnd, encoding).to_string(), injected);
+
+	// CDATA is written as text, raw in scripts
+	ctx.put("cdata", "<html xmlns=\"webpp://html5\"><body><script><![CDATA[if(a < b && c) { s = '</script>'; }]]></script><p><![CDATA[x & y]]></p></body></html>");
+	std::string cdata;
+	ctx.get("cdata").render(rnd, cdata, encoding);
+	BOOST_CHECK(cdata.find("<script>if(a < b && c) { s = '<\\/script>'; }</script><p>x &amp; y</p>") != std::string::npos);
+	BOOST_CHECK_EQUAL(ctx.get("cdata").render(rnd, encoding).to_string(), cdata);
+}
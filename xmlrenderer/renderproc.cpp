@@ -1,5 +1,6 @@
 #include "xmllib.hpp"
 #include "taglib.hpp"
+#include "test_parser.hpp"
 #include <fstream>
 #include <vector>
 #include <boost/algorithm/string.hpp>
@@ -50,14 +51,18 @@ void parse_render_values(const std::map<std::string, std::string>& lines, webpp:
 }
 
 int main(int argc, char **argv) {
-	bool bench = false;
+	bool bench = false, profile = false;
 	if(argc == 4 && !strcmp(argv[3], "bench")) {
 		bench = true;
 		--argc;
+	} else if(argc == 4 && !strcmp(argv[3], "profile")) {
+		profile = true;
+		webpp::xml::expressions::profiler::enable();
+		--argc;
 	}
 
 	if(argc != 3) {
-		std::cerr << "Usage: " << argv[0] << " <render values file> <xml template file>\n";
+		std::cerr << "Usage: " << argv[0] << " <render values file> <xml template file> [bench|profile]\n";
 		return 1;
 	}
 	webpp::xml::context ctx(".");
@@ -91,6 +96,16 @@ int main(int argc, char **argv) {
 		auto process_time = (later-now).ticks();
 		double perreq = (double)process_time/n/1000000;
 		std::cout << n << " rendered documents, total time " << (double)process_time/1000000 << " seconds, " << perreq << " per request\n";
+	} else if(profile) {
+		try {
+			webpp::xml::render::context rnd;
+			parse_render_values(lines, rnd.get(""));
+			ctx.get("testfile").render(rnd).to_string();
+			webpp::xml::expressions::profiler::report(std::cerr);
+		} catch(const webpp::stacked_exception& e) {
+			std::cerr << e.format();
+			throw;
+		}
 	} else {
 		try {
 			webpp::xml::render::context rnd;
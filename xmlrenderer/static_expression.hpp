@@ -0,0 +1,245 @@
+#ifndef WEBPP_XML_STATIC_EXPRESSION_HPP
+#define WEBPP_XML_STATIC_EXPRESSION_HPP
+
+#include "test_parser.hpp"
+#include <type_traits>
+#include <limits>
+#include <string>
+
+namespace webpp { namespace xml {
+namespace expressions {
+/*! \brief Expressions written in C++ for taglibs, checked by compiler and evaluated without parsing
+ *
+ *  \code
+ *  using namespace webpp::xml::expressions::statics;
+ *  static const auto visible = (var("user.age") >= 18 && in(var("user.group"), var("groups"), "name")) || var("user.admin").is_true();
+ *  if(visible.evaluate(rnd)) ...
+ *  \endcode
+ *
+ *  Each expression has its own type, so evaluation is inlined into calling tag. Results are the same as
+ *  of parsed expression with the same source: unknown side of comparison is cast to type of the other side,
+ *  two variables are compared as strings. Comparison of literals of different types, 'and'/'or' of values
+ *  and tests of non-variables are rejected by compiler.
+ */
+namespace statics {
+	/// \brief Base of nodes with value (variables and literals)
+	struct value_node {};
+	/// \brief Base of nodes with boolean result
+	struct test_node {};
+
+	template<typename T>
+	struct is_value : std::is_base_of<value_node, T> {};
+
+	template<typename T>
+	struct is_test : std::is_base_of<test_node, T> {};
+
+	template<typename T>
+	class literal;
+
+	template<>
+	class literal<int> : public value_node {
+		int value_;
+	public:
+		static const base::value_t::type_t type = base::value_t::type_t::integer;
+		explicit literal(const int value) : value_(value) {}
+		inline base::value_t get_value(render::context&) const { return base::value_t::from_integer(value_); }
+	};
+
+	template<>
+	class literal<double> : public value_node {
+		double value_;
+	public:
+		static const base::value_t::type_t type = base::value_t::type_t::real;
+		explicit literal(const double value) : value_(value) {}
+		inline base::value_t get_value(render::context&) const { return base::value_t::from_real(value_); }
+	};
+
+	template<>
+	class literal<std::string> : public value_node {
+		std::string value_;
+	public:
+		static const base::value_t::type_t type = base::value_t::type_t::string;
+		explicit literal(const std::string& value) : value_(value) {}
+		inline base::value_t get_value(render::context&) const { return base::value_t::from_string(value_); }
+	};
+
+	/// \brief Variable 'is ...' test
+	class variable_test : public test_node {
+		base::operand op_;
+		render::path path_;
+	public:
+		variable_test(const base::operand op, const render::path& path) : op_(op), path_(path) {}
+		inline bool evaluate(render::context& rnd) const { return test_variable(op_, rnd.get(path_)); }
+	};
+
+	/// \brief Variable from render context, its name is resolved to symbols once
+	class variable : public value_node {
+		render::path path_;
+	public:
+		static const base::value_t::type_t type = base::value_t::type_t::unknown;
+		explicit variable(const Glib::ustring& name) : path_(name) {}
+
+		inline const render::path& path() const { return path_; }
+
+		base::value_t get_value(render::context& rnd) const {
+			const render::tree_element& v = rnd.get(path_);
+			if(v.empty())
+				throw std::runtime_error("Variable is null: " + path_.name());
+			return base::value_t::from_variable(v.get_value());
+		}
+
+		inline variable_test is_true() const { return variable_test(base::operand::IS_TRUE, path_); }
+		inline variable_test is_not_true() const { return variable_test(base::operand::IS_NOT_TRUE, path_); }
+		inline variable_test is_empty() const { return variable_test(base::operand::IS_EMPTY, path_); }
+		inline variable_test is_not_empty() const { return variable_test(base::operand::IS_NOT_EMPTY, path_); }
+		inline variable_test is_null() const { return variable_test(base::operand::IS_NULL, path_); }
+		inline variable_test is_not_null() const { return variable_test(base::operand::IS_NOT_NULL, path_); }
+	};
+
+	inline variable var(const Glib::ustring& name) { return variable(name); }
+
+	/// \brief Node type of comparison operand: nodes are used as they are, C++ values become literals
+	template<typename T, typename Enable = void>
+	struct operand_of {};
+
+	template<typename T>
+	struct operand_of<T, typename std::enable_if<is_value<T>::value>::type> {
+		typedef T type;
+		static inline const T& wrap(const T& v) { return v; }
+	};
+
+	/// \brief Integer literals are int, as in parsed expressions; wider types would be truncated, so they are rejected
+	template<typename T>
+	struct operand_of<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+		static_assert(std::numeric_limits<T>::digits <= std::numeric_limits<int>::digits,
+			"Integer literal does not fit int, cast it or compare with a variable");
+		typedef literal<int> type;
+		static inline type wrap(const T v) { return type(static_cast<int>(v)); }
+	};
+
+	template<typename T>
+	struct operand_of<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+		typedef literal<double> type;
+		static inline type wrap(const T v) { return type(static_cast<double>(v)); }
+	};
+
+	template<typename T>
+	struct operand_of<T, typename std::enable_if<!is_value<T>::value && std::is_convertible<const T&, std::string>::value>::type> {
+		typedef literal<std::string> type;
+		static inline type wrap(const T& v) { return type(static_cast<std::string>(v)); }
+	};
+
+	template<typename L, typename R>
+	class comparison : public test_node {
+		static_assert(L::type == base::value_t::type_t::unknown || R::type == base::value_t::type_t::unknown || L::type == R::type,
+			"Could not compare different types");
+		base::operand op_;
+		L lhs_;
+		R rhs_;
+	public:
+		comparison(const base::operand op, const L& lhs, const R& rhs) : op_(op), lhs_(lhs), rhs_(rhs) {}
+		inline bool evaluate(render::context& rnd) const {
+			// right side first, as in parsed expression
+			const base::value_t rhs = rhs_.get_value(rnd);
+			return compare(op_, lhs_.get_value(rnd), rhs);
+		}
+	};
+
+	/// \brief True if T has operand_of, so it can be compared
+	template<typename T, typename Enable = void>
+	struct is_operand : std::false_type {};
+
+	template<typename T>
+	struct is_operand<T, typename std::conditional<true, void, typename operand_of<T>::type>::type> : std::true_type {};
+
+	/// \brief Comparison node of 'lhs op rhs', at least one side has to be a node
+	/// Without member 'type' for other operands, so operators below are not candidates for them.
+	template<typename L, typename R, typename Enable = void>
+	struct comparison_of {};
+
+	template<typename L, typename R>
+	struct comparison_of<L, R, typename std::enable_if<(is_value<L>::value || is_value<R>::value) && is_operand<L>::value && is_operand<R>::value>::type> {
+		typedef comparison<typename operand_of<L>::type, typename operand_of<R>::type> type;
+
+		static inline type make(const base::operand op, const L& lhs, const R& rhs) {
+			return type(op, operand_of<L>::wrap(lhs), operand_of<R>::wrap(rhs));
+		}
+	};
+
+	template<typename L, typename R>
+	inline typename comparison_of<L, R>::type operator==(const L& lhs, const R& rhs) { return comparison_of<L, R>::make(base::operand::EQ, lhs, rhs); }
+	template<typename L, typename R>
+	inline typename comparison_of<L, R>::type operator!=(const L& lhs, const R& rhs) { return comparison_of<L, R>::make(base::operand::NE, lhs, rhs); }
+	template<typename L, typename R>
+	inline typename comparison_of<L, R>::type operator<(const L& lhs, const R& rhs) { return comparison_of<L, R>::make(base::operand::LT, lhs, rhs); }
+	template<typename L, typename R>
+	inline typename comparison_of<L, R>::type operator<=(const L& lhs, const R& rhs) { return comparison_of<L, R>::make(base::operand::LE, lhs, rhs); }
+	template<typename L, typename R>
+	inline typename comparison_of<L, R>::type operator>(const L& lhs, const R& rhs) { return comparison_of<L, R>::make(base::operand::GT, lhs, rhs); }
+	template<typename L, typename R>
+	inline typename comparison_of<L, R>::type operator>=(const L& lhs, const R& rhs) { return comparison_of<L, R>::make(base::operand::GE, lhs, rhs); }
+
+	/// \brief 'left in array as suffix'
+	template<typename L>
+	class membership : public test_node {
+		L left_;
+		render::path array_, suffix_;
+	public:
+		membership(const L& left, const render::path& array, const render::path& suffix) : left_(left), array_(array), suffix_(suffix) {}
+		bool evaluate(render::context& rnd) const {
+			render::tree_element& right = rnd.get(array_);
+			if(!right.is_array())
+				throw std::runtime_error("second argument for 'in' operator should be array");
+			return array_contains(right.get_array(), suffix_, left_.get_value(rnd));
+		}
+	};
+
+	template<typename L>
+	inline membership<typename operand_of<L>::type> in(const L& left, const variable& array, const Glib::ustring& suffix = Glib::ustring()) {
+		return membership<typename operand_of<L>::type>(operand_of<L>::wrap(left), array.path(), render::path(suffix));
+	}
+
+	template<typename L, typename R>
+	class conjunction : public test_node {
+		L lhs_;
+		R rhs_;
+	public:
+		conjunction(const L& lhs, const R& rhs) : lhs_(lhs), rhs_(rhs) {}
+		inline bool evaluate(render::context& rnd) const { return lhs_.evaluate(rnd) && rhs_.evaluate(rnd); }
+	};
+
+	template<typename L, typename R>
+	class disjunction : public test_node {
+		L lhs_;
+		R rhs_;
+	public:
+		disjunction(const L& lhs, const R& rhs) : lhs_(lhs), rhs_(rhs) {}
+		inline bool evaluate(render::context& rnd) const { return lhs_.evaluate(rnd) || rhs_.evaluate(rnd); }
+	};
+
+	template<typename E>
+	class negation : public test_node {
+		E rhs_;
+	public:
+		explicit negation(const E& rhs) : rhs_(rhs) {}
+		inline bool evaluate(render::context& rnd) const { return !rhs_.evaluate(rnd); }
+	};
+
+	template<typename L, typename R>
+	inline typename std::enable_if<is_test<L>::value && is_test<R>::value, conjunction<L, R>>::type operator&&(const L& lhs, const R& rhs) {
+		return conjunction<L, R>(lhs, rhs);
+	}
+
+	template<typename L, typename R>
+	inline typename std::enable_if<is_test<L>::value && is_test<R>::value, disjunction<L, R>>::type operator||(const L& lhs, const R& rhs) {
+		return disjunction<L, R>(lhs, rhs);
+	}
+
+	template<typename E>
+	inline typename std::enable_if<is_test<E>::value, negation<E>>::type operator!(const E& rhs) {
+		return negation<E>(rhs);
+	}
+}
+}}}
+
+#endif // WEBPP_XML_STATIC_EXPRESSION_HPP
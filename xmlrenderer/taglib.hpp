@@ -4,48 +4,199 @@
 #include "xmllib.hpp"
 #include "test_parser.hpp"
 #include <webpp-common/stacked_exception.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/noncopyable.hpp>
+#include <mutex>
+#include <memory>
+#include <vector>
 namespace webpp { namespace xml { namespace taglib {
-	/*! \brief XMLNS handler for formatting attributes
-	 *  \\example <a f:href="/users/#{user.name}" f:title="user #[user.name} - abuse level #{user.abuse|%.2f]">
+	/*! \brief Format source ("user #{user.name} - #{user.abuse|%.2f}") split once into literal and evaluated segments
+	 *  Syntax errors are kept as segments too, so they are reported when the source is rendered, as if it was parsed then.
+	 *  Source is handled as UTF-8 bytes, literals are views of the stored source.
 	 */
-	class format_xmlns : public xmlns {
-		Glib::ustring format(const Glib::ustring& source, render::context& ctx) const {
+	class format_string : public boost::noncopyable {
+	public:
+		enum class kind { literal, expression, formatted, error };
+		struct segment {
+			kind type;
+			boost::string_ref text; // literal text or error message
+			std::string name; // expression or variable name of 'formatted' segment
+			render::format_spec format; // format of 'formatted' segment
+			render::path variable; // variable of 'formatted' segment
+			const expressions::compiled_expression* expression; // compiled 'name' of 'expression' segment, nullptr if it does not parse
+		};
+
+		explicit format_string(const std::string& source) : source_(source), literals_length_(0) {
+			// delimiters are ASCII, so they can not be part of multibyte characters
+			const std::string& raw = source_;
+			const boost::string_ref view(source_);
 			std::size_t last = 0, start;
-			std::ostringstream result;
-			while(start = source.find("#{", last), start != Glib::ustring::npos) {
+			while(start = raw.find("#{", last), start != std::string::npos) {
 				if(start != last)
-					result << source.substr(last, start-last);
+					add_literal(view.substr(last, start-last));
 
-				auto pipe = source.find('|', start+1), end = source.find('}', start+1);
-				if(end == Glib::ustring::npos) {
-					throw std::runtime_error("#{ not terminated by }");
+				auto pipe = raw.find('|', start+1), end = raw.find('}', start+1);
+				if(end == std::string::npos) {
+					add(kind::error, "#{ not terminated by }");
+					return;
 				}
-				if(pipe != Glib::ustring::npos && pipe < end) {
-					auto variable = source.substr(start+2, pipe - start-2);
-					auto format = source.substr(pipe+1, end-pipe-1);
+				if(pipe != std::string::npos && pipe < end) {
+					auto variable = raw.substr(start+2, pipe - start-2);
+					auto format = view.substr(pipe+1, end-pipe-1);
 					if(format.empty()) {
-						throw std::runtime_error("empty format string");
+						add(kind::error, "empty format string");
+						return;
 					}
-					auto& var = ctx.get(variable);
-					if(!var.is_value())
-						throw std::runtime_error("format: required variable '" + variable + "' not found in render context");
-					result << var.get_value().format(format);
+					segments_.push_back(segment { kind::formatted, boost::string_ref(), variable, render::format_spec(format.to_string()), render::path(variable), nullptr });
 				} else {
-					auto variable = source.substr(start+2, end-start-2);
-					result << expressions::evaluate_string_expression(variable, ctx);
+					auto expression = raw.substr(start+2, end-start-2);
+					segments_.push_back(segment { kind::expression, boost::string_ref(), expression, render::format_spec(), render::path(), compile(expression) });
 				}
 				last = end+1;
 			}
-			if(last != source.length())
-				result << source.substr(last);
-			return result.str();
+			if(last != raw.length())
+				add_literal(view.substr(last));
+		}
+
+		/// \brief Tokenized 'source' from global table, split on first use
+		static const format_string& intern(const std::string& source) {
+			static std::mutex mutex;
+			static boost::unordered_map<std::string, std::unique_ptr<format_string>> formats;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			auto i = formats.find(source);
+			if(i == formats.end())
+				i = formats.emplace(source, std::unique_ptr<format_string>(new format_string(source))).first;
+			return *i->second;
+		}
+
+		/// \brief Append rendered source to 'output'
+		void render(render::context& ctx, std::string& output) const {
+			for(const segment& i : segments_) {
+				switch(i.type) {
+					case kind::literal:
+						output.append(i.text.data(), i.text.size());
+						break;
+					case kind::expression:
+						// syntax error is reported by the string overload, as if expression was parsed now
+						output += i.expression != nullptr ? expressions::evaluate_string_expression(*i.expression, ctx) : expressions::evaluate_string_expression(i.name, ctx);
+						break;
+					case kind::formatted: {
+						auto& var = ctx.get(i.variable);
+						if(!var.is_value())
+							throw std::runtime_error("format: required variable '" + i.name + "' not found in render context");
+						i.format.write(var.get_value(), output);
+						break;
+					}
+					case kind::error:
+						throw std::runtime_error(i.text.to_string());
+				}
+			}
+		}
+
+		std::string render(render::context& ctx) const {
+			std::string result;
+			result.reserve(literals_length_);
+			render(ctx, result);
+			return result;
+		}
+
+		inline const std::vector<segment>& segments() const { return segments_; }
+	private:
+		const std::string source_;
+		std::vector<segment> segments_;
+		std::size_t literals_length_;
+
+		void add(const kind type, boost::string_ref text) {
+			segments_.push_back(segment { type, text, std::string(), render::format_spec(), render::path(), nullptr });
+		}
+
+		static const expressions::compiled_expression* compile(const std::string& expression) {
+			try {
+				return &expressions::intern_compiled_expression(expression);
+			} catch(const std::exception&) {
+				return nullptr;
+			}
+		}
+
+		void add_literal(boost::string_ref text) {
+			add(kind::literal, text);
+			literals_length_ += text.length();
+		}
+	};
+
+	/*! \brief XMLNS handler for formatting attributes
+	 *  \\example <a f:href="/users/#{user.name}" f:title="user #[user.name} - abuse level #{user.abuse|%.2f]">
+	 */
+	class format_xmlns : public xmlns {
+		/// \brief How attribute of formatted element is rendered, decided by its namespace
+		enum class attribute_kind : unsigned char { copied, control, formatted, unsupported };
+
+		/// \brief Tokenized sources of element, by attribute and by child node, nullptr if they are not formatted
+		struct compiled_element : public compiled_node {
+			bool text; // f:text, its contents replace it
+			std::vector<attribute_kind> kinds;
+			std::vector<const format_string*> attributes, children;
+		};
+
+		struct compiled_attribute : public compiled_node {
+			const format_string* format;
+			explicit compiled_attribute(const format_string* format) : format(format) {}
+		};
+
+		/// \brief Compiled format of index-th node, source() is read and tokenized only if fragment was not compiled with this handler
+		template<typename SourceT>
+		static const format_string& format(const std::vector<const format_string*>* formats, const std::size_t index, const SourceT& source) {
+			return formats != nullptr && (*formats)[index] != nullptr ? *(*formats)[index] : format_string::intern(source());
+		}
+
+		static const format_string& format(const compiled_node* compiled, const xmlpp::Attribute* src) {
+			const compiled_attribute* attribute = dynamic_cast<const compiled_attribute*>(compiled);
+			return attribute != nullptr ? *attribute->format : format_string::intern(src->get_value().raw());
+		}
+
+		static const compiled_element* element(const compiled_node* compiled) {
+			return dynamic_cast<const compiled_element*>(compiled);
+		}
+
+		static attribute_kind classify(const xmlpp::Attribute* attribute) {
+			const Glib::ustring ns = attribute->get_namespace_uri();
+			switch(intern_namespace(ns)) {
+				case namespace_id::none:
+				case namespace_id::xml:
+				case namespace_id::html5:
+					return attribute_kind::copied;
+				case namespace_id::control:
+					// ignore control attributes, core handles it
+					return attribute_kind::control;
+				default:
+					return ns == "webpp://format" ? attribute_kind::formatted : attribute_kind::unsupported;
+			}
 		}
 
 	public:
-		virtual void tag(xmlpp::Element* dst, const xmlpp::Element* src , render::context& ctx) const {
+		virtual void tag(xmlpp::Element* dst, const xmlpp::Element* src, render::context& ctx) const {
+			tag(dst, src, nullptr, ctx);
+		}
+
+		virtual void attribute(xmlpp::Element* dst, const xmlpp::Attribute* src, render::context& ctx) const {
+			attribute(dst, src, nullptr, ctx);
+		}
+
+		virtual void tag(xml_writer& dst, const xmlpp::Element* src, render::context& ctx) const {
+			tag(dst, src, nullptr, ctx);
+		}
+
+		virtual void attribute(xml_writer& dst, const xmlpp::Attribute* src, render::context& ctx) const {
+			attribute(dst, src, nullptr, ctx);
+		}
+
+		virtual void tag(xmlpp::Element* dst, const xmlpp::Element* src, const compiled_node* compiled, render::context& ctx) const {
 			STACKED_EXCEPTIONS_ENTER();
+			const compiled_element* formats = element(compiled);
 			xmlpp::Element *target;
-			if(src->get_name() == "text") {
+			if(formats != nullptr ? formats->text : src->get_name() == "text") {
                 target = dst->get_parent();
                 if(target == nullptr)
                     throw std::runtime_error("format: text node cannot be root node");
@@ -53,40 +204,118 @@ namespace webpp { namespace xml { namespace taglib {
 			} else {
                 target = dst;
                 target->set_name(src->get_name());
+				std::size_t index = 0;
 				for(const xmlpp::Attribute* i : src->get_attributes()) {
-					if(i->get_namespace_uri() == "" || i->get_namespace_uri() == "webpp://xml" || i->get_namespace_uri() == "webpp://html5") {
-						target->set_attribute(i->get_name(), i->get_value());
-					} else if(i->get_namespace_uri() == "webpp://format") {
-						attribute(target, i, ctx);
-					} else if(i->get_namespace_uri() == "webpp://control") {
-						// ignore control attributes, core handles it
-					} else {
-						throw std::runtime_error("webpp://format tags support only XML/HTML5/webpp://format attributes, not " + i->get_namespace_uri() + " namespace");
+					switch(formats != nullptr ? formats->kinds[index] : classify(i)) {
+						case attribute_kind::copied:
+							target->set_attribute(i->get_name(), i->get_value());
+							break;
+						case attribute_kind::control:
+							break;
+						case attribute_kind::unsupported:
+							throw std::runtime_error("webpp://format tags support only XML/HTML5/webpp://format attributes, not " + i->get_namespace_uri() + " namespace");
+						case attribute_kind::formatted:
+							// Glib::ustring is used only at libxml boundary, format strings work on UTF-8 bytes
+							target->set_attribute(i->get_name(), format(formats ? &formats->attributes : nullptr, index, [i] { return i->get_value().raw(); }).render(ctx));
 					}
+					++index;
 				}
 			}
+			std::size_t index = 0;
 			for(xmlpp::Node* i : src->get_children()) {
 				xmlpp::TextNode* ti = dynamic_cast<xmlpp::TextNode*>(i);
 				xmlpp::CommentNode* ci = dynamic_cast<xmlpp::CommentNode*>(i);
 				xmlpp::CdataNode *cdi = dynamic_cast<xmlpp::CdataNode*>(i);
 				if(ti != nullptr)
-					target->add_child_text(format(ti->get_content(), ctx));
+					target->add_child_text(format(formats ? &formats->children : nullptr, index, [ti] { return ti->get_content().raw(); }).render(ctx));
 				else if(ci != nullptr)
-					target->add_child_comment(format(ci->get_content(), ctx));
+					target->add_child_comment(format(formats ? &formats->children : nullptr, index, [ci] { return ci->get_content().raw(); }).render(ctx));
 				else if(cdi != nullptr)
-					target->add_child_cdata(format(cdi->get_content(), ctx));
+					target->add_child_cdata(format(formats ? &formats->children : nullptr, index, [cdi] { return cdi->get_content().raw(); }).render(ctx));
 				else
 					throw std::runtime_error("webpp://format rendered tag can contain only text, comment or cdata nodes");
+				++index;
+			}
+			STACKED_EXCEPTIONS_LEAVE("tag " + src->get_namespace_uri() + ":" + src->get_name());
+		}
 
+		virtual void attribute(xmlpp::Element* dst, const xmlpp::Attribute* src, const compiled_node* compiled, render::context& ctx) const {
+			STACKED_EXCEPTIONS_ENTER();
+			dst->set_attribute(src->get_name(), format(compiled, src).render(ctx));
+			STACKED_EXCEPTIONS_LEAVE("attribute " + src->get_namespace_uri() + ":" + src->get_name());
+		}
+
+		/// \brief Same as tag() above, formatted text is written without conversion to Glib::ustring
+		virtual void tag(xml_writer& dst, const xmlpp::Element* src, const compiled_node* compiled, render::context& ctx) const {
+			STACKED_EXCEPTIONS_ENTER();
+			const compiled_element* formats = element(compiled);
+			if(formats != nullptr ? formats->text : src->get_name() == "text") {
+				if(dst.depth() == 1)
+					throw std::runtime_error("format: text node cannot be root node");
+				dst.detach_element();
+			} else {
+				dst.set_name(src->get_name().raw());
+				std::size_t index = 0;
+				for(const xmlpp::Attribute* i : src->get_attributes()) {
+					switch(formats != nullptr ? formats->kinds[index] : classify(i)) {
+						case attribute_kind::copied:
+							dst.set_attribute(i->get_name().raw(), i->get_value().raw());
+							break;
+						case attribute_kind::control:
+							break;
+						case attribute_kind::unsupported:
+							throw std::runtime_error("webpp://format tags support only XML/HTML5/webpp://format attributes, not " + i->get_namespace_uri() + " namespace");
+						case attribute_kind::formatted:
+							dst.set_attribute(i->get_name().raw(), format(formats ? &formats->attributes : nullptr, index, [i] { return i->get_value().raw(); }).render(ctx));
+					}
+					++index;
+				}
+			}
+			std::size_t index = 0;
+			for(const xmlNode* i = src->cobj()->children; i != nullptr; i = i->next, ++index) {
+				const auto content = [i] { return std::string(i->content != nullptr ? reinterpret_cast<const char*>(i->content) : ""); };
+				switch(i->type) {
+					case XML_TEXT_NODE:
+						dst.text(format(formats ? &formats->children : nullptr, index, content).render(ctx));
+						break;
+					case XML_COMMENT_NODE:
+						dst.comment(format(formats ? &formats->children : nullptr, index, content).render(ctx));
+						break;
+					case XML_CDATA_SECTION_NODE:
+						dst.cdata(format(formats ? &formats->children : nullptr, index, content).render(ctx));
+						break;
+					default:
+						throw std::runtime_error("webpp://format rendered tag can contain only text, comment or cdata nodes");
+				}
 			}
 			STACKED_EXCEPTIONS_LEAVE("tag " + src->get_namespace_uri() + ":" + src->get_name());
 		}
 
-		virtual void attribute(xmlpp::Element* dst, const xmlpp::Attribute* src, render::context& ctx) const {
+		virtual void attribute(xml_writer& dst, const xmlpp::Attribute* src, const compiled_node* compiled, render::context& ctx) const {
 			STACKED_EXCEPTIONS_ENTER();
-			dst->set_attribute(src->get_name(), format(src->get_value(), ctx));
+			dst.set_attribute(src->get_name().raw(), format(compiled, src).render(ctx));
 			STACKED_EXCEPTIONS_LEAVE("attribute " + src->get_namespace_uri() + ":" + src->get_name());
-		}			
+		}
+
+		/// \brief Split format sources of element or attribute when fragment is loaded, render uses them without lookups
+		virtual std::shared_ptr<const compiled_node> compile(const xmlpp::Node* node) const {
+			if(const xmlpp::Attribute* attribute = dynamic_cast<const xmlpp::Attribute*>(node))
+				return std::make_shared<compiled_attribute>(&format_string::intern(attribute->get_value().raw()));
+			const xmlpp::Element* element = dynamic_cast<const xmlpp::Element*>(node);
+			if(element == nullptr)
+				return nullptr;
+			auto result = std::make_shared<compiled_element>();
+			result->text = element->get_name() == "text";
+			for(const xmlpp::Attribute* i : element->get_attributes()) {
+				result->kinds.push_back(classify(i));
+				result->attributes.push_back(result->kinds.back() == attribute_kind::formatted ? &format_string::intern(i->get_value().raw()) : nullptr);
+			}
+			for(const xmlpp::Node* i : element->get_children()) {
+				const xmlpp::ContentNode* content = dynamic_cast<const xmlpp::ContentNode*>(i);
+				result->children.push_back(content != nullptr ? &format_string::intern(content->get_content().raw()) : nullptr);
+			}
+			return result;
+		}
 	};
 
 	struct basic {
@@ -12,6 +12,15 @@
 #include <boost/fusion/include/adapt_struct.hpp>
 #include <boost/variant/recursive_variant.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/functional/hash.hpp>
+#include <mutex>
+#include <atomic>
+#include <iomanip>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
 
 namespace webpp { namespace xml { namespace expressions {
 	struct literal_expression : public base {
@@ -21,27 +30,32 @@ namespace webpp { namespace xml { namespace expressions {
 			virtual bool evaluate(render::context&) const;
 			virtual render::tree_element& get_tree_element(render::context&) const;
 			virtual std::string to_string() const;
+			virtual std::string to_source() const;
 			virtual value_t get_value(render::context&) const;
 	};
 
 	struct variable_expression : public base {
 			std::string variable_;
+			render::path path_; // variable_ resolved to symbols
 			variable_expression(const std::string& v);
 
 			virtual bool evaluate(render::context& rnd) const;
 			virtual render::tree_element& get_tree_element(render::context& rnd) const;
 
 			virtual std::string to_string() const;
+			virtual std::string to_source() const;
 			virtual value_t get_value(render::context& rnd) const;
 	};
 
 	struct function_expression : public base {
 			std::string function_, variable_;
+			render::path path_; // variable_ resolved to symbols
 			function_expression(const std::string& name);
 
 			virtual bool evaluate(render::context& rnd) const;
 			virtual render::tree_element& get_tree_element(render::context&) const;
 			virtual std::string to_string() const;
+			virtual std::string to_source() const;
 			virtual value_t get_value(render::context & rnd) const;
 	};
 
@@ -52,6 +66,7 @@ namespace webpp { namespace xml { namespace expressions {
 			virtual bool evaluate(render::context& rnd) const;
 			virtual render::tree_element& get_tree_element(render::context&) const;
 			virtual std::string to_string() const;
+			virtual std::string to_source() const;
 			virtual value_t get_value(render::context &) const;
 	};
 
@@ -62,6 +77,7 @@ namespace webpp { namespace xml { namespace expressions {
 			virtual bool evaluate(render::context& rnd) const;
 			virtual render::tree_element& get_tree_element(render::context&) const;
 			virtual std::string to_string() const;
+			virtual std::string to_source() const;
 			virtual value_t get_value(render::context &) const;
 	};
 
@@ -73,6 +89,7 @@ namespace webpp { namespace xml { namespace expressions {
 		virtual render::tree_element& get_tree_element(render::context&) const;
 		virtual value_t get_value(render::context &) const;
 		virtual std::string to_string() const;
+		virtual std::string to_source() const;
 	};
 
 	struct twoop_expression : public base {
@@ -83,6 +100,7 @@ namespace webpp { namespace xml { namespace expressions {
 		virtual render::tree_element& get_tree_element(render::context&) const;
 		virtual value_t get_value(render::context &) const;
 		virtual std::string to_string() const;
+		virtual std::string to_source() const;
 	};
 
 	struct threeop_expression : public base {
@@ -93,6 +111,7 @@ namespace webpp { namespace xml { namespace expressions {
 		virtual render::tree_element& get_tree_element(render::context&) const;
 		virtual value_t get_value(render::context &) const;
 		virtual std::string to_string() const;
+		virtual std::string to_source() const;
 	};
 
 	struct and_expression : public base {
@@ -103,6 +122,7 @@ namespace webpp { namespace xml { namespace expressions {
 		virtual render::tree_element& get_tree_element(render::context&) const;
 		virtual value_t get_value(render::context &) const;
 		virtual std::string to_string() const;
+		virtual std::string to_source() const;
 	};
 
 	struct or_expression : public base {
@@ -113,6 +133,7 @@ namespace webpp { namespace xml { namespace expressions {
 			virtual render::tree_element& get_tree_element(render::context&) const;
 			virtual value_t get_value(render::context &) const;
 			virtual std::string to_string() const;
+			virtual std::string to_source() const;
 	};
 
 	struct not_expression : public base {
@@ -123,6 +144,7 @@ namespace webpp { namespace xml { namespace expressions {
 			virtual render::tree_element& get_tree_element(render::context&) const;
 			virtual value_t get_value(render::context &) const;
 			virtual std::string to_string() const;
+			virtual std::string to_source() const;
 	};
 
 	struct inline_condition_expression : public base {
@@ -133,6 +155,7 @@ namespace webpp { namespace xml { namespace expressions {
 		virtual render::tree_element& get_tree_element(render::context&) const;
 		virtual value_t get_value(render::context &) const;
 		virtual std::string to_string() const;
+		virtual std::string to_source() const;
 	};
 
 	unescaped_string::unescaped_string()
@@ -149,66 +172,190 @@ namespace webpp { namespace xml { namespace expressions {
 		;
 	}
 
-	bool evaluate_test_expression(const std::string& expression, render::context& rnd) {
-		STACKED_EXCEPTIONS_ENTER()
+	expression_ptr parse_expression(const std::string& expression) {
 		using qi::phrase_parse;
 		using qi::ascii::space;
+		// grammar is stateless during parse, so build it only once
+		static const expression_grammar grammar;
 		std::string::const_iterator saved = expression.begin(), begin = expression.begin(), end = expression.end();
 
 		expression_ptr ex;
-		bool r = phrase_parse(begin, end, expression_grammar(), space, ex);
+		bool r = phrase_parse(begin, end, grammar, space, ex);
 		if(begin != end || !r) {
 			throw std::runtime_error("Parse failed, stopped at character "
 									 + boost::lexical_cast<std::string>(begin-saved)
 									 + ": " + std::string(begin, end));
+		}
+		return ex;
+	}
+
+	static expression_ptr fold_literals(const expression_ptr& e);
+
+	const compiled_expression& intern_compiled_expression(const std::string& expression) {
+		// every distinct expression text is parsed and compiled once, then shared by all fragments and renders
+		static std::mutex mutex;
+		static boost::unordered_map<std::string, std::unique_ptr<compiled_expression>> expressions;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto i = expressions.find(expression);
+			if(i != expressions.end())
+				return *i->second;
+		}
+		// parsed without lock, other thread could add the same expression meanwhile
+		std::unique_ptr<compiled_expression> compiled(new compiled_expression(fold_literals(parse_expression(expression)), expression));
+		std::lock_guard<std::mutex> lock(mutex);
+		return *expressions.emplace(expression, std::move(compiled)).first->second;
+	}
+
+	expression_ptr intern_expression(const std::string& expression) {
+		return intern_compiled_expression(expression).expression();
+	}
+
+	static std::atomic<bool> profiler_enabled(false);
+	static std::mutex profiler_mutex;
+	static boost::unordered_map<std::string, expression_profile> profiles;
+
+	void profiler::enable(const bool enabled) {
+		profiler_enabled = enabled;
+	}
+
+	bool profiler::enabled() {
+		return profiler_enabled.load(std::memory_order_relaxed);
+	}
+
+	void profiler::reset() {
+		std::lock_guard<std::mutex> lock(profiler_mutex);
+		profiles.clear();
+	}
+
+	profiler::results_t profiler::results() {
+		std::lock_guard<std::mutex> lock(profiler_mutex);
+		return results_t(profiles.begin(), profiles.end());
+	}
+
+	void profiler::report(std::ostream& out, const std::size_t limit) {
+		const results_t all = results();
+		std::vector<results_t::const_iterator> sorted;
+		for(auto i = all.begin(); i != all.end(); ++i)
+			sorted.push_back(i);
+		std::sort(sorted.begin(), sorted.end(), [](const results_t::const_iterator& a, const results_t::const_iterator& b) { return a->second.time > b->second.time; });
+		if(limit != 0 && sorted.size() > limit)
+			sorted.resize(limit);
+
+		out << std::setw(12) << "time [us]" << std::setw(12) << "calls" << std::setw(12) << "exceptions" << "  expression\n";
+		for(const auto& i : sorted) {
+			out << std::setw(12) << std::chrono::duration_cast<std::chrono::microseconds>(i->second.time).count()
+				<< std::setw(12) << i->second.evaluations << std::setw(12) << i->second.exceptions << "  " << i->first << "\n";
+		}
+	}
+
+	profiler::sample::sample(const std::string& expression)
+		: expression_(expression), start_(std::chrono::steady_clock::now()), finished_(false) {}
+
+	profiler::sample::~sample() {
+		const auto elapsed = std::chrono::steady_clock::now() - start_;
+		std::lock_guard<std::mutex> lock(profiler_mutex);
+		expression_profile& p = profiles[expression_];
+		++p.evaluations;
+		if(!finished_)
+			++p.exceptions;
+		p.time += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed);
+	}
+
+	static bool evaluate_test(const compiled_expression& e, render::context& rnd) {
+		render::memo_entry* invariant = e.repeat_cache(rnd);
+		if(invariant != nullptr && invariant->has_boolean)
+			return invariant->boolean;
+
+		bool result;
+		render::memo_entry* memo = e.memo(rnd);
+		if(memo == nullptr) {
+			result = e.evaluate(rnd);
 		} else {
-			return ex->evaluate(rnd);
+			if(!memo->has_boolean) {
+				memo->boolean = e.evaluate(rnd);
+				memo->has_boolean = true;
+			}
+			result = memo->boolean;
 		}
-		STACKED_EXCEPTIONS_LEAVE("evaluate test expression: " + expression);
+
+		// evaluation could change context and invalidate results of repeats
+		if(invariant != nullptr && (invariant = e.repeat_cache(rnd)) != nullptr) {
+			invariant->boolean = result;
+			invariant->has_boolean = true;
+		}
+		return result;
 	}
 
-	std::string evaluate_string_expression(const std::string& expression, render::context& rnd) {
-		STACKED_EXCEPTIONS_ENTER()
-		using qi::phrase_parse;
-		using qi::ascii::space;
-		std::string::const_iterator saved = expression.begin(), begin = expression.begin(), end = expression.end();
+	static std::string evaluate_string(const compiled_expression& e, render::context& rnd) {
+		render::memo_entry* invariant = e.repeat_cache(rnd);
+		if(invariant != nullptr && invariant->has_string)
+			return invariant->string;
 
-		expression_ptr ex;
-		bool r = phrase_parse(begin, end, expression_grammar(), space, ex);
-		if(begin != end || !r) {
-			throw std::runtime_error("Parse failed, stopped at character "
-									 + boost::lexical_cast<std::string>(begin-saved)
-									 + ": " + std::string(begin, end));
+		std::string result;
+		render::memo_entry* memo = e.memo(rnd);
+		if(memo == nullptr) {
+			result = e.get_string(rnd);
 		} else {
-			const expressions::base::value_t v = ex->get_value(rnd);
-			switch(v.type) {
-				case expressions::base::value_t::type_t::string:
-				case expressions::base::value_t::type_t::unknown:
-					return boost::any_cast<std::string>(v.value_);
-				case expressions::base::value_t::type_t::integer:
-					return boost::lexical_cast<std::string>(boost::any_cast<int>(v.value_));
-				case expressions::base::value_t::type_t::real:
-					return boost::lexical_cast<std::string>(boost::any_cast<double>(v.value_));
+			if(!memo->has_string) {
+				memo->string = e.get_string(rnd);
+				memo->has_string = true;
 			}
+			result = memo->string;
 		}
+
+		// evaluation could change context and invalidate results of repeats
+		if(invariant != nullptr && (invariant = e.repeat_cache(rnd)) != nullptr) {
+			invariant->string = result;
+			invariant->has_string = true;
+		}
+		return result;
+	}
+
+	bool evaluate_test_expression(const std::string& expression, render::context& rnd) {
+		const compiled_expression* e;
+		STACKED_EXCEPTIONS_ENTER()
+		e = &intern_compiled_expression(expression);
+		STACKED_EXCEPTIONS_LEAVE("evaluate test expression: " + expression);
+		return evaluate_test_expression(*e, rnd);
+	}
+
+	std::string evaluate_string_expression(const std::string& expression, render::context& rnd) {
+		const compiled_expression* e;
+		STACKED_EXCEPTIONS_ENTER()
+		e = &intern_compiled_expression(expression);
 		STACKED_EXCEPTIONS_LEAVE("evaluate string expression: " + expression);
+		return evaluate_string_expression(*e, rnd);
 	}
 
-	void print_expression_ast(const std::string& expression) {
+	bool evaluate_test_expression(const compiled_expression& e, render::context& rnd) {
 		STACKED_EXCEPTIONS_ENTER()
-		using qi::phrase_parse;
-		using qi::ascii::space;
-		std::string::const_iterator saved = expression.begin(), begin = expression.begin(), end = expression.end();
+		if(!profiler::enabled())
+			return evaluate_test(e, rnd);
+
+		profiler::sample sample(e.source());
+		const bool result = evaluate_test(e, rnd);
+		sample.finish();
+		return result;
+		STACKED_EXCEPTIONS_LEAVE("evaluate test expression: " + e.source());
+	}
 
-		expression_ptr ex;
-		bool r = phrase_parse(begin, end, expression_grammar(), space, ex);
-		if(begin != end || !r) {
-			throw std::runtime_error("Parse failed, stopped at character "
-									 + boost::lexical_cast<std::string>(begin-saved)
-									 + ": " + std::string(begin, end));
-		} else {
-			std::cout << ex->to_string();
-		}
+	std::string evaluate_string_expression(const compiled_expression& e, render::context& rnd) {
+		STACKED_EXCEPTIONS_ENTER()
+		if(!profiler::enabled())
+			return evaluate_string(e, rnd);
+
+		profiler::sample sample(e.source());
+		std::string result = evaluate_string(e, rnd);
+		sample.finish();
+		return result;
+		STACKED_EXCEPTIONS_LEAVE("evaluate string expression: " + e.source());
+	}
+
+	void print_expression_ast(const std::string& expression) {
+		STACKED_EXCEPTIONS_ENTER()
+		std::cout << parse_expression(expression)->to_string();
 		STACKED_EXCEPTIONS_LEAVE("evaluate test expression: " + expression);
 	}
 
@@ -333,6 +480,34 @@ namespace webpp { namespace xml { namespace expressions {
 		}
 	}
 
+	base::value_t base::value_t::from_integer(const int v) {
+		value_t result;
+		result.type = type_t::integer;
+		result.integer = v;
+		return result;
+	}
+
+	base::value_t base::value_t::from_real(const double v) {
+		value_t result;
+		result.type = type_t::real;
+		result.real = v;
+		return result;
+	}
+
+	base::value_t base::value_t::from_string(boost::string_ref v) {
+		value_t result;
+		result.type = type_t::string;
+		result.string = v;
+		return result;
+	}
+
+	base::value_t base::value_t::from_variable(const render::value_base& v) {
+		value_t result;
+		result.type = type_t::unknown;
+		result.variable = &v;
+		return result;
+	}
+
 	std::string base::operand_name(const operand op) {
 			switch(op) {
 			case operand::EQ: return "eq";
@@ -352,6 +527,31 @@ namespace webpp { namespace xml { namespace expressions {
 			}
 	}
 
+	static std::string operand_source(const base::operand op) {
+		switch(op) {
+			case base::operand::EQ: return "=";
+			case base::operand::NE: return "!=";
+			case base::operand::LT: return "<";
+			case base::operand::LE: return "<=";
+			case base::operand::GT: return ">";
+			case base::operand::GE: return ">=";
+			case base::operand::IN: return "in";
+			case base::operand::IS_TRUE: return "is true";
+			case base::operand::IS_NOT_TRUE: return "is not true";
+			case base::operand::IS_EMPTY: return "is empty";
+			case base::operand::IS_NOT_EMPTY: return "is not empty";
+			case base::operand::IS_NULL: return "is null";
+			case base::operand::IS_NOT_NULL: return "is not null";
+		}
+	}
+
+	// grammar accepts 'and'/'or' chains in place of single expression only in parentheses
+	static std::string nested_source(const base& e) {
+		if(dynamic_cast<const and_expression*>(&e) || dynamic_cast<const or_expression*>(&e))
+			return "(" + e.to_source() + ")";
+		return e.to_source();
+	}
+
 	literal_expression::literal_expression(const std::string& v) : literal_(v) {}
 	bool literal_expression::evaluate(render::context&) const {
 		throw error("string", literal_, "String can not be evaluated as boolean expression");
@@ -363,28 +563,58 @@ namespace webpp { namespace xml { namespace expressions {
 		return "string(" + literal_ + ")";
 	}
 
+	std::string literal_expression::to_source() const {
+		// unescaped_string accepts alphanumerics, spaces and escapes; hex escape is greedy, so hex digits after it are escaped too
+		static const char* const escapes = "\a\b\f\n\r\t\v\\\'\"", *const escaped = "abfnrtv\\'\"";
+		static const char* const digits = "0123456789abcdef";
+		std::string result("'");
+		bool after_hex = false;
+		for(const char c : literal_) {
+			const char* escape = c == 0 ? nullptr : std::strchr(escapes, c);
+			if(escape != nullptr) {
+				result += '\\';
+				result += escaped[escape - escapes];
+				after_hex = false;
+			} else if(std::isspace(static_cast<unsigned char>(c)) || (std::isalnum(static_cast<unsigned char>(c)) && !(after_hex && std::isxdigit(static_cast<unsigned char>(c))))) {
+				result += c;
+				after_hex = false;
+			} else {
+				const unsigned char u = static_cast<unsigned char>(c);
+				result += "\\x";
+				result += digits[u >> 4];
+				result += digits[u & 15];
+				after_hex = true;
+			}
+		}
+		return result + "'";
+	}
+
 	base::value_t literal_expression::get_value(render::context&) const {
-		return value_t { value_t::type_t::string, literal_ };
+		return value_t::from_string(literal_);
 	}
 
-	variable_expression::variable_expression(const std::string& v) : variable_(v) {}
+	variable_expression::variable_expression(const std::string& v) : variable_(v), path_(v) {}
 
 	bool variable_expression::evaluate(render::context&) const {
 		throw error("variable", variable_, "Variable can not be evaluated as boolean expression, use 'foo is true' instead");
 	}
 	render::tree_element& variable_expression::get_tree_element(render::context& rnd) const {
-		return rnd.get(variable_);
+		return rnd.get(path_);
 	}
 
 	std::string variable_expression::to_string() const {
 		return "variable(" + variable_ + ")";
 	}
 
+	std::string variable_expression::to_source() const {
+		return variable_;
+	}
+
 	base::value_t variable_expression::get_value(render::context& rnd) const {
-		auto& v = rnd.get(variable_);
+		auto& v = rnd.get(path_);
 		if(v.empty())
 			throw std::runtime_error("Variable is null: " + variable_);
-		return value_t { value_t::type_t::unknown, std::string(v.get_value().output()) };
+		return value_t::from_variable(v.get_value());
 	}
 
 	function_expression::function_expression(const std::string& name) {
@@ -396,6 +626,7 @@ namespace webpp { namespace xml { namespace expressions {
 					variable_ = name.substr(0, lastdot);
 					function_ = name.substr(lastdot+1);
 			}
+			path_ = render::path(variable_);
 	}
 
 	bool function_expression::evaluate(render::context&) const {
@@ -407,12 +638,15 @@ namespace webpp { namespace xml { namespace expressions {
 	std::string function_expression::to_string() const {
 		return "function(" + variable_ + "." + function_ + "())";
 	}
+	std::string function_expression::to_source() const {
+		return (variable_.empty() ? function_ : variable_ + "." + function_) + "()";
+	}
 	base::value_t function_expression::get_value(render::context & rnd) const {
 		if(function_ == "size") {
-			auto& v = rnd.get(variable_);
+			auto& v = rnd.get(path_);
 			if(!v.is_array())
 				throw std::runtime_error("size(): variable is not array: " + variable_);
-			return value_t { value_t::type_t::integer, static_cast<int>(v.get_array().size()) };
+			return value_t::from_integer(static_cast<int>(v.get_array().size()));
 
 		} else {
 			throw std::runtime_error("Unknown function " + function_ + ": " + variable_ + "." + function_ + "()");
@@ -430,9 +664,12 @@ namespace webpp { namespace xml { namespace expressions {
 	std::string integer_expression::to_string() const {
 		return "integer(" + boost::lexical_cast<std::string>(integer_) + ")";
 	}
+	std::string integer_expression::to_source() const {
+		return boost::lexical_cast<std::string>(integer_);
+	}
 
 	base::value_t integer_expression::get_value(render::context &) const {
-		return value_t { value_t::type_t::integer, integer_ };
+		return value_t::from_integer(integer_);
 	}
 
 	real_expression::real_expression(const double v) : real_(v) {}
@@ -445,9 +682,18 @@ namespace webpp { namespace xml { namespace expressions {
 	std::string real_expression::to_string() const {
 		return "real(" + boost::lexical_cast<std::string>(real_) + ")";
 	}
+	std::string real_expression::to_source() const {
+		// parser requires dot in real literals
+		std::string result = boost::lexical_cast<std::string>(real_);
+		if(result.find('.') == std::string::npos) {
+			const std::size_t exponent = result.find('e');
+			result.insert(exponent == std::string::npos ? result.length() : exponent, ".0");
+		}
+		return result;
+	}
 
 	base::value_t real_expression::get_value(render::context &) const {
-		return value_t { value_t::type_t::real, real_ };
+		return value_t::from_real(real_);
 	}
 
 	oneop_expression::oneop_expression(expression_ptr lhs, base::operand op)
@@ -498,47 +744,214 @@ namespace webpp { namespace xml { namespace expressions {
 		return base::operand_name(op_) + "(" + lhs_->to_string() + ")";
 	}
 
+	std::string oneop_expression::to_source() const {
+		return lhs_->to_source() + " " + operand_source(op_);
+	}
+
 	template<typename T>
-	bool cast_and_compare_impl2(const base::operand op, const base::value_t& lhs, const base::value_t& rhs, const std::string& stringrep) {
-		try {
-			const T l = boost::any_cast<T>(lhs.value_);
-			const T r = boost::any_cast<T>(rhs.value_);
-			//std::cerr << "op " << base::operand_name(op) << ": " << l << ", " << r << std::endl;
-			switch(op) {
-				case base::operand::EQ: return l == r;
-				case base::operand::NE: return l != r;
-				case base::operand::GE: return l >= r;
-				case base::operand::GT: return l > r;
-				case base::operand::LE: return l <= r;
-				case base::operand::LT: return l < r;
-				default: throw std::logic_error("cast_and_compare does not support " + base::operand_name(op));
+	bool compare_values(const base::operand op, const T& l, const T& r) {
+		switch(op) {
+			case base::operand::EQ: return l == r;
+			case base::operand::NE: return l != r;
+			case base::operand::GE: return l >= r;
+			case base::operand::GT: return l > r;
+			case base::operand::LE: return l <= r;
+			case base::operand::LT: return l < r;
+			default: throw std::logic_error("cast_and_compare does not support " + base::operand_name(op));
+		}
+	}
 
-			}
-		} catch(const boost::bad_any_cast& e) {
-			throw error("cast_and_compare_impl", stringrep, e.what());
+	/*! \brief Error found by expression code itself, not by values or arrays of render context
+	 *  Compiled expression is evaluated again as tree only after this error, so tree reports it with all tokens.
+	 *  Other exceptions (thrown by lambdas, custom arrays, allocation) are passed on as they are.
+	 */
+	class evaluation_error : public std::runtime_error {
+	public:
+		explicit evaluation_error(const std::string& what) : std::runtime_error(what) {}
+	};
+
+	// values stored in render context as integers, reals or strings are used directly,
+	// other values are converted from their string representation
+
+	int integer_value(const base::value_t& v) {
+		switch(v.type) {
+			case base::value_t::type_t::integer:
+				return v.integer;
+			case base::value_t::type_t::unknown:
+				if(v.variable->type() == render::value_type::integer) {
+					const long long i = v.variable->get_integer();
+					if(i >= std::numeric_limits<int>::min() && i <= std::numeric_limits<int>::max())
+						return static_cast<int>(i);
+				}
+				return boost::lexical_cast<int>(v.variable->output().raw());
+			default:
+				throw std::logic_error("integer_value called with type=" + base::value_t::type_name(v.type));
 		}
 	}
 
-	template<typename T>
-	bool cast_and_compare_impl(const base::operand op, base::value_t lhs, base::value_t rhs, const std::string& stringrep) {
-		if(lhs.type == base::value_t::type_t::unknown) {
-			lhs.value_ = boost::lexical_cast<T, std::string>(boost::any_cast<std::string>(lhs.value_));
+	double real_value(const base::value_t& v) {
+		switch(v.type) {
+			case base::value_t::type_t::real:
+				return v.real;
+			case base::value_t::type_t::unknown:
+				if(v.variable->type() == render::value_type::real || v.variable->type() == render::value_type::integer)
+					return v.variable->get_real();
+				return boost::lexical_cast<double>(v.variable->output().raw());
+			default:
+				throw std::logic_error("real_value called with type=" + base::value_t::type_name(v.type));
 		}
-		if(rhs.type == base::value_t::type_t::unknown) {
-			rhs.value_ = boost::lexical_cast<T, std::string>(boost::any_cast<std::string>(rhs.value_));
+	}
+
+	boost::string_ref string_value(const base::value_t& v, std::string& storage) {
+		switch(v.type) {
+			case base::value_t::type_t::string:
+				return v.string;
+			case base::value_t::type_t::unknown:
+				if(v.variable->type() == render::value_type::string)
+					return v.variable->get_string();
+				storage = v.variable->output().raw();
+				return storage;
+			default:
+				throw std::logic_error("string_value called with type=" + base::value_t::type_name(v.type));
 		}
-		return cast_and_compare_impl2<T>(op, lhs, rhs, stringrep);
 	}
 
-	bool cast_and_compare(const base::operand op, const base::value_t::type_t type, const base::value_t& lhs, const base::value_t& rhs, const std::string& stringrep) {
+	bool cast_and_compare(const base::operand op, const base::value_t::type_t type, const base::value_t& lhs, const base::value_t& rhs) {
 		switch(type) {
-			case base::value_t::type_t::integer: return cast_and_compare_impl<int>(op, lhs, rhs, stringrep);
-			case base::value_t::type_t::real: return cast_and_compare_impl<double>(op, lhs, rhs, stringrep);
-			case base::value_t::type_t::string: return cast_and_compare_impl<std::string>(op, lhs, rhs, stringrep);
+			case base::value_t::type_t::integer: return compare_values(op, integer_value(lhs), integer_value(rhs));
+			case base::value_t::type_t::real: return compare_values(op, real_value(lhs), real_value(rhs));
+			case base::value_t::type_t::string: {
+				std::string lstorage, rstorage;
+				return compare_values(op, string_value(lhs, lstorage), string_value(rhs, rstorage));
+			}
 			default: throw std::logic_error("cast_and_compare should not be called with type=unknown");
 		}
 	}
 
+	// hash and equality for std::string keys looked up by boost::string_ref without copying
+	struct string_ref_hash {
+		std::size_t operator()(boost::string_ref s) const { return boost::hash_range(s.begin(), s.end()); }
+	};
+
+	struct string_ref_equal {
+		bool operator()(boost::string_ref lhs, boost::string_ref rhs) const { return lhs == rhs; }
+	};
+
+	/*! \brief Values stored under one suffix in elements of render::array, used by 'in' operator
+	 *  Set for every compared type is built on first use. It is not used when any element value is missing,
+	 *  is a reference or can not be converted; array is then scanned, so errors are the same as without index.
+	 */
+	class in_index : public render::array_cache {
+		enum class state { empty, built, unusable };
+		state strings_state_, integers_state_, reals_state_;
+		boost::unordered_set<std::string, string_ref_hash, string_ref_equal> strings_;
+		boost::unordered_set<int> integers_;
+		boost::unordered_set<double> reals_;
+
+		template<typename SetT, typename ConvertT>
+		static state build(const render::array& array, const render::path& suffix, SetT& set, ConvertT convert) {
+			for(const auto& element : array.elements()) {
+				const render::tree_element& e = element->find(suffix);
+				if(!e.is_value() || e.get_value().is_reference())
+					return state::unusable;
+				try {
+					set.insert(convert(base::value_t::from_variable(e.get_value())));
+				} catch(const std::exception&) {
+					return state::unusable;
+				}
+			}
+			return state::built;
+		}
+	public:
+		in_index() : strings_state_(state::empty), integers_state_(state::empty), reals_state_(state::empty) {}
+
+		/// \brief Membership of 'left' compared as 'type', indeterminate if index can not be used
+		boost::logic::tribool contains(const render::array& array, const render::path& suffix, const base::value_t::type_t type, const base::value_t& left) {
+			switch(type) {
+				case base::value_t::type_t::integer:
+					if(integers_state_ == state::empty)
+						integers_state_ = build(array, suffix, integers_, [](const base::value_t& v) { return integer_value(v); });
+					if(integers_state_ == state::unusable)
+						return boost::logic::indeterminate;
+					return integers_.count(integer_value(left)) != 0;
+				case base::value_t::type_t::real:
+					if(reals_state_ == state::empty)
+						reals_state_ = build(array, suffix, reals_, [](const base::value_t& v) { return real_value(v); });
+					if(reals_state_ == state::unusable)
+						return boost::logic::indeterminate;
+					return reals_.count(real_value(left)) != 0;
+				case base::value_t::type_t::string: {
+					if(strings_state_ == state::empty)
+						strings_state_ = build(array, suffix, strings_, [](const base::value_t& v) { std::string storage; return string_value(v, storage).to_string(); });
+					if(strings_state_ == state::unusable)
+						return boost::logic::indeterminate;
+					std::string storage;
+					return strings_.find(string_value(left, storage), string_ref_hash(), string_ref_equal()) != strings_.end();
+				}
+				default:
+					return boost::logic::indeterminate;
+			}
+		}
+	};
+
+	// 'left in array as suffix', elements are compared as type of left side (string if it is unknown)
+	bool array_contains(render::array_base& array, const render::path& suffix, const base::value_t& left) {
+		const base::value_t::type_t type = left.type == base::value_t::type_t::unknown ? base::value_t::type_t::string : left.type;
+
+		if(const render::array* indexable = dynamic_cast<const render::array*>(&array)) {
+			// keys of other caches must not start with "in:", cache of other type under the key is replaced
+			const std::string key = "in:" + suffix.name().raw();
+			in_index* index = dynamic_cast<in_index*>(indexable->find_cache(key));
+			if(index == nullptr) {
+				index = new in_index;
+				indexable->store_cache(key, std::unique_ptr<render::array_cache>(index));
+			}
+			const boost::logic::tribool result = index->contains(*indexable, suffix, type, left);
+			if(!boost::logic::indeterminate(result))
+				return bool(result);
+		}
+
+		array.reset();
+		while(array.has_next()) {
+			const render::tree_element& element = array.next().find(suffix);
+			if(!element.is_value())
+				throw evaluation_error("no value in this node");
+			if(cast_and_compare(base::operand::EQ, type, left, base::value_t::from_variable(element.get_value())))
+				return true;
+		}
+		return false;
+	}
+
+	// same rules as twoop_expression: unknown side is cast to type of known side, two unknowns are compared as strings
+	bool compare(const base::operand op, const base::value_t& lhs, const base::value_t& rhs) {
+		typedef base::value_t::type_t type_t;
+		if(lhs.type != type_t::unknown && rhs.type != type_t::unknown && lhs.type != rhs.type)
+			throw evaluation_error("Could not compare different types");
+		if(lhs.type == type_t::unknown && rhs.type == type_t::unknown)
+			return cast_and_compare(op, type_t::string, lhs, rhs);
+		return cast_and_compare(op, lhs.type == type_t::unknown ? rhs.type : lhs.type, lhs, rhs);
+	}
+
+	// same as oneop_expression
+	bool test_variable(const base::operand op, render::tree_element& t) {
+		switch(op) {
+			case base::operand::IS_NULL: return t.empty();
+			case base::operand::IS_NOT_NULL: return t.is_array() || t.is_value();
+			case base::operand::IS_NOT_EMPTY: return t.is_array() && !t.get_array().empty();
+			case base::operand::IS_EMPTY: return !t.is_array() || t.get_array().empty();
+			case base::operand::IS_TRUE:
+				if(!t.is_value())
+					throw evaluation_error("Expected boolean value");
+				return t.get_value().is_true();
+			case base::operand::IS_NOT_TRUE:
+				if(!t.is_value())
+					throw evaluation_error("Expected boolean value");
+				return !t.get_value().is_true();
+			default:
+				throw std::logic_error("test does not support " + base::operand_name(op));
+		}
+	}
+
 	twoop_expression::twoop_expression(expression_ptr lhs, base::operand op, expression_ptr rhs)
 			: lhs_(lhs), rhs_(rhs), op_(op)  {}
 	bool twoop_expression::evaluate(render::context& rnd) const {
@@ -550,17 +963,17 @@ namespace webpp { namespace xml { namespace expressions {
 				// two variables, no other way then compare string representation of them
 				// TODO: virtual equal() for render::value?
 				if(rhs.type == lhs.type) {
-					return cast_and_compare_impl<std::string>(op_, lhs, rhs, to_string());
+					return cast_and_compare(op_, value_t::type_t::string, lhs, rhs);
 				} else if(rhs.type == value_t::type_t::unknown) {
 					// left is known, right is unknown, cast right to left's type
-					return cast_and_compare(op_, lhs.type, lhs, rhs, to_string());
+					return cast_and_compare(op_, lhs.type, lhs, rhs);
 				} else {
 					// right is known, left is unknonw, cast left to right's type
-					return cast_and_compare(op_, rhs.type, lhs, rhs, to_string());
+					return cast_and_compare(op_, rhs.type, lhs, rhs);
 				}
 			} else if(rhs.type == lhs.type) {
 				// known type on both sides
-				return cast_and_compare(op_, rhs.type, lhs, rhs, to_string());
+				return cast_and_compare(op_, rhs.type, lhs, rhs);
 			} else {
 				// different types on right and left side
 				throw std::runtime_error("Could not use operator " + base::operand_name(op_) + " on different types: "
@@ -583,6 +996,7 @@ namespace webpp { namespace xml { namespace expressions {
 	}
 
 	std::string twoop_expression::to_string() const { return operand_name(op_) + "(" + lhs_->to_string() + "," + rhs_->to_string() + ")"; }
+	std::string twoop_expression::to_source() const { return lhs_->to_source() + " " + operand_source(op_) + " " + rhs_->to_source(); }
 
 	threeop_expression::threeop_expression(base::operand op, expression_ptr first, expression_ptr second, expression_ptr third)
 		: first_(first), second_(second), third_(third), op_(op) {}
@@ -595,26 +1009,16 @@ namespace webpp { namespace xml { namespace expressions {
 					throw std::runtime_error("second argument for 'in' operator should be array");
 				const value_t left = first_->get_value(rnd);
 
-				std::string suffix;
+				static const render::path no_suffix;
+				const render::path* suffix = &no_suffix;
 				if(third_) {
 					std::shared_ptr<variable_expression> right = std::dynamic_pointer_cast<variable_expression>(third_);
 					if(!right)
 						throw std::runtime_error("third argument for 'in' operator (after 'as') should be variable suffix");
-					suffix = right->variable_;
+					suffix = &right->path_;
 				}
 
-				render::array_base& array = right.get_array();
-				array.reset();
-				value_t::type_t compare_type = left.type;
-				if(left.type == value_t::type_t::unknown)
-					compare_type = value_t::type_t::string;
-				while(array.has_next()) {
-					const value_t element { value_t::type_t::unknown, std::string(array.next().find(suffix).get_value().output()) };
-
-					if(cast_and_compare(base::operand::EQ, compare_type, left, element, to_string()))
-						return true;
-				}
-				return false;
+				return array_contains(right.get_array(), *suffix, left);
 			} else
 				throw std::runtime_error("Operand not supported: " + base::operand_name(op_));
 		} catch(const error& e) {
@@ -633,6 +1037,7 @@ namespace webpp { namespace xml { namespace expressions {
 	}
 
 	std::string threeop_expression::to_string() const { return operand_name(op_) + "(" + first_->to_string() + "," + second_->to_string() + "," + ( third_ ? third_->to_string() : std::string("null") ) + ")"; }
+	std::string threeop_expression::to_source() const { return first_->to_source() + " " + operand_source(op_) + " " + second_->to_source() + ( third_ ? " as " + third_->to_source() : std::string() ); }
 
 	inline_condition_expression::inline_condition_expression(expression_ptr condition, expression_ptr when_true, expression_ptr when_false)
 		: condition_(condition), when_true_(when_true), when_false_(when_false) {}
@@ -653,6 +1058,9 @@ namespace webpp { namespace xml { namespace expressions {
 	std::string inline_condition_expression::to_string() const {
 		return "operator if-then(" + condition_->to_string() + "," + when_true_->to_string() + "," + when_false_->to_string() + ")";
 	}
+	std::string inline_condition_expression::to_source() const {
+		return "if " + nested_source(*condition_) + " then " + when_true_->to_source() + " else " + when_false_->to_source();
+	}
 
 
 	and_expression::and_expression(expression_ptr lhs, expression_ptr rhs)
@@ -672,6 +1080,10 @@ namespace webpp { namespace xml { namespace expressions {
 	std::string and_expression::to_string() const {
 		return "and(" + lhs_->to_string() + "," + rhs_->to_string() + ")";
 	}
+	std::string and_expression::to_source() const {
+		// left associative chain does not need parentheses
+		return (dynamic_cast<const and_expression*>(lhs_.get()) ? lhs_->to_source() : nested_source(*lhs_)) + " and " + nested_source(*rhs_);
+	}
 
 	or_expression::or_expression(expression_ptr lhs, expression_ptr rhs)
 			: lhs_(lhs), rhs_(rhs) {}
@@ -688,6 +1100,9 @@ namespace webpp { namespace xml { namespace expressions {
 	std::string or_expression::to_string() const {
 		return "or(" + lhs_->to_string() + "," + rhs_->to_string() + ")";
 	}
+	std::string or_expression::to_source() const {
+		return (dynamic_cast<const or_expression*>(rhs_.get()) ? nested_source(*rhs_) : rhs_->to_source()).insert(0, lhs_->to_source() + " or ");
+	}
 
 	not_expression::not_expression(expression_ptr rhs) : rhs_(rhs) {}
 
@@ -704,7 +1119,564 @@ namespace webpp { namespace xml { namespace expressions {
 	std::string not_expression::to_string() const {
 		return "not(" + rhs_->to_string() + ")";
 	}
+	std::string not_expression::to_source() const {
+		return "not (" + rhs_->to_source() + ")";
+	}
+
+	/*! \brief Evaluates parts of expression tree, which do not depend on render context
+	 *  Subexpressions are constant when they use only literals and variables present in 'constants'.
+	 *  Subexpressions which fail to evaluate are left as they are, so errors are reported during render.
+	 *  Operands which are not constant are kept even when result does not depend on them, they can fail during render.
+	 *  Variables are looked up without creating nodes in 'constants'.
+	 */
+	class folder {
+		render::context& constants_;
+
+		bool constant(const base& e) const {
+			if(dynamic_cast<const literal_expression*>(&e) || dynamic_cast<const integer_expression*>(&e) || dynamic_cast<const real_expression*>(&e))
+				return true;
+			if(const variable_expression* v = dynamic_cast<const variable_expression*>(&e)) {
+				const render::tree_element* node = constants_.lookup(v->path_);
+				return node != nullptr && !node->empty();
+			}
+			if(const function_expression* f = dynamic_cast<const function_expression*>(&e)) {
+				const render::tree_element* node = constants_.lookup(f->path_);
+				return node != nullptr && node->is_array();
+			}
+			if(const oneop_expression* o = dynamic_cast<const oneop_expression*>(&e))
+				return constant(*o->lhs_);
+			if(const twoop_expression* t = dynamic_cast<const twoop_expression*>(&e))
+				return constant(*t->lhs_) && constant(*t->rhs_);
+			if(const threeop_expression* t = dynamic_cast<const threeop_expression*>(&e))
+				return constant(*t->first_) && constant(*t->second_);
+			return false;
+		}
+
+		// constant variable is replaced by literal of type it would be converted to during render (string if 'other' is unknown too)
+		expression_ptr substitute(const expression_ptr& e, const base* other) {
+			const variable_expression* v = dynamic_cast<const variable_expression*>(e.get());
+			if(v == nullptr || !constant(*v))
+				return e;
+			try {
+				// array constant has no value, it is left for render to report
+				const base::value_t value = base::value_t::from_variable(constants_.lookup(v->path_)->get_value());
+				if(dynamic_cast<const function_expression*>(other))
+					return std::make_shared<integer_expression>(integer_value(value));
+				std::string storage;
+				return std::make_shared<literal_expression>(string_value(value, storage).to_string());
+			} catch(const std::exception&) {
+				return e;
+			}
+		}
+
+	public:
+		/// \brief Folded expression, or its value if expression is null
+		struct result {
+			expression_ptr expression;
+			bool value;
+		};
+
+		folder(render::context& constants) : constants_(constants) {}
+
+		result fold(const expression_ptr& e) {
+			if(const and_expression* a = dynamic_cast<const and_expression*>(e.get())) {
+				const result lhs = fold(a->lhs_);
+				if(!lhs.expression && !lhs.value)
+					return lhs;
+				const result rhs = fold(a->rhs_);
+				if(!rhs.expression && rhs.value)
+					return lhs;
+				if(!lhs.expression)
+					return rhs;
+				if(!rhs.expression) // result is false, but lhs is evaluated first and its errors are reported
+					return result { lhs.expression == a->lhs_ ? e : std::make_shared<and_expression>(lhs.expression, a->rhs_), false };
+				if(lhs.expression == a->lhs_ && rhs.expression == a->rhs_)
+					return result { e, false };
+				return result { std::make_shared<and_expression>(lhs.expression, rhs.expression), false };
+			} else if(const or_expression* o = dynamic_cast<const or_expression*>(e.get())) {
+				const result lhs = fold(o->lhs_);
+				if(!lhs.expression && lhs.value)
+					return lhs;
+				const result rhs = fold(o->rhs_);
+				if(!rhs.expression && !rhs.value)
+					return lhs;
+				if(!lhs.expression)
+					return rhs;
+				if(!rhs.expression) // result is true, but lhs is evaluated first and its errors are reported
+					return result { lhs.expression == o->lhs_ ? e : std::make_shared<or_expression>(lhs.expression, o->rhs_), false };
+				if(lhs.expression == o->lhs_ && rhs.expression == o->rhs_)
+					return result { e, false };
+				return result { std::make_shared<or_expression>(lhs.expression, rhs.expression), false };
+			} else if(const not_expression* n = dynamic_cast<const not_expression*>(e.get())) {
+				const result rhs = fold(n->rhs_);
+				if(!rhs.expression)
+					return result { expression_ptr(), !rhs.value };
+				return result { rhs.expression == n->rhs_ ? e : std::make_shared<not_expression>(rhs.expression), false };
+			} else if(const inline_condition_expression* i = dynamic_cast<const inline_condition_expression*>(e.get())) {
+				// branches are atoms, value is selected during render
+				const result condition = fold(i->condition_);
+				if(!condition.expression)
+					return result { substitute(condition.value ? i->when_true_ : i->when_false_, nullptr), false };
+				const expression_ptr when_true = substitute(i->when_true_, nullptr), when_false = substitute(i->when_false_, nullptr);
+				if(condition.expression == i->condition_ && when_true == i->when_true_ && when_false == i->when_false_)
+					return result { e, false };
+				return result { std::make_shared<inline_condition_expression>(condition.expression, when_true, when_false), false };
+			} else if((dynamic_cast<const oneop_expression*>(e.get()) || dynamic_cast<const twoop_expression*>(e.get()) || dynamic_cast<const threeop_expression*>(e.get()))
+					  && constant(*e)) {
+				try {
+					return result { expression_ptr(), e->evaluate(constants_) };
+				} catch(const std::exception&) {
+					return result { e, false };
+				}
+			} else if(const twoop_expression* t = dynamic_cast<const twoop_expression*>(e.get())) {
+				const expression_ptr lhs = substitute(t->lhs_, t->rhs_.get()), rhs = substitute(t->rhs_, t->lhs_.get());
+				if(lhs == t->lhs_ && rhs == t->rhs_)
+					return result { e, false };
+				return result { std::make_shared<twoop_expression>(lhs, t->op_, rhs), false };
+			} else if(const threeop_expression* t = dynamic_cast<const threeop_expression*>(e.get())) {
+				const expression_ptr first = substitute(t->first_, nullptr);
+				if(first == t->first_)
+					return result { e, false };
+				return result { std::make_shared<threeop_expression>(t->op_, first, t->second_, t->third_), false };
+			} else {
+				return result { e, false };
+			}
+		}
+	};
+
+	// parts using only literals are folded once when expression is interned, fully constant test expressions are left to compiler
+	static expression_ptr fold_literals(const expression_ptr& e) {
+		render::context no_constants;
+		const folder::result result = folder(no_constants).fold(e);
+		return result.expression ? result.expression : e;
+	}
+
+	boost::logic::tribool fold_test_expression(const std::string& expression, render::context& constants, std::string& folded) {
+		expression_ptr e;
+		try {
+			e = intern_expression(expression);
+		} catch(const std::exception&) {
+			// syntax errors are reported during render
+			folded = expression;
+			return boost::logic::indeterminate;
+		}
+		const folder::result result = folder(constants).fold(e);
+		if(!result.expression) {
+			folded = result.value ? "1 = 1" : "1 = 0";
+			return result.value;
+		}
+		folded = result.expression->to_source();
+		return boost::logic::indeterminate;
+	}
+
+
+	/// \brief Flattens expression tree into code of compiled_expression
+	class compiler {
+		typedef compiled_expression::opcode opcode;
+		compiled_expression& target_;
+		std::size_t depth_, max_depth_;
+	public:
+		compiler(compiled_expression& target) : target_(target), depth_(0), max_depth_(0) {}
+
+		/// \brief Compile expression evaluated as boolean, return false if it has to be evaluated as tree
+		bool compile_test(const base* e, compiled_expression::code_t& code) {
+			if(const and_expression* a = dynamic_cast<const and_expression*>(e)) {
+				return compile_logical(a->lhs_.get(), opcode::jump_if_false, a->rhs_.get(), code);
+			} else if(const or_expression* o = dynamic_cast<const or_expression*>(e)) {
+				return compile_logical(o->lhs_.get(), opcode::jump_if_true, o->rhs_.get(), code);
+			} else if(const not_expression* n = dynamic_cast<const not_expression*>(e)) {
+				if(!compile_test(n->rhs_.get(), code))
+					return false;
+				emit(code, opcode::negate);
+				return true;
+			} else if(const oneop_expression* o = dynamic_cast<const oneop_expression*>(e)) {
+				const variable_expression* v = dynamic_cast<const variable_expression*>(o->lhs_.get());
+				if(v == nullptr)
+					return false;
+				switch(o->op_) {
+					case base::operand::IS_NULL: case base::operand::IS_NOT_NULL:
+					case base::operand::IS_EMPTY: case base::operand::IS_NOT_EMPTY:
+					case base::operand::IS_TRUE: case base::operand::IS_NOT_TRUE:
+						emit(code, opcode::test, add_name(v->variable_), o->op_);
+						push();
+						return true;
+					default:
+						return false;
+				}
+			} else if(const twoop_expression* t = dynamic_cast<const twoop_expression*>(e)) {
+				switch(t->op_) {
+					case base::operand::EQ: case base::operand::NE:
+					case base::operand::LT: case base::operand::LE:
+					case base::operand::GT: case base::operand::GE:
+						break;
+					default:
+						return false;
+				}
+				if(!compile_value(t->lhs_.get(), code) || !compile_value(t->rhs_.get(), code))
+					return false;
+				emit(code, opcode::compare, 0, t->op_);
+				pop();
+				return true;
+			} else if(const threeop_expression* t = dynamic_cast<const threeop_expression*>(e)) {
+				const variable_expression* array = dynamic_cast<const variable_expression*>(t->second_.get());
+				const variable_expression* suffix = dynamic_cast<const variable_expression*>(t->third_.get());
+				if(t->op_ != base::operand::IN || array == nullptr || (t->third_ && suffix == nullptr))
+					return false;
+				if(!compile_value(t->first_.get(), code))
+					return false;
+				const int name = add_name(array->variable_);
+				add_name(suffix ? suffix->variable_ : std::string());
+				emit(code, opcode::in, name);
+				return true;
+			} else
+				return false;
+		}
+
+		/// \brief Compile expression evaluated as value, return false if it has to be evaluated as tree
+		bool compile_value(const base* e, compiled_expression::code_t& code) {
+			if(const literal_expression* l = dynamic_cast<const literal_expression*>(e)) {
+				target_.strings_.push_back(l->literal_);
+				emit(code, opcode::push_string, target_.strings_.size() - 1);
+			} else if(const integer_expression* i = dynamic_cast<const integer_expression*>(e)) {
+				emit(code, opcode::push_integer, i->integer_);
+			} else if(const real_expression* r = dynamic_cast<const real_expression*>(e)) {
+				target_.reals_.push_back(r->real_);
+				emit(code, opcode::push_real, target_.reals_.size() - 1);
+			} else if(const variable_expression* v = dynamic_cast<const variable_expression*>(e)) {
+				emit(code, opcode::push_variable, add_name(v->variable_));
+			} else if(const function_expression* f = dynamic_cast<const function_expression*>(e)) {
+				if(f->function_ != "size")
+					return false;
+				emit(code, opcode::push_size, add_name(f->variable_));
+			} else if(const inline_condition_expression* c = dynamic_cast<const inline_condition_expression*>(e)) {
+				if(!compile_test(c->condition_.get(), code))
+					return false;
+				const std::size_t to_else = emit(code, opcode::pop_jump_if_false, 0);
+				pop();
+				if(!compile_value(c->when_true_.get(), code))
+					return false;
+				const std::size_t to_end = emit(code, opcode::jump, 0);
+				pop(); // only one of branches leaves value on stack
+				code[to_else].argument = code.size();
+				if(!compile_value(c->when_false_.get(), code))
+					return false;
+				code[to_end].argument = code.size();
+				return true;
+			} else
+				return false;
+			push();
+			return true;
+		}
+
+		/// \brief Check if compiled code fits on machine stack
+		inline bool fits() const { return max_depth_ <= compiled_expression::max_stack; }
+
+	private:
+		bool compile_logical(const base* lhs, const opcode jump, const base* rhs, compiled_expression::code_t& code) {
+			if(!compile_test(lhs, code))
+				return false;
+			const std::size_t position = emit(code, jump, 0);
+			pop(); // when not jumping, lhs is popped
+			if(!compile_test(rhs, code))
+				return false;
+			code[position].argument = code.size();
+			return true;
+		}
+
+		std::size_t emit(compiled_expression::code_t& code, const opcode op, const int argument = 0, const base::operand operand = base::operand::EQ) {
+			code.push_back(compiled_expression::instruction { op, operand, argument });
+			return code.size() - 1;
+		}
+
+		int add_name(const std::string& name) {
+			target_.paths_.emplace_back(name);
+			return target_.paths_.size() - 1;
+		}
+
+		inline void push() { max_depth_ = std::max(max_depth_, ++depth_); }
+		inline void pop() { --depth_; }
+	};
+
+	/// \brief Stack machine running code of compiled_expression
+	class machine {
+		typedef compiled_expression::opcode opcode;
+		typedef base::value_t::type_t type_t;
+		const compiled_expression& program_;
+		render::context& rnd_;
+	public:
+		struct slot {
+			base::value_t value;
+			bool boolean;
+		};
+
+		machine(const compiled_expression& program, render::context& rnd) : program_(program), rnd_(rnd) {}
+
+		/// \brief Run code, return bottom of stack. Any failure is reported as exception.
+		const slot& run(const compiled_expression::code_t& code, slot* stack) const {
+			std::size_t top = 0, pc = 0;
+			while(pc < code.size()) {
+				const compiled_expression::instruction& i = code[pc++];
+				switch(i.op) {
+					case opcode::push_integer:
+						stack[top++].value = base::value_t::from_integer(i.argument);
+						break;
+					case opcode::push_real:
+						stack[top++].value = base::value_t::from_real(program_.reals_[i.argument]);
+						break;
+					case opcode::push_string:
+						stack[top++].value = base::value_t::from_string(program_.strings_[i.argument]);
+						break;
+					case opcode::push_variable: {
+						render::tree_element& v = rnd_.get(program_.paths_[i.argument]);
+						if(v.empty())
+							throw evaluation_error("Variable is null");
+						stack[top++].value = base::value_t::from_variable(v.get_value());
+						break;
+					}
+					case opcode::push_size: {
+						render::tree_element& v = rnd_.get(program_.paths_[i.argument]);
+						if(!v.is_array())
+							throw evaluation_error("size(): variable is not array");
+						stack[top++].value = base::value_t::from_integer(static_cast<int>(v.get_array().size()));
+						break;
+					}
+					case opcode::test:
+						stack[top++].boolean = test(i.operand, rnd_.get(program_.paths_[i.argument]));
+						break;
+					case opcode::compare:
+						--top;
+						try {
+							stack[top-1].boolean = compare(i.operand, stack[top-1].value, stack[top].value);
+						} catch(const boost::bad_lexical_cast& e) {
+							throw evaluation_error(e.what());
+						}
+						break;
+					case opcode::in:
+						stack[top-1].boolean = in(stack[top-1].value, program_.paths_[i.argument], program_.paths_[i.argument+1]);
+						break;
+					case opcode::negate:
+						stack[top-1].boolean = !stack[top-1].boolean;
+						break;
+					case opcode::jump:
+						pc = i.argument;
+						break;
+					case opcode::jump_if_false:
+						if(!stack[top-1].boolean)
+							pc = i.argument;
+						else
+							--top;
+						break;
+					case opcode::jump_if_true:
+						if(stack[top-1].boolean)
+							pc = i.argument;
+						else
+							--top;
+						break;
+					case opcode::pop_jump_if_false:
+						if(!stack[--top].boolean)
+							pc = i.argument;
+						break;
+				}
+			}
+			return stack[0];
+		}
+
+	private:
+		// values which are not booleans are tested by tree, is_true() of other types is not called twice
+		static bool test(const base::operand op, render::tree_element& t) {
+			if((op == base::operand::IS_TRUE || op == base::operand::IS_NOT_TRUE) && t.is_value() && t.get_value().type() != render::value_type::boolean)
+				throw evaluation_error("Expected boolean value");
+			return test_variable(op, t);
+		}
+
+		// same as threeop_expression
+		bool in(const base::value_t& left, const render::path& name, const render::path& suffix) const {
+			render::tree_element& right = rnd_.get(name);
+			if(!right.is_array())
+				throw evaluation_error("second argument for 'in' operator should be array");
+			try {
+				return array_contains(right.get_array(), suffix, left);
+			} catch(const boost::bad_lexical_cast& e) {
+				throw evaluation_error(e.what());
+			}
+		}
+	};
+
+	static std::string to_string(const base::value_t& v) {
+		switch(v.type) {
+			case base::value_t::type_t::integer:
+				return boost::lexical_cast<std::string>(v.integer);
+			case base::value_t::type_t::real:
+				return boost::lexical_cast<std::string>(v.real);
+			case base::value_t::type_t::string:
+				return std::string(v.string.data(), v.string.size());
+			case base::value_t::type_t::unknown:
+				return v.variable->output().raw();
+		}
+	}
+
+	static void add_dependency(const render::path& name, std::vector<render::path>& names) {
+		for(const auto& n : names) {
+			if(n.segments() == name.segments())
+				return;
+		}
+		names.push_back(name);
+	}
+
+	/*! \brief Collect all variables used by expression
+	 *  \return false if result depends on something else than values and presence of nodes (array contents)
+	 */
+	static bool collect_dependencies(const base* e, std::vector<render::path>& names) {
+		if(dynamic_cast<const literal_expression*>(e) || dynamic_cast<const integer_expression*>(e) || dynamic_cast<const real_expression*>(e)) {
+			return true;
+		} else if(const variable_expression* v = dynamic_cast<const variable_expression*>(e)) {
+			add_dependency(v->path_, names);
+			return true;
+		} else if(const function_expression* f = dynamic_cast<const function_expression*>(e)) {
+			add_dependency(f->path_, names);
+			return false;
+		} else if(const oneop_expression* o = dynamic_cast<const oneop_expression*>(e)) {
+			// emptiness depends on array contents
+			return collect_dependencies(o->lhs_.get(), names) && o->op_ != base::operand::IS_EMPTY && o->op_ != base::operand::IS_NOT_EMPTY;
+		} else if(const twoop_expression* t = dynamic_cast<const twoop_expression*>(e)) {
+			const bool lhs = collect_dependencies(t->lhs_.get(), names);
+			return collect_dependencies(t->rhs_.get(), names) && lhs;
+		} else if(const threeop_expression* t = dynamic_cast<const threeop_expression*>(e)) {
+			// third argument is suffix of array elements, not a variable
+			collect_dependencies(t->first_.get(), names);
+			collect_dependencies(t->second_.get(), names);
+			return false;
+		} else if(const and_expression* a = dynamic_cast<const and_expression*>(e)) {
+			const bool lhs = collect_dependencies(a->lhs_.get(), names);
+			return collect_dependencies(a->rhs_.get(), names) && lhs;
+		} else if(const or_expression* o = dynamic_cast<const or_expression*>(e)) {
+			const bool lhs = collect_dependencies(o->lhs_.get(), names);
+			return collect_dependencies(o->rhs_.get(), names) && lhs;
+		} else if(const not_expression* n = dynamic_cast<const not_expression*>(e)) {
+			return collect_dependencies(n->rhs_.get(), names);
+		} else if(const inline_condition_expression* i = dynamic_cast<const inline_condition_expression*>(e)) {
+			const bool condition = collect_dependencies(i->condition_.get(), names);
+			const bool when_true = collect_dependencies(i->when_true_.get(), names);
+			return collect_dependencies(i->when_false_.get(), names) && condition && when_true;
+		} else {
+			return false;
+		}
+	}
+
+	compiled_expression::compiled_expression(expression_ptr expression, std::string source)
+		: expression_(expression), source_(std::move(source)) {
+		compiler test(*this);
+		if(!test.compile_test(expression_.get(), test_code_) || !test.fits())
+			test_code_.clear();
+
+		compiler value(*this);
+		if(!value.compile_value(expression_.get(), value_code_) || !value.fits())
+			value_code_.clear();
+
+		memoizable_ = collect_dependencies(expression_.get(), dependencies_);
+	}
+
+	bool compiled_expression::depends_on(const Glib::ustring& variable) const {
+		const std::string& prefix = variable.raw();
+		for(const auto& name : dependencies_) {
+			const std::string& n = name.name().raw();
+			if(n.compare(0, prefix.length(), prefix) != 0)
+				continue;
+			// 'variable', 'variable.*', 'variable-index'
+			if(n.length() == prefix.length() || n[prefix.length()] == '.' || n.compare(prefix.length(), std::string::npos, "-index") == 0)
+				return true;
+		}
+		return false;
+	}
 
+	render::memo_entry* compiled_expression::repeat_cache(render::context& rnd) const {
+		// read_recorder has to see variables of expression, result stored earlier would hide them
+		if(rnd.recording_reads())
+			return nullptr;
+		auto& scopes = rnd.repeat_scopes();
+		// result is valid during innermost repeat, which is nested in all repeats expression depends on
+		std::size_t scope = 0;
+		for(std::size_t i = scopes.size(); i > 0; --i) {
+			if(depends_on(scopes[i-1].variable)) {
+				scope = i;
+				break;
+			}
+		}
+		// names in c:insert inside repeat resolve with other prefix
+		if(scope == scopes.size() || scopes[scope].prefix != rnd.current_prefix())
+			return nullptr;
+		auto result = scopes[scope].results.emplace(this, render::memo_entry());
+		// writes to other trees and to arrays do not advance clock of context, their nodes are watched
+		if(result.second) {
+			for(const auto& name : dependencies_) {
+				if(const render::tree_element* node = rnd.lookup(name))
+					rnd.watch_repeat(scopes[scope], *node);
+			}
+		}
+		return &result.first->second;
+	}
+
+	render::memo_entry* compiled_expression::memo(render::context& rnd) const {
+		if(!memoizable_ || rnd.recording_reads())
+			return nullptr;
+
+		render::memo_entry& entry = rnd.memo()[this];
+		// nothing changed in context's tree since last check
+		if(entry.checked == rnd.clock())
+			return &entry;
+
+		bool valid = entry.dependencies.size() == dependencies_.size(), local = true;
+		for(std::size_t i = 0; valid && i < dependencies_.size(); ++i) {
+			const render::tree_element& node = rnd.get(dependencies_[i]).target();
+			valid = &node == entry.dependencies[i].first && node.stamp() == entry.dependencies[i].second;
+			local = local && rnd.owns(node);
+		}
+
+		if(!valid) {
+			entry.has_boolean = entry.has_string = false;
+			entry.dependencies.clear();
+			local = true;
+			for(const auto& name : dependencies_) {
+				const render::tree_element& node = rnd.get(name).target();
+				// referenced variables can change without notice
+				if(node.is_value() && node.get_value().is_reference()) {
+					entry.dependencies.clear();
+					entry.checked = 0;
+					return nullptr;
+				}
+				entry.dependencies.emplace_back(&node, node.stamp());
+				local = local && rnd.owns(node);
+			}
+		}
+		// changes of nodes in other trees do not advance context's clock, they are checked every time
+		entry.checked = local ? rnd.clock() : 0;
+		return &entry;
+	}
+
+	bool compiled_expression::evaluate(render::context& rnd) const {
+		if(!test_code_.empty()) {
+			try {
+				machine::slot stack[max_stack];
+				return machine(*this, rnd).run(test_code_, stack).boolean;
+			} catch(const evaluation_error&) {
+				// evaluate tree again below, it reports error with all tokens
+			}
+		}
+		return expression_->evaluate(rnd);
+	}
+
+	std::string compiled_expression::get_string(render::context& rnd) const {
+		if(!value_code_.empty()) {
+			try {
+				machine::slot stack[max_stack];
+				return to_string(machine(*this, rnd).run(value_code_, stack).value);
+			} catch(const evaluation_error&) {
+				// evaluate tree again below, it reports error with all tokens
+			}
+		}
+
+		return to_string(expression_->get_value(rnd));
+	}
 
 }}}
 
@@ -4,7 +4,12 @@
 #include "xmllib.hpp"
 #include <webpp-common/stacked_exception.hpp>
 #include <memory>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <ostream>
 #include <boost/spirit/include/qi.hpp>
+#include <boost/logic/tribool.hpp>
 
 namespace webpp { namespace xml {
 namespace expressions {
@@ -23,10 +28,21 @@ namespace expressions {
 
 	class base {
 	public:
+		/// value of expression, tagged union which does not own any data
 		struct value_t {
 			enum class type_t { integer, real, string, unknown } type;
-			boost::any value_;
+			union {
+				int integer; // type == integer
+				double real; // type == real
+				const render::value_base* variable; // type == unknown, value from render context
+			};
+			boost::string_ref string; // type == string, literal from expression
 			static std::string type_name(type_t);
+
+			static value_t from_integer(const int v);
+			static value_t from_real(const double v);
+			static value_t from_string(boost::string_ref v);
+			static value_t from_variable(const render::value_base& v);
 		};
 
 		enum class operand {
@@ -53,6 +69,8 @@ namespace expressions {
 		virtual bool evaluate(render::context&) const = 0;
 		virtual render::tree_element& get_tree_element(render::context&) const = 0;
 		virtual std::string to_string() const = 0;
+		/// \brief Expression in syntax accepted by parser
+		virtual std::string to_source() const = 0;
 		virtual value_t get_value(render::context&) const = 0;
 	};
 
@@ -84,8 +102,140 @@ namespace expressions {
 			qi::symbols<char, base::operand> operands1, operands2;
 	};
 
+	/*! \brief Expression tree flattened into linear program for small stack machine
+	 *  Program is run without virtual calls and heap allocations (except stringified variables).
+	 *  Constructs which can not be compiled and errors found by expression code are handled by evaluating expression tree,
+	 *  so results and error messages are the same as with tree evaluation. Exceptions of values (lambdas, custom arrays)
+	 *  are passed on, so they are not evaluated again.
+	 */
+	class compiled_expression {
+	public:
+		enum class opcode : unsigned char {
+			push_integer, // push integer literal 'argument'
+			push_real, // push real literal reals_[argument]
+			push_string, // push string literal strings_[argument]
+			push_variable, // push value of variable paths_[argument], type unknown
+			push_size, // push size of array paths_[argument]
+			test, // push result of 'variable is ...' test, 'operand' on variable paths_[argument]
+			compare, // pop two values, push result of 'operand' comparison
+			in, // pop value, push true if it is in array paths_[argument] with suffix paths_[argument+1]
+			negate, // replace top boolean with its negation
+			jump, // jump to 'argument'
+			jump_if_false, // if top is false, jump to 'argument', otherwise pop it
+			jump_if_true, // if top is true, jump to 'argument', otherwise pop it
+			pop_jump_if_false // pop top, if it was false jump to 'argument'
+		};
+
+		struct instruction {
+			opcode op;
+			base::operand operand;
+			int argument;
+		};
+		typedef std::vector<instruction> code_t;
+
+		/// maximum stack depth, deeper expressions are evaluated as tree
+		static const std::size_t max_stack = 16;
+
+		/// \brief Compile 'expression', 'source' is its text used by profiler and error messages
+		explicit compiled_expression(expression_ptr expression, std::string source = std::string());
+
+		/// \brief Evaluate as boolean expression (c:visible-if)
+		bool evaluate(render::context& rnd) const;
+		/// \brief Evaluate as value and convert it to string (#{})
+		std::string get_string(render::context& rnd) const;
+
+		/*! \brief Memoized result of this expression in 'rnd', nullptr if expression can not be memoized (uses arrays or functions) or reads are recorded
+		 *  Entry is valid while all variables of expression resolve to the same, unchanged nodes.
+		 */
+		render::memo_entry* memo(render::context& rnd) const;
+		/// \brief Result of this expression cached in repeat scope of 'rnd', nullptr if it depends on variables of all active repeats or reads are recorded
+		render::memo_entry* repeat_cache(render::context& rnd) const;
+		/// \brief True if expression uses 'variable', its members or 'variable-index'
+		bool depends_on(const Glib::ustring& variable) const;
+
+		inline const expression_ptr& expression() const { return expression_; }
+		inline const std::string& source() const { return source_; }
+		inline const code_t& test_code() const { return test_code_; }
+		inline const code_t& value_code() const { return value_code_; }
+		/// \brief Variables used by expression
+		inline const std::vector<render::path>& dependencies() const { return dependencies_; }
+	private:
+		expression_ptr expression_;
+		std::string source_;
+		code_t test_code_, value_code_;
+		bool memoizable_;
+		std::vector<render::path> dependencies_;
+		std::vector<double> reals_;
+		std::vector<std::string> strings_;
+		std::vector<render::path> paths_;
+
+		friend class compiler;
+		friend class machine;
+	};
+
+	/// \brief Parse expression, throw exception on syntax error
+	expression_ptr parse_expression(const std::string& expression);
+	/*! \brief Find expression in global table of already parsed expressions, parse and compile it on first use
+	 *  Table is locked, so fragments and format strings resolve their expressions once when they are loaded.
+	 */
+	const compiled_expression& intern_compiled_expression(const std::string& expression);
+	/// \brief Parsed expression tree from global table, \see intern_compiled_expression
+	expression_ptr intern_expression(const std::string& expression);
+
+	/*! \brief Fold parts of test expression which use only literals and values from 'constants'
+	 *  \return result if it is known without render context, indeterminate otherwise
+	 *  \param folded source of remaining expression, or of literal only expression with known result
+	 */
+	boost::logic::tribool fold_test_expression(const std::string& expression, render::context& constants, std::string& folded);
+
+	/// \brief Compare values as expressions do: unknown side is cast to type of known side, two unknowns are compared as strings
+	bool compare(const base::operand op, const base::value_t& lhs, const base::value_t& rhs);
+	/// \brief Result of 'variable is ...' test
+	bool test_variable(const base::operand op, render::tree_element& t);
+	/// \brief Result of 'left in array as suffix', elements are compared as type of left side (string if it is unknown)
+	bool array_contains(render::array_base& array, const render::path& suffix, const base::value_t& left);
+
+	/// \brief Statistics of one expression collected by profiler
+	struct expression_profile {
+		std::size_t evaluations; // calls including cached results
+		std::size_t exceptions;
+		std::chrono::nanoseconds time; // cumulative evaluation time
+
+		expression_profile() : evaluations(0), exceptions(0), time(0) {}
+	};
+
+	/*! \brief Opt-in profiler of evaluate_test_expression and evaluate_string_expression (c:visible-if, #{})
+	 *  When disabled, evaluation only checks the flag. Statistics are shared by all threads and kept until reset().
+	 */
+	class profiler {
+	public:
+		typedef std::map<std::string, expression_profile> results_t;
+
+		static void enable(const bool enabled = true);
+		static bool enabled();
+		static void reset();
+		/// \brief Copy of statistics by expression text
+		static results_t results();
+		/// \brief Write table of expressions sorted by cumulative time, 'limit' rows at most (0 for all)
+		static void report(std::ostream& out, const std::size_t limit = 0);
+
+		/// \brief Measures one evaluation, it is counted as exception unless finish() is called
+		class sample {
+			const std::string& expression_;
+			std::chrono::steady_clock::time_point start_;
+			bool finished_;
+		public:
+			explicit sample(const std::string& expression);
+			~sample();
+			inline void finish() { finished_ = true; }
+		};
+	};
+
 	bool evaluate_test_expression(const std::string& expression, render::context& rnd);
 	std::string evaluate_string_expression(const std::string& expression, render::context& rnd);
+	/// \brief Evaluate expression resolved by intern_compiled_expression(), without lookup in global table
+	bool evaluate_test_expression(const compiled_expression& expression, render::context& rnd);
+	std::string evaluate_string_expression(const compiled_expression& expression, render::context& rnd);
 	void print_expression_ast(const std::string& expression);
 }}}
 
@@ -11,6 +11,13 @@ extern "C" {
 }
 
 #include <iostream>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <clocale>
+#include <deque>
+#include <exception>
+#include <boost/functional/hash.hpp>
 extern "C" {
 	#include <libxml/xpath.h>
 }
@@ -18,21 +25,88 @@ extern "C" {
 #include "test_parser.hpp"
 
 namespace webpp { namespace xml { 
+	/*! \brief Output documents released by fragment_output, reused by next outputs of the same thread
+	 *  Every document has own dictionary, so names of elements and attributes are interned when they are first rendered
+	 *  and later renders into the document do not allocate them. Only document and its dictionary are reused: libxml2 has
+	 *  no arena for nodes, so nodes are allocated by every render and released output is freed node by node, in time
+	 *  linear to its size, as without the pool.
+	 */
+	class output_documents : boost::noncopyable {
+		static const std::size_t max_documents = 16;
+		// trivially destructible, so it can be read while thread_local objects are destroyed at thread exit
+		static thread_local bool destroyed_;
+		std::vector<std::unique_ptr<xmlpp::Document>> documents_;
+
+		output_documents() {}
+		~output_documents() { destroyed_ = true; }
+
+		/// \brief Pool of current thread, nullptr if it was destroyed already (output released by other thread_local object)
+		static output_documents* local() {
+			if(destroyed_)
+				return nullptr;
+			static thread_local output_documents documents;
+			return &documents;
+		}
+	public:
+		static std::unique_ptr<xmlpp::Document> acquire() {
+			output_documents* pool = local();
+			if(pool == nullptr || pool->documents_.empty()) {
+				std::unique_ptr<xmlpp::Document> result(new xmlpp::Document);
+				result->cobj()->dict = xmlDictCreate(); // freed by xmlFreeDoc()
+				return result;
+			}
+			std::unique_ptr<xmlpp::Document> result = std::move(pool->documents_.back());
+			pool->documents_.pop_back();
+			return result;
+		}
+
+		static void release(std::unique_ptr<xmlpp::Document> document) {
+			// dictionary is not shared with other documents, so document can be released by other thread than it was acquired by
+			output_documents* pool = local();
+			if(pool == nullptr || pool->documents_.size() == max_documents)
+				return;
+			xmlDoc* doc = document->cobj();
+			for(xmlNode* i = doc->children; i != nullptr;) {
+				xmlNode* next = i->next;
+				xmlpp::Node::free_wrappers(i);
+				xmlUnlinkNode(i);
+				xmlFreeNode(i);
+				i = next;
+			}
+			pool->documents_.push_back(std::move(document));
+		}
+	};
+
+	thread_local bool output_documents::destroyed_ = false;
+
 	fragment_output::fragment_output(const Glib::ustring& name)
-        : name_(name), output_(new xmlpp::Document), remove_xml_declaration_(false) {
+        : name_(name), output_(output_documents::acquire()), remove_xml_declaration_(false), html5_encoding_(0) {
 
 	}
 
-    fragment_output::fragment_output(fragment_output&& orig) : name_(orig.name_), remove_xml_declaration_(orig.remove_xml_declaration_) {
+    fragment_output::fragment_output(fragment_output&& orig)
+		: name_(orig.name_), remove_xml_declaration_(orig.remove_xml_declaration_), html5_encoding_(orig.html5_encoding_) {
 		std::swap(output_, orig.output_);
 	}
 
+	fragment_output::~fragment_output() {
+		if(output_)
+			output_documents::release(std::move(output_));
+	}
+
     Glib::ustring fragment_output::to_string() const {
 		STACKED_EXCEPTIONS_ENTER();
+        if(html5_encoding_ & HTML5) {
+            // libxml has no HTML5 serializer, document is written in one pass as stream render writes it
+            std::string result;
+            xml_writer writer(result, html5_encoding_);
+            writer.copy_document(*output_);
+            return result;
+        }
         const Glib::ustring xml_declaration("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
         Glib::ustring result =  output_->write_to_string();
         if(remove_xml_declaration_)
-            return result.substr(xml_declaration.length()); // or should it use .replace (slower) or other magic?
+            return result.raw().substr(xml_declaration.raw().length()); // or should it use .replace (slower) or other magic?
         else
             return result;
 		STACKED_EXCEPTIONS_LEAVE("");
@@ -52,6 +126,10 @@ namespace webpp { namespace xml {
             remove_xml_declaration_ = true;
         }
 
+        if(xhtml5_encoding & HTML5) {
+            html5_encoding_ = xhtml5_encoding & ~REMOVE_COMMENTS; // comments are removed below
+        }
+
         if(xhtml5_encoding & REMOVE_COMMENTS) {
             // first process (pre|post)-root comments
             for(xmlNode* i = output_->cobj()->children; i != nullptr;) {
@@ -72,102 +150,1837 @@ namespace webpp { namespace xml {
         return *this;
     }
 
-    void fragment_output::remove_comments(xmlpp::Element* element) {
-        for(xmlpp::Node* i : element->get_children()) {
-            xmlpp::CommentNode* cn = dynamic_cast<xmlpp::CommentNode*>(i);
-            xmlpp::Element* e = dynamic_cast<xmlpp::Element*>(i);
-            if(cn != nullptr) {
-                element->remove_child(cn);
-            } else if(e != nullptr) {
-                remove_comments(e);
-            }
-        }
-    }
+    void fragment_output::remove_comments(xmlpp::Element* element) {
+        for(xmlpp::Node* i : element->get_children()) {
+            xmlpp::CommentNode* cn = dynamic_cast<xmlpp::CommentNode*>(i);
+            xmlpp::Element* e = dynamic_cast<xmlpp::Element*>(i);
+            if(cn != nullptr) {
+                element->remove_child(cn);
+            } else if(e != nullptr) {
+                remove_comments(e);
+            }
+        }
+    }
+
+	chunked_output::chunked_output() : flushed_(0) {}
+
+	const std::vector<chunked_output::chunk>& chunked_output::chunks() const {
+		chunks_.clear();
+		for(const segment& s : segments_)
+			chunks_.push_back(chunk { s.data != nullptr ? s.data : buffer_.data() + s.offset, s.size });
+		if(flushed_ != buffer_.size())
+			chunks_.push_back(chunk { buffer_.data() + flushed_, buffer_.size() - flushed_ });
+		return chunks_;
+	}
+
+	std::size_t chunked_output::size() const {
+		std::size_t result = buffer_.size();
+		for(const segment& s : segments_) {
+			if(s.data != nullptr)
+				result += s.size;
+		}
+		return result;
+	}
+
+	std::string chunked_output::to_string() const {
+		std::string result;
+		result.reserve(size());
+		for(const chunk& c : chunks())
+			result.append(c.data, c.size);
+		return result;
+	}
+
+	void chunked_output::clear() {
+		buffer_.clear();
+		segments_.clear();
+		flushed_ = 0;
+		chunks_.clear();
+		fragments_.clear();
+	}
+
+	void chunked_output::add_static(boost::string_ref content, const fragment* owner) {
+		// fragments are owned by context, output shares them so static chunks stay valid after reload
+		if(owner != nullptr && std::find_if(fragments_.begin(), fragments_.end(), [owner](const std::shared_ptr<const fragment>& i) { return i.get() == owner; }) == fragments_.end())
+			fragments_.push_back(owner->shared_from_this());
+		if(flushed_ != buffer_.size()) {
+			segments_.push_back(segment { nullptr, flushed_, buffer_.size() - flushed_ });
+			flushed_ = buffer_.size();
+		}
+		segments_.push_back(segment { content.data(), 0, content.size() });
+	}
+
+	void chunked_output::inserted(const std::size_t position, const std::size_t size) {
+		for(segment& s : segments_) {
+			if(s.data != nullptr)
+				continue;
+			if(s.offset > position)
+				s.offset += size;
+			else if(s.offset + s.size > position)
+				s.size += size;
+		}
+		if(flushed_ > position)
+			flushed_ += size;
+	}
+
+	xml_writer::xml_writer(std::string& buffer, const int xhtml5_encoding)
+		: buffer_(buffer), chunked_(nullptr), embedded_(false), flush_threshold_(0), xhtml5_encoding_(xhtml5_encoding), depth_(0), written_(0), namespaces_end_(0), scratch_node_(nullptr) {
+		if(!(xhtml5_encoding_ & (fragment_output::REMOVE_XML_DECLARATION | fragment_output::HTML5)))
+			buffer_ += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+	}
+
+	xml_writer::xml_writer(chunked_output& output, const int xhtml5_encoding) : xml_writer(output.buffer_, xhtml5_encoding) {
+		chunked_ = &output;
+	}
+
+	xml_writer::xml_writer(std::string& buffer, const int xhtml5_encoding, const bool embedded)
+		: xml_writer(buffer, embedded ? (xhtml5_encoding | fragment_output::REMOVE_XML_DECLARATION) & ~fragment_output::DOCTYPE : xhtml5_encoding) {
+		embedded_ = embedded;
+	}
+
+	std::vector<std::pair<std::string, std::string>> xml_writer::namespaces() const {
+		std::vector<std::pair<std::string, std::string>> result;
+		for(const namespace_declaration& ns : namespaces_)
+			result.emplace_back(ns.uri, ns.prefix);
+		return result;
+	}
+
+	xml_writer::xml_writer(std::string& buffer, const sink_t& sink, const std::size_t flush_threshold, const int xhtml5_encoding)
+		: xml_writer(buffer, xhtml5_encoding) {
+		sink_ = sink;
+		flush_threshold_ = flush_threshold;
+	}
+
+	xml_writer::element& xml_writer::current() {
+		if(depth_ == 0)
+			throw std::logic_error("xml_writer: there is no open element");
+		return elements_[depth_ - 1];
+	}
+
+	void xml_writer::open_element(boost::string_ref name) {
+		if(depth_ == 0) {
+			if(namespaces_end_ != 0)
+				throw std::logic_error("xml_writer: root element is written already");
+			// libxml puts internal subset in front of root element
+			if(xhtml5_encoding_ & fragment_output::DOCTYPE)
+				buffer_ += "<!DOCTYPE html>\n";
+		}
+		if(elements_.size() == depth_)
+			elements_.push_back(element());
+		element& e = elements_[depth_++];
+		e.prefix.clear();
+		e.name.assign(name.data(), name.size());
+		e.attribute_count = e.deferred_count = 0;
+		e.trailer.clear();
+		e.written = e.detached = false;
+	}
+
+	void xml_writer::close_element() {
+		element& e = current();
+		if(!e.detached) {
+			if(!e.written) {
+				write_open_elements(1);
+				write_start(e, depth_ == 1, true);
+			} else {
+				buffer_ += "</";
+				if(!e.prefix.empty())
+					buffer_.append(e.prefix).append(1, ':');
+				buffer_.append(e.name).append(1, '>');
+			}
+		}
+		if(!e.trailer.empty()) {
+			write_open_elements(1);
+			buffer_ += e.trailer;
+		}
+		end_scope();
+		--depth_;
+		written_ = std::min(written_, depth_);
+		if(depth_ == 0 && !embedded_)
+			buffer_ += '\n';
+		flush(flush_threshold_);
+	}
+
+	void xml_writer::remove_element() {
+		element& e = current();
+		if(e.written && !e.detached)
+			throw std::logic_error("xml_writer: element " + e.name + " is written already");
+		end_scope();
+		--depth_;
+		written_ = std::min(written_, depth_);
+	}
+
+	void xml_writer::detach_element() {
+		element& e = current();
+		if(e.written && !e.detached)
+			throw std::logic_error("xml_writer: element " + e.name + " is written already");
+		e.detached = true;
+	}
+
+	void xml_writer::end_scope() {
+		while(!namespaces_.empty() && namespaces_.back().scope == depth_)
+			namespaces_.pop_back();
+	}
+
+	void xml_writer::flush(const std::size_t threshold) {
+		if(!sink_ || buffer_.size() < threshold || buffer_.empty())
+			return;
+		sink_(buffer_);
+		buffer_.clear();
+		if(namespaces_end_ != 0)
+			namespaces_end_ = std::string::npos;
+	}
+
+	void xml_writer::set_name(boost::string_ref name) {
+		current().name.assign(name.data(), name.size());
+	}
+
+	void xml_writer::set_namespace(boost::string_ref prefix) {
+		const namespace_declaration* ns = find_namespace(prefix);
+		if(ns == nullptr)
+			throw std::runtime_error("The namespace prefix (" + prefix.to_string() + ") has not been declared.");
+		current().prefix = ns->prefix;
+	}
+
+	const xml_writer::namespace_declaration* xml_writer::find_namespace(boost::string_ref prefix) const {
+		// as xmlSearchNs(), default namespace without uri is not found
+		for(const namespace_declaration& ns : namespaces_) {
+			if(prefix.empty() ? ns.prefix.empty() && ns.has_uri : prefix == ns.prefix)
+				return &ns;
+		}
+		return nullptr;
+	}
+
+	void xml_writer::set_namespace_declaration(boost::string_ref uri, boost::string_ref prefix) {
+		// same rules as xmlpp::Element::set_namespace_declaration() on root element
+		for(const namespace_declaration& ns : namespaces_) {
+			if(prefix == ns.prefix) {
+				const namespace_declaration* found = find_namespace(prefix);
+				if(found == nullptr || uri != found->uri)
+					throw std::runtime_error("Could not add namespace declaration with URI=" + uri.to_string() + ", prefix=" + prefix.to_string());
+				return;
+			}
+		}
+		if(namespaces_end_ == std::string::npos) {
+			// root start was flushed already, namespace is declared by current element for its subtree
+			element& e = current();
+			if(e.written)
+				throw std::logic_error("xml_writer: namespace " + uri.to_string() + " declared after element " + e.name + " is written");
+			namespaces_.push_back(namespace_declaration { prefix.to_string(), uri.to_string(), !uri.empty(), depth_ });
+			return;
+		}
+		namespaces_.push_back(namespace_declaration { prefix.to_string(), uri.to_string(), !uri.empty(), 0 });
+		if(namespaces_end_ != 0 && !embedded_) {
+			// root is written, declaration goes after previous ones
+			std::string declaration;
+			write_namespace(namespaces_.back(), declaration);
+			buffer_.insert(namespaces_end_, declaration);
+			if(chunked_ != nullptr)
+				chunked_->inserted(namespaces_end_, declaration.size());
+			namespaces_end_ += declaration.size();
+		}
+	}
+
+	/// HTML5 elements without end tag
+	static bool html_void_element(boost::string_ref name) {
+		static const char* const names[] = { "area", "base", "br", "col", "embed", "hr", "img", "input", "link", "meta", "param", "source", "track", "wbr" };
+		for(const char* n : names) {
+			if(name == n)
+				return true;
+		}
+		return false;
+	}
+
+	/// HTML5 elements which contain raw text, it is not escaped
+	static bool html_raw_text_element(boost::string_ref name) {
+		return name == "script" || name == "style";
+	}
+
+	/// Raw text must not end its element, "</" is written as "<\/", which means the same in scripts and styles
+	static void append_raw_text(boost::string_ref content, std::string& output) {
+		for(std::size_t end = content.find("</"); end != boost::string_ref::npos; end = content.find("</")) {
+			output.append(content.data(), end + 1).append("\\/");
+			content.remove_prefix(end + 2);
+		}
+		output.append(content.data(), content.size());
+	}
+
+	/// HTML5 attribute which means the same when it is written without value (empty or boolean attribute set to its name)
+	static bool html_minimized_attribute(boost::string_ref name, boost::string_ref value) {
+		static const char* const names[] = { "allowfullscreen", "async", "autofocus", "autoplay", "checked", "controls", "default", "defer",
+			"disabled", "formnovalidate", "hidden", "ismap", "loop", "multiple", "muted", "novalidate", "open", "readonly", "required",
+			"reversed", "selected" };
+		if(value.empty())
+			return true;
+		if(name != value)
+			return false;
+		for(const char* n : names) {
+			if(name == n)
+				return true;
+		}
+		return false;
+	}
+
+	/// HTML5 element in output is element without namespace prefix
+	static bool html_element(const xmlNode* node) {
+		return node != nullptr && node->type == XML_ELEMENT_NODE && (node->ns == nullptr || node->ns->prefix == nullptr);
+	}
+
+	static void set_attribute_of(std::vector<std::pair<std::string, std::string>>& attributes, std::size_t& count, boost::string_ref name, boost::string_ref value) {
+		for(std::size_t i = 0; i < count; ++i) {
+			if(name == attributes[i].first) {
+				attributes[i].second.assign(value.data(), value.size());
+				return;
+			}
+		}
+		if(count == attributes.size())
+			attributes.emplace_back();
+		attributes[count].first.assign(name.data(), name.size());
+		attributes[count].second.assign(value.data(), value.size());
+		++count;
+	}
+
+	void xml_writer::set_attribute(boost::string_ref name, boost::string_ref value) {
+		element& e = current();
+		if(e.detached)
+			return;
+		if(e.written)
+			throw std::logic_error("xml_writer: attribute " + name.to_string() + " set after element " + e.name + " is written");
+		set_attribute_of(e.attributes, e.attribute_count, name, value);
+	}
+
+	void xml_writer::defer_attribute(boost::string_ref name, boost::string_ref value) {
+		element& e = current();
+		if(!e.written)
+			set_attribute_of(e.deferred, e.deferred_count, name, value);
+	}
+
+	void xml_writer::text(boost::string_ref content) {
+		write_open_elements();
+		if(raw_text())
+			append_raw_text(content, buffer_);
+		else
+			escape_text(content, buffer_);
+	}
+
+	bool xml_writer::raw_text() {
+		return (xhtml5_encoding_ & fragment_output::HTML5) && depth_ != 0 && current().prefix.empty() && html_raw_text_element(current().name);
+	}
+
+	void xml_writer::comment(boost::string_ref content) {
+		if(xhtml5_encoding_ & fragment_output::REMOVE_COMMENTS)
+			return;
+		write_open_elements();
+		buffer_.append("<!--").append(content.data(), content.size()).append("-->");
+		if(depth_ == 0)
+			buffer_ += '\n';
+	}
+
+	static void write_cdata(boost::string_ref content, std::string& output) {
+		if(content.empty()) {
+			output += "<![CDATA[]]>";
+			return;
+		}
+		// "]]>" can not be inside of section, libxml splits it between two sections
+		std::size_t start = 0;
+		for(std::size_t i = 0; i < content.size(); ++i) {
+			if(content.substr(i, 3) == "]]>") {
+				output.append("<![CDATA[").append(content.data() + start, i + 2 - start).append("]]>");
+				start = i + 2;
+			}
+		}
+		if(start != content.size())
+			output.append("<![CDATA[").append(content.data() + start, content.size() - start).append("]]>");
+	}
+
+	void xml_writer::cdata(boost::string_ref content) {
+		// HTML elements can not contain CDATA sections
+		if((xhtml5_encoding_ & fragment_output::HTML5) && depth_ != 0 && current().prefix.empty()) {
+			text(content);
+			return;
+		}
+		write_open_elements();
+		write_cdata(content, buffer_);
+	}
+
+	void xml_writer::copy(const xmlpp::Node* node) {
+		write_child(node->cobj());
+	}
+
+	void xml_writer::raw(boost::string_ref content) {
+		write_open_elements();
+		buffer_.append(content.data(), content.size());
+	}
+
+	void xml_writer::copy_document(const xmlpp::Document& document) {
+		if(depth_ != 0)
+			throw std::logic_error("xml_writer: document copied into element " + current().name);
+		for(const xmlNode* i = document.cobj()->children; i != nullptr; i = i->next) {
+			if(i->type == XML_DTD_NODE)
+				buffer_ += "<!DOCTYPE html>\n"; // only internal subset set by fragment_output::xhtml5()
+			else if(i->type == XML_ELEMENT_NODE) {
+				write_node(i, buffer_);
+				buffer_ += '\n';
+			} else if(i->type == XML_COMMENT_NODE)
+				comment(i->content != nullptr ? reinterpret_cast<const char*>(i->content) : "");
+		}
+		flush(flush_threshold_);
+	}
+
+	void xml_writer::serialized(boost::string_ref content, const fragment* owner) {
+		if(content.empty())
+			return;
+		write_open_elements();
+		if(chunked_ != nullptr && content.size() >= chunked_output::min_static_chunk)
+			chunked_->add_static(content, owner);
+		else if(sink_ && content.size() >= flush_threshold_) {
+			flush();
+			sink_(content);
+		} else {
+			buffer_.append(content.data(), content.size());
+			flush(flush_threshold_);
+		}
+	}
+
+	xmlpp::Element* xml_writer::scratch_element() {
+		if(!scratch_) {
+			scratch_.reset(new xmlpp::Document);
+			scratch_->create_root_node("scratch");
+		}
+		xmlpp::Element* root = scratch_->get_root_node();
+		for(xmlpp::Node* i : root->get_children())
+			root->remove_child(i);
+		xmlpp::Element* element = root->add_child(current().name);
+		scratch_node_ = element->cobj();
+		return element;
+	}
+
+	void xml_writer::copy_element(const xmlpp::Element*) {
+		// handler could have freed element, so it is looked up by address before it is dereferenced
+		const xmlNode* parent = scratch_->get_root_node()->cobj();
+		const xmlNode* target = parent->children;
+		while(target != nullptr && (target != scratch_node_ || target->type != XML_ELEMENT_NODE))
+			target = target->next;
+		if(target == nullptr) {
+			// handler has removed element
+			detach_element();
+			for(const xmlNode* i = parent->children; i != nullptr; i = i->next)
+				write_child(i);
+			return;
+		}
+
+		element& e = current();
+		std::string siblings;
+		for(const xmlNode* i = parent->children; i != target; i = i->next)
+			write_node(i, siblings);
+		if(!siblings.empty()) {
+			write_open_elements(1);
+			buffer_ += siblings;
+		}
+
+		e.name = reinterpret_cast<const char*>(target->name);
+		if(target->ns != nullptr)
+			e.prefix = target->ns->prefix != nullptr ? reinterpret_cast<const char*>(target->ns->prefix) : "";
+		for(const xmlAttr* i = target->properties; i != nullptr; i = i->next) {
+			std::string name = i->ns != nullptr && i->ns->prefix != nullptr ? reinterpret_cast<const char*>(i->ns->prefix) + std::string(":") : std::string();
+			name += reinterpret_cast<const char*>(i->name);
+			xmlChar* value = xmlNodeGetContent(reinterpret_cast<const xmlNode*>(i));
+			set_attribute(name, value != nullptr ? reinterpret_cast<const char*>(value) : "");
+			xmlFree(value);
+		}
+		for(const xmlNode* i = target->children; i != nullptr; i = i->next)
+			write_child(i);
+		for(const xmlNode* i = target->next; i != nullptr; i = i->next)
+			write_node(i, e.trailer);
+	}
+
+	void xml_writer::write_open_elements(const std::size_t except) {
+		for(; written_ + except < depth_; ++written_) {
+			element& e = elements_[written_];
+			if(!e.written) {
+				if(!e.detached)
+					write_start(e, written_ == 0, false);
+				e.written = true;
+			}
+		}
+	}
+
+	void xml_writer::write_start(element& e, const bool root, const bool empty) {
+		for(std::size_t i = e.deferred_count; i-- > 0;)
+			set_attribute_of(e.attributes, e.attribute_count, e.deferred[i].first, e.deferred[i].second);
+
+		buffer_ += '<';
+		if(!e.prefix.empty())
+			buffer_.append(e.prefix).append(1, ':');
+		buffer_ += e.name;
+		if(root) {
+			for(const namespace_declaration& ns : namespaces_) {
+				if(!embedded_)
+					write_namespace(ns, buffer_);
+			}
+			namespaces_end_ = buffer_.size();
+		} else if(namespaces_end_ == std::string::npos) {
+			const std::size_t scope = &e - &elements_[0] + 1;
+			for(const namespace_declaration& ns : namespaces_) {
+				if(ns.scope == scope)
+					write_namespace(ns, buffer_);
+			}
+		}
+		const bool html = (xhtml5_encoding_ & fragment_output::HTML5) && e.prefix.empty();
+		const bool minimize = html && (xhtml5_encoding_ & fragment_output::MINIMIZE_ATTRIBUTES);
+		for(std::size_t i = 0; i < e.attribute_count; ++i) {
+			buffer_.append(1, ' ').append(e.attributes[i].first);
+			if(minimize && html_minimized_attribute(e.attributes[i].first, e.attributes[i].second))
+				continue;
+			buffer_ += "=\"";
+			escape_attribute(e.attributes[i].second, buffer_);
+			buffer_ += '"';
+		}
+		if(!empty)
+			buffer_ += '>';
+		else if(!html)
+			buffer_ += "/>";
+		else if(html_void_element(e.name))
+			buffer_ += '>';
+		else
+			buffer_.append("></").append(e.name).append(1, '>');
+	}
+
+	void xml_writer::write_namespace(const namespace_declaration& ns, std::string& output) const {
+		if(!ns.has_uri)
+			return;
+		output += " xmlns";
+		if(!ns.prefix.empty())
+			output.append(1, ':').append(ns.prefix);
+		// quoted as xmlBufWriteQuotedString() does
+		const char quote = ns.uri.find('"') == std::string::npos ? '"' : '\'';
+		output.append(1, '=').append(1, quote).append(ns.uri).append(1, quote);
+	}
+
+	static void write_qualified_name(const xmlNs* ns, const xmlChar* name, std::string& output) {
+		if(ns != nullptr && ns->prefix != nullptr)
+			output.append(reinterpret_cast<const char*>(ns->prefix)).append(1, ':');
+		output += reinterpret_cast<const char*>(name);
+	}
+
+	void xml_writer::write_child(const xmlNode* node) {
+		// removed comment does not make parent non-empty
+		if(node->type == XML_COMMENT_NODE && (xhtml5_encoding_ & fragment_output::REMOVE_COMMENTS))
+			return;
+		write_open_elements();
+		write_node(node, buffer_);
+	}
+
+	void xml_writer::write_node(const xmlNode* node, std::string& output) const {
+		const char* content = reinterpret_cast<const char*>(node->content);
+		switch(node->type) {
+			case XML_TEXT_NODE:
+				if(content == nullptr)
+					break;
+				if(node->name == xmlStringTextNoenc)
+					output += content;
+				else if((xhtml5_encoding_ & fragment_output::HTML5) && html_element(node->parent)
+						&& html_raw_text_element(reinterpret_cast<const char*>(node->parent->name)))
+					append_raw_text(content, output);
+				else
+					escape_text(content, output);
+				break;
+			case XML_CDATA_SECTION_NODE:
+				// as xml_writer::cdata(), which writes it as text
+				if((xhtml5_encoding_ & fragment_output::HTML5) && html_element(node->parent)) {
+					if(html_raw_text_element(reinterpret_cast<const char*>(node->parent->name)))
+						append_raw_text(content != nullptr ? content : "", output);
+					else
+						escape_text(content != nullptr ? content : "", output);
+				} else
+					write_cdata(content != nullptr ? content : "", output);
+				break;
+			case XML_COMMENT_NODE:
+				if(!(xhtml5_encoding_ & fragment_output::REMOVE_COMMENTS))
+					output.append("<!--").append(content != nullptr ? content : "").append("-->");
+				break;
+			case XML_ENTITY_REF_NODE:
+				output.append(1, '&').append(reinterpret_cast<const char*>(node->name)).append(1, ';');
+				break;
+			case XML_PI_NODE:
+				output.append("<?").append(reinterpret_cast<const char*>(node->name));
+				if(content != nullptr)
+					output.append(1, ' ').append(content);
+				output += "?>";
+				break;
+			case XML_ELEMENT_NODE: {
+				const bool html = (xhtml5_encoding_ & fragment_output::HTML5) && html_element(node);
+				const bool minimize = html && (xhtml5_encoding_ & fragment_output::MINIMIZE_ATTRIBUTES);
+				output += '<';
+				write_qualified_name(node->ns, node->name, output);
+				for(const xmlNs* ns = node->nsDef; ns != nullptr; ns = ns->next) {
+					if(ns->href != nullptr)
+						write_namespace(namespace_declaration { ns->prefix != nullptr ? reinterpret_cast<const char*>(ns->prefix) : "",
+							reinterpret_cast<const char*>(ns->href), true, 0 }, output);
+				}
+				for(const xmlAttr* attribute = node->properties; attribute != nullptr; attribute = attribute->next) {
+					output += ' ';
+					write_qualified_name(attribute->ns, attribute->name, output);
+					if(minimize && attribute->ns == nullptr && (attribute->children == nullptr || (attribute->children->next == nullptr
+							&& attribute->children->type == XML_TEXT_NODE && html_minimized_attribute(reinterpret_cast<const char*>(attribute->name),
+								attribute->children->content != nullptr ? reinterpret_cast<const char*>(attribute->children->content) : ""))))
+						continue;
+					output += "=\"";
+					for(const xmlNode* i = attribute->children; i != nullptr; i = i->next) {
+						if(i->type == XML_ENTITY_REF_NODE)
+							output.append(1, '&').append(reinterpret_cast<const char*>(i->name)).append(1, ';');
+						else if(i->content != nullptr)
+							escape_attribute(reinterpret_cast<const char*>(i->content), output);
+					}
+					output += '"';
+				}
+				if(node->children == nullptr) {
+					if(!html)
+						output += "/>";
+					else if(html_void_element(reinterpret_cast<const char*>(node->name)))
+						output += '>';
+					else
+						output.append("></").append(reinterpret_cast<const char*>(node->name)).append(1, '>');
+					break;
+				}
+				output += '>';
+				for(const xmlNode* i = node->children; i != nullptr; i = i->next)
+					write_node(i, output);
+				output += "</";
+				write_qualified_name(node->ns, node->name, output);
+				output += '>';
+				break;
+			}
+			default:
+				throw std::runtime_error("xml_writer: can not write node " + std::string(reinterpret_cast<const char*>(node->name)));
+		}
+	}
+
+	void xml_writer::escape_text(boost::string_ref content, std::string& output) {
+		std::size_t start = 0;
+		for(std::size_t i = 0; i < content.size(); ++i) {
+			const char* replacement;
+			switch(content[i]) {
+				case '<': replacement = "&lt;"; break;
+				case '>': replacement = "&gt;"; break;
+				case '&': replacement = "&amp;"; break;
+				case '\r': replacement = "&#13;"; break;
+				default: continue;
+			}
+			output.append(content.data() + start, i - start).append(replacement);
+			start = i + 1;
+		}
+		output.append(content.data() + start, content.size() - start);
+	}
+
+	void xml_writer::escape_attribute(boost::string_ref value, std::string& output) {
+		std::size_t start = 0;
+		for(std::size_t i = 0; i < value.size(); ++i) {
+			const char* replacement;
+			switch(value[i]) {
+				case '<': replacement = "&lt;"; break;
+				case '>': replacement = "&gt;"; break;
+				case '&': replacement = "&amp;"; break;
+				case '"': replacement = "&quot;"; break;
+				case '\n': replacement = "&#10;"; break;
+				case '\r': replacement = "&#13;"; break;
+				case '\t': replacement = "&#9;"; break;
+				default: continue;
+			}
+			output.append(value.data() + start, i - start).append(replacement);
+			start = i + 1;
+		}
+		output.append(value.data() + start, value.size() - start);
+	}
+
+	void tag::render(xml_writer& dst, const xmlpp::Element* src, render::context& ctx) const {
+		xmlpp::Element* element = dst.scratch_element();
+		render(element, src, ctx);
+		dst.copy_element(element);
+	}
+
+	void xmlns::tag(xml_writer& dst, const xmlpp::Element* src, render::context& ctx) const {
+		xmlpp::Element* element = dst.scratch_element();
+		tag(element, src, ctx);
+		dst.copy_element(element);
+	}
+
+	void xmlns::attribute(xml_writer& dst, const xmlpp::Attribute* src, render::context& ctx) const {
+		xmlpp::Element* element = dst.scratch_element();
+		attribute(element, src, ctx);
+		dst.copy_element(element);
+	}
+
+
+	/// Load fragment from file 'filename', fragment name is filename
+	fragment::fragment(const Glib::ustring& filename, context& ctx)
+		: name_(filename), context_(ctx){
+		STACKED_EXCEPTIONS_ENTER();
+		reader_.set_substitute_entities(false);
+		reader_.set_validate(false);		
+		reader_.parse_file(filename);		
+		reader_.get_document()->get_root_node()->set_namespace_declaration("webpp://control", "webpp_control");
+		apply_stylesheets();
+		fold_constants(get_document().get_root_node(), true);
+		prepare_xmlnses(get_document().get_root_node());
+		index_nodes(get_document().get_root_node());
+		compile();
+		STACKED_EXCEPTIONS_LEAVE("parsing file '" + filename + "'");
+	}
+
+	/// Load fragment name 'name' from in-memory 'buffer'
+	fragment::fragment(const Glib::ustring& name, const Glib::ustring& buffer, context& ctx)
+		: name_(name), context_(ctx) {
+		STACKED_EXCEPTIONS_ENTER();
+		reader_.set_substitute_entities(false);
+		reader_.set_validate(false);
+		reader_.parse_memory(buffer);
+		reader_.get_document()->get_root_node()->set_namespace_declaration("webpp://control", "webpp_control");
+		apply_stylesheets();
+		fold_constants(get_document().get_root_node(), true);
+		prepare_xmlnses(get_document().get_root_node());
+		index_nodes(get_document().get_root_node());
+		compile();
+		STACKED_EXCEPTIONS_LEAVE("parsing memory buffer named '" + name + "':<<XML\n" + buffer + "\nXML\n");
+	}
+
+	void fragment::apply_stylesheets() {
+		if(context_.get_stylesheets().empty())
+			return;
+
+		xmlDoc *current = reader_.get_document()->cobj(), *prev = nullptr;
+		for(const auto& stylesheet : context_.get_stylesheets()) {
+			const char* params[] = { nullptr };
+
+			if(prev != nullptr && prev != reader_.get_document()->cobj())
+				xmlFreeDoc(prev);
+
+			prev = current;
+			// TODO: handle errors (it is NOT easy, requires global state)
+			current = xsltApplyStylesheet(stylesheet.get(), prev, params);
+			if(current == nullptr) {
+				if(prev != reader_.get_document()->cobj())
+					xmlFreeDoc(prev);
+				throw std::runtime_error("Could not apply XSL stylesheet");
+			}
+		}
+		processed_document_.reset(new xmlpp::Document(current));
+	}
+
+	void fragment::fold_constants(xmlpp::Element* element, bool root) {
+		// outer repeat is not removed, render reports its errors and tests visibility of each item
+		bool outer = false;
+		for(const xmlpp::Attribute* attribute : element->get_attributes())
+			outer = outer || (attribute->get_namespace_uri() == "webpp://control" && attribute->get_name() == "repeat" && attribute->get_value() == "outer");
+
+		for(xmlpp::Attribute* attribute : element->get_attributes()) {
+			if(outer || attribute->get_namespace_uri() != "webpp://control" || attribute->get_name() != "visible-if")
+				continue;
+
+			std::string folded;
+			const boost::logic::tribool visible = expressions::fold_test_expression(attribute->get_value(), context_.get_constants(), folded);
+			if(visible) {
+				element->remove_attribute(attribute->get_name(), attribute->get_namespace_prefix());
+			} else if(!visible) {
+				// root stays, render reports empty document (or removes it, when fragment is inserted)
+				if(root) {
+					attribute->set_value(folded);
+					return;
+				}
+				element->get_parent()->remove_child(element);
+				return;
+			} else if(folded != attribute->get_value()) {
+				attribute->set_value(folded);
+			}
+			break;
+		}
+
+		// custom tags handle their children
+		const Glib::ustring ns = element->get_namespace_uri();
+		if(ns != "webpp://html5" && ns != "webpp://xml" && ns.raw().find("webpp://") != std::string::npos)
+			return;
+
+		for(xmlpp::Node* child : element->get_children()) {
+			xmlpp::Element* child_element = dynamic_cast<xmlpp::Element*>(child);
+			if(child_element != nullptr)
+				fold_constants(child_element, false);
+		}
+	}
+
+	void fragment::prepare_xmlnses(const xmlpp::Element* element) {
+		// unknown namespaces are reported during render
+		const Glib::ustring ns = element->get_namespace_uri();
+		const namespace_id id = intern_namespace(ns);
+		const bool custom = id == namespace_id::control || id == namespace_id::custom;
+		const xmlns* element_handler = custom ? context_.find_xmlns(ns) : nullptr;
+		if(element_handler != nullptr)
+			element_handler->prepare(element);
+
+		const xmlns* prepared = element_handler;
+		for(const xmlpp::Attribute* attribute : element->get_attributes()) {
+			const Glib::ustring attribute_ns = attribute->get_namespace_uri();
+			if(attribute_ns.empty() || attribute_ns == "webpp://control")
+				continue;
+			const xmlns* handler = context_.find_xmlns(attribute_ns);
+			if(handler != nullptr && handler != prepared) {
+				handler->prepare(element);
+				prepared = handler;
+			}
+		}
+
+		// custom tags handle their children
+		if(custom)
+			return;
+
+		for(const xmlpp::Node* child : element->get_children()) {
+			const xmlpp::Element* child_element = dynamic_cast<const xmlpp::Element*>(child);
+			if(child_element != nullptr)
+				prepare_xmlnses(child_element);
+		}
+	}
+
+	namespace_id intern_namespace(const Glib::ustring& uri) {
+		const std::string& raw = uri.raw();
+		if(raw.empty())
+			return namespace_id::none;
+		if(raw.compare(0, 8, "webpp://") != 0)
+			return raw.find("webpp://") == std::string::npos ? namespace_id::foreign : namespace_id::custom;
+		if(raw == "webpp://xml")
+			return namespace_id::xml;
+		if(raw == "webpp://html5")
+			return namespace_id::html5;
+		if(raw == "webpp://control")
+			return namespace_id::control;
+		return namespace_id::custom;
+	}
+
+	static control_id intern_control(const Glib::ustring& name) {
+		if(name == "repeat")
+			return control_id::repeat;
+		if(name == "repeat-array")
+			return control_id::repeat_array;
+		if(name == "repeat-variable")
+			return control_id::repeat_variable;
+		if(name == "visible-if")
+			return control_id::visible_if;
+		if(name == "repeat-once")
+			return control_id::repeat_once;
+		return control_id::unknown;
+	}
+
+	/// \brief c:visible-if resolved when fragment is loaded, syntax errors are left for render to report
+	static const expressions::compiled_expression* compile_test(const Glib::ustring& expression) {
+		try {
+			return &expressions::intern_compiled_expression(expression.raw());
+		} catch(const std::exception&) {
+			return nullptr;
+		}
+	}
+
+	static bool evaluate_test(const fragment::attribute_info& attribute, render::context& rnd) {
+		return attribute.expression != nullptr
+			? expressions::evaluate_test_expression(*attribute.expression, rnd)
+			: expressions::evaluate_test_expression(attribute.value.raw(), rnd);
+	}
+
+	void fragment::index_nodes(const xmlpp::Element* element) {
+		node_info& info = nodes_[element];
+		info.element = element;
+		const Glib::ustring ns = element->get_namespace_uri();
+		info.ns = intern_namespace(ns);
+		info.control_insert = info.ns == namespace_id::control && element->get_name() == "insert";
+		info.repeat_once = false;
+		info.has_id = false;
+
+		for(const xmlpp::Attribute* attribute : element->get_attributes()) {
+			const Glib::ustring attribute_ns = attribute->get_namespace_uri();
+			attribute_info a { attribute, attribute->get_name(), attribute->get_value(), intern_namespace(attribute_ns), control_id::unknown, nullptr, nullptr, nullptr };
+			if(a.ns == namespace_id::control)
+				a.control = intern_control(a.name);
+			if(a.control == control_id::visible_if)
+				a.expression = compile_test(a.value);
+			if(a.control == control_id::repeat_once && a.value == "yes")
+				info.repeat_once = true;
+			// same attribute as xmlpp::Element::get_attribute("id"), which ignores namespaces
+			if(a.name == "id" && !info.has_id) {
+				info.has_id = true;
+				info.id = a.value;
+			}
+			info.attributes.push_back(a);
+		}
+		resolve_handlers(info);
+
+		info.static_tree = (info.ns == namespace_id::xml || info.ns == namespace_id::html5) && !info.has_id;
+		for(const attribute_info& a : info.attributes)
+			info.static_tree = info.static_tree && a.ns == namespace_id::none;
+
+		for(const xmlpp::Node* child : element->get_children()) {
+			info.children.push_back(child);
+			const xmlpp::Element* child_element = dynamic_cast<const xmlpp::Element*>(child);
+			if(child_element != nullptr) {
+				index_nodes(child_element);
+				const node_info& child_info = nodes_[child_element];
+				info.static_tree = info.static_tree && child_info.static_tree;
+				info.child_elements.push_back(&child_info);
+			} else
+				info.child_elements.push_back(nullptr);
+		}
+	}
+
+	void fragment::resolve_handlers(node_info& info) {
+		const Glib::ustring ns = info.element->get_namespace_uri();
+		info.tag_handler = info.ns == namespace_id::custom ? context_.find_tag(ns, info.element->get_name()) : nullptr;
+		info.xmlns_handler = info.ns == namespace_id::custom ? context_.find_xmlns(ns) : nullptr;
+		info.compiled = info.tag_handler == nullptr && info.xmlns_handler != nullptr ? info.xmlns_handler->compile(info.element) : nullptr;
+		for(attribute_info& a : info.attributes) {
+			a.handler = a.ns != namespace_id::control && a.ns != namespace_id::none ? context_.find_xmlns(a.attribute->get_namespace_uri()) : nullptr;
+			a.compiled = a.handler != nullptr ? a.handler->compile(a.attribute) : nullptr;
+		}
+	}
+
+	void fragment::bind_handlers() {
+		prepare_xmlnses(get_document().get_root_node());
+		for(auto& i : nodes_)
+			resolve_handlers(i.second);
+	}
+
+	const fragment::node_info& fragment::info(const xmlpp::Element* element) const {
+		auto i = nodes_.find(element);
+		if(i == nodes_.end())
+			throw std::logic_error("element " + element->get_name() + " is not part of fragment " + name_);
+		return i->second;
+	}
+
+	std::size_t fragment::emit(const program::opcode op, const node_info* node, const unsigned argument) {
+		program_.code.push_back(program::instruction { op, argument, 0, 0, node });
+		return program_.code.size() - 1;
+	}
+
+	std::size_t fragment::emit_fail(const std::string& message) {
+		program_.strings.push_back(message);
+		return emit(program::opcode::fail, nullptr, program_.strings.size() - 1);
+	}
+
+	void fragment::compile() {
+		std::vector<std::size_t> exits;
+		compile_element(info(get_document().get_root_node()), false, exits);
+		for(const std::size_t i : exits)
+			program_.code[i].exit = program_.code.size();
+	}
+
+	void fragment::compile_element(const node_info& info, const bool in_outer_repeat, std::vector<std::size_t>& exits) {
+		typedef program::opcode op;
+		enum { inner, outer, none } repeat_type = none;
+		Glib::ustring repeat_variable, repeat_array;
+		bool tested = false, unchecked = false;
+
+		// control attributes, in order of prepared_fragment::process_node
+		for(unsigned i = 0; i < info.attributes.size(); ++i) {
+			const attribute_info& attribute = info.attributes[i];
+			if(attribute.ns != namespace_id::control)
+				continue;
+			switch(attribute.control) {
+				case control_id::repeat:
+					if(attribute.value == "inner")
+						repeat_type = inner;
+					else if(attribute.value == "outer")
+						repeat_type = outer;
+					else {
+						emit_fail((boost::format("repeat must be one of (inner,outer), not '%s' in line '%s', tag '%s'")
+							% attribute.value % info.element->get_line() % info.element->get_name()).str());
+						return;
+					}
+					break;
+				case control_id::repeat_array:
+					repeat_array = attribute.value;
+					break;
+				case control_id::repeat_variable:
+					repeat_variable = attribute.value;
+					break;
+				case control_id::visible_if:
+					if(repeat_type != outer || in_outer_repeat) {
+						emit(tested ? op::test_and : op::test, &info, i);
+						tested = unchecked = true;
+					}
+					break;
+				case control_id::repeat_once:
+					break;
+				case control_id::unknown:
+					emit_fail("webpp://control atribute " + attribute.name + " is not implemented");
+					return;
+			}
+			// invisible element is dropped before its next control attribute, unless it is outer repeat
+			if(unchecked && repeat_type != outer) {
+				exits.push_back(emit(op::discard_if_invisible));
+				unchecked = false;
+			}
+		}
+		if(unchecked)
+			exits.push_back(emit(op::discard_if_invisible));
+
+		if(in_outer_repeat && repeat_type == outer)
+			repeat_type = none;
+
+		if(repeat_type == outer) {
+			if(info.element->get_parent() == nullptr) {
+				emit_fail("outer repeat on root element is not possible");
+				return;
+			}
+			if(repeat_variable.empty() || repeat_array.empty()) {
+				emit_fail("repeat attribute set, but repeat_variable or repeat_array is not set");
+				return;
+			}
+			program_.repeats.push_back(program::repeat { repeat_variable, render::path(repeat_array), render::path(repeat_variable + "-index") });
+			const unsigned repeat = program_.repeats.size() - 1;
+			exits.push_back(emit(op::begin_outer, &info, repeat));
+			const std::size_t loop = emit(op::next_outer, &info, repeat);
+			std::vector<std::size_t> item_exits;
+			compile_element(info, true, item_exits);
+			emit(op::close);
+			for(const std::size_t i : item_exits)
+				program_.code[i].exit = program_.code.size();
+			const std::size_t more = emit(op::more_outer, &info);
+			program_.code[more].target = loop;
+			// items are closed already, so jump over close of parent
+			exits.push_back(more);
+			return;
+		}
+
+		// c:insert has precedence over view inserted by id
+		std::size_t insertion = std::string::npos;
+		if(info.has_id && !info.control_insert) {
+			insertion = emit(op::insertion, &info);
+			exits.push_back(insertion);
+		}
+
+		bool nochildren = true; // custom tags handle their children
+		if(info.ns != namespace_id::control && info.ns != namespace_id::custom) {
+			emit(op::begin_element, &info);
+			for(unsigned i = 0; i < info.attributes.size(); ++i) {
+				switch(info.attributes[i].ns) {
+					case namespace_id::none:
+						emit(op::set_attribute, &info, i);
+						break;
+					case namespace_id::control:
+						break;
+					default:
+						emit(op::xmlns_attribute, &info, i);
+				}
+			}
+			nochildren = false;
+		} else if(info.control_insert) {
+			const xmlpp::Attribute* name = info.element->get_attribute("name");
+			const xmlpp::Attribute* value_prefix = info.element->get_attribute("value-prefix");
+			if(name == nullptr)
+				emit_fail("webpp://control:insert requires attribute name (inserted view name)");
+			else if(value_prefix == nullptr)
+				emit_fail("webpp://control:insert requires attribute value-prefix (prefix for render context variables)");
+			else {
+				program_.inserts.push_back(program::insert { name->get_value(), render::path(value_prefix->get_value()) });
+				exits.push_back(emit(op::insert, &info, program_.inserts.size() - 1));
+			}
+		} else if(info.ns == namespace_id::control)
+			emit_fail("unknown webpp://control tag: " + info.element->get_name());
+		else
+			emit(op::call_tag, &info);
+
+		if(repeat_type == none) {
+			if(!nochildren)
+				compile_children(info, false);
+		} else if(repeat_variable.empty() || repeat_array.empty()) {
+			emit_fail("repeat attribute set, but repeat_variable or repeat_array is not set");
+		} else {
+			program_.repeats.push_back(program::repeat { repeat_variable, render::path(repeat_array), render::path(repeat_variable + "-index") });
+			emit(op::begin_inner, &info, program_.repeats.size() - 1);
+			const std::size_t next = emit(op::next_inner, &info);
+			compile_children(info, true);
+			program_.code[emit(op::jump)].target = next;
+			program_.code[next].target = program_.code.size();
+		}
+
+		// inserted view replaces element with its children
+		if(insertion != std::string::npos)
+			program_.code[insertion].target = program_.code.size();
+	}
+
+	void fragment::compile_children(const node_info& info, const bool direct_inside_inner) {
+		typedef program::opcode op;
+		// static element is part of blob of its parent, unless it is root
+		const bool in_blob = info.static_tree && info.element->get_parent() != nullptr;
+		std::size_t blob = std::string::npos;
+		unsigned blob_start = 0;
+		for(unsigned i = 0; i < info.children.size(); ++i) {
+			const xmlpp::Element* child = dynamic_cast<const xmlpp::Element*>(info.children[i]);
+			if(!in_blob && (child == nullptr || this->info(child).static_tree)) {
+				if(blob == std::string::npos) {
+					blob = emit(op::blob);
+					blob_start = i;
+				}
+			} else if(blob != std::string::npos) {
+				compile_blob(info, blob, blob_start, i);
+				blob = std::string::npos;
+			}
+
+			if(child == nullptr) {
+				emit(info.children[i]->cobj()->type == XML_COMMENT_NODE ? op::comment : op::copy, &info, i);
+				continue;
+			}
+
+			const node_info& child_info = this->info(child);
+			std::size_t skip = std::string::npos;
+			if(direct_inside_inner && child_info.repeat_once)
+				skip = emit(op::skip_repeated);
+			std::vector<std::size_t> exits;
+			emit(op::open_child, &child_info);
+			compile_element(child_info, false, exits);
+			emit(op::close);
+			for(const std::size_t e : exits)
+				program_.code[e].exit = program_.code.size();
+			if(skip != std::string::npos)
+				program_.code[skip].target = program_.code.size();
+		}
+		if(blob != std::string::npos)
+			compile_blob(info, blob, blob_start, info.children.size());
+	}
+
+	void fragment::compile_blob(const node_info& info, const std::size_t blob, const unsigned first, const unsigned last) {
+		program::instruction& i = program_.code[blob];
+		i.node = &info;
+		i.argument = program_.blobs.size();
+		i.exit = program_.code.size();
+
+		program::blob b { std::string(), std::string(), std::string(), std::string(), false };
+		for(const int encoding : { 0, static_cast<int>(fragment_output::REMOVE_COMMENTS), static_cast<int>(fragment_output::HTML5),
+				fragment_output::HTML5 | fragment_output::REMOVE_COMMENTS }) {
+			std::string buffer;
+			xml_writer writer(buffer, encoding | fragment_output::REMOVE_XML_DECLARATION);
+			writer.open_element("blob");
+			writer.text(boost::string_ref());
+			const std::size_t start = buffer.size();
+			for(unsigned c = first; c < last; ++c) {
+				const xmlpp::Element* child = dynamic_cast<const xmlpp::Element*>(info.children[c]);
+				if(child == nullptr)
+					writer.copy(info.children[c]);
+				else if(write_static(writer, this->info(child)))
+					b.html5 = true;
+			}
+			std::string& content = encoding & fragment_output::HTML5 ? (encoding & fragment_output::REMOVE_COMMENTS ? b.html_without_comments : b.html_content)
+				: (encoding & fragment_output::REMOVE_COMMENTS ? b.without_comments : b.content);
+			content = buffer.substr(start);
+		}
+		program_.blobs.push_back(std::move(b));
+	}
+
+	bool fragment::write_static(xml_writer& writer, const node_info& info) const {
+		// as stream_output does for open_child, begin_element, set_attribute and copy
+		bool html5 = info.ns == namespace_id::html5;
+		writer.open_element(reinterpret_cast<const char*>(info.element->cobj()->name));
+		for(const attribute_info& a : info.attributes)
+			writer.set_attribute(a.name.raw(), a.value.raw());
+		for(const xmlpp::Node* child : info.children) {
+			const xmlpp::Element* element = dynamic_cast<const xmlpp::Element*>(child);
+			if(element == nullptr)
+				writer.copy(child);
+			else
+				html5 = write_static(writer, this->info(element)) || html5;
+		}
+		writer.close_element();
+		return html5;
+	}
+
+	/// Return all nodes in fragment, matching given XPath expression
+/*	xmlpp::NodeSet fragment::find_by_xpath(const Glib::ustring& query) {
+		return reader_.get_document()->get_root_node()->find(query);
+	}
+*/
+
+    xmlpp::Element* prepared_fragment::create_output(xmlpp::Document& output, const bool comments) const {
+		const xmlpp::Element* src = fragment_.get_document().get_root_node();
+
+        // copy children prev and next to root element, without processing (comments...)
+		for(xmlNode* i = fragment_.get_document().cobj()->children; i != src->cobj() && i != nullptr && comments; i = i->next) {
+            if(i->type == XML_COMMENT_NODE) {
+                xmlChar* comment = xmlNodeGetContent(i);
+                output.add_comment(Glib::ustring(reinterpret_cast<const char*>(comment)));
+                xmlFree(comment);
+            }
+        }
+
+        output.create_root_node(src->get_name());
+        xmlpp::Element* dst = output.get_root_node();
+
+        for(const xmlNode* i = src->cobj(); i != nullptr && comments; i = i->next) {
+            if(i->type == XML_COMMENT_NODE) {
+                xmlChar* comment = xmlNodeGetContent(i);
+                output.add_comment(Glib::ustring(reinterpret_cast<const char*>(comment)));
+                xmlFree(comment);
+            }
+        }
+        return dst;
+	}
+
+	/// Output of running program, current element is the last one opened and not closed
+	struct prepared_fragment::program_output {
+		virtual ~program_output() {}
+		/// add child named as 'src' to current element
+		virtual void open(const xmlpp::Element* src) = 0;
+		virtual void close() = 0;
+		/// remove current element, it is not root
+		virtual void discard() = 0;
+		/// set name and namespace of current element
+		virtual void begin_element(const fragment::node_info& info) = 0;
+		virtual void set_attribute(const fragment::attribute_info& attribute) = 0;
+		virtual void attribute(const xmlns& handler, const xmlpp::Attribute* src, const compiled_node* compiled, render::context& rnd) = 0;
+		virtual void copy(const xmlpp::Node* node) = 0;
+		/// append static nodes of fragment 'owner', return false if they have to be copied one by one
+		virtual bool blob(const fragment::program::blob& blob, const fragment& owner) = 0;
+		virtual void tag(const tag& handler, const xmlpp::Element* src, render::context& rnd) = 0;
+		virtual void tag(const xmlns& handler, const xmlpp::Element* src, const compiled_node* compiled, render::context& rnd) = 0;
+		/// view with root in current element is going to be inserted
+		virtual void begin_insertion(const Glib::ustring& id) = 0;
+		virtual void end_insertion(const Glib::ustring& id) = 0;
+		/// before repeat ('first') and after each of its items
+		virtual void repeat_boundary(const bool first) = 0;
+		/// serializer of streamed output, nullptr for output document
+		virtual xml_writer* serializer() = 0;
+	};
+
+	struct prepared_fragment::dom_output : prepared_fragment::program_output {
+		xmlpp::Document& output;
+		std::vector<xmlpp::Element*> elements;
+		bool comments; // false for fragment_output::REMOVE_COMMENTS
+
+		dom_output(xmlpp::Document& output, xmlpp::Element* root, const bool comments = true) : output(output), elements(1, root), comments(comments) {}
+
+		/// handlers do not know about fragment_output::REMOVE_COMMENTS, remove comments they added after 'prev' to 'parent'
+		void remove_comments(xmlNode* parent, xmlNode* prev) const {
+			for(xmlNode* i = prev != nullptr ? prev->next : parent->children; i != nullptr;) {
+				xmlNode* next = i->next;
+				if(i->type == XML_COMMENT_NODE) {
+					xmlpp::Node::free_wrappers(i);
+					xmlUnlinkNode(i);
+					xmlFreeNode(i);
+				} else if(i->type == XML_ELEMENT_NODE)
+					remove_comments(i, nullptr);
+				i = next;
+			}
+		}
+
+		virtual void open(const xmlpp::Element* src) {
+			// xmlpp::Element::add_child() copies name, node of document takes it from dictionary of document
+			xmlNode* node = xmlNewDocNode(output.cobj(), nullptr, src->cobj()->name, nullptr);
+			xmlAddChild(elements.back()->cobj(), node);
+			xmlpp::Node::create_wrapper(node);
+			elements.push_back(static_cast<xmlpp::Element*>(node->_private));
+		}
+
+		virtual void close() {
+			elements.pop_back();
+		}
+
+		virtual void discard() {
+			xmlpp::Element* element = elements.back();
+			element->get_parent()->remove_child(element);
+			elements.pop_back();
+		}
+
+		virtual void begin_element(const fragment::node_info& info) {
+			const xmlpp::Element* src = info.element;
+			if(info.ns == namespace_id::html5)
+				output.get_root_node()->set_namespace_declaration("http://www.w3.org/1999/xhtml");
+			else if(info.ns != namespace_id::xml) {
+				output.get_root_node()->set_namespace_declaration(src->get_namespace_uri(), src->get_namespace_prefix());
+				elements.back()->set_namespace(src->get_namespace_prefix());
+			}
+			elements.back()->set_name(src->get_name());
+		}
+
+		virtual void set_attribute(const fragment::attribute_info& attribute) {
+			elements.back()->set_attribute(attribute.name, attribute.value);
+		}
+
+		virtual void attribute(const xmlns& handler, const xmlpp::Attribute* src, const compiled_node* compiled, render::context& rnd) {
+			handler.attribute(elements.back(), src, compiled, rnd);
+		}
+
+		virtual void copy(const xmlpp::Node* node) {
+			elements.back()->import_node(node);
+		}
+
+		virtual bool blob(const fragment::program::blob&, const fragment&) {
+			// nodes of output document can not be shared, imported copy would keep namespaces of fragment
+			return false;
+		}
+
+		virtual void tag(const xml::tag& handler, const xmlpp::Element* src, render::context& rnd) {
+			// handler can replace current element, its output starts after previous sibling
+			xmlNode* parent = elements.back()->cobj()->parent, *prev = elements.back()->cobj()->prev;
+			handler.render(elements.back(), src, rnd);
+			if(!comments)
+				remove_comments(parent, prev);
+		}
+
+		virtual void tag(const xmlns& handler, const xmlpp::Element* src, const compiled_node* compiled, render::context& rnd) {
+			xmlNode* parent = elements.back()->cobj()->parent, *prev = elements.back()->cobj()->prev;
+			handler.tag(elements.back(), src, compiled, rnd);
+			if(!comments)
+				remove_comments(parent, prev);
+		}
+
+		virtual void begin_insertion(const Glib::ustring&) {}
+
+		virtual void end_insertion(const Glib::ustring& id) {
+			elements.back()->set_attribute("id", id);
+		}
+
+		virtual void repeat_boundary(const bool) {}
+
+		virtual xml_writer* serializer() { return nullptr; }
+	};
+
+	struct prepared_fragment::stream_output : prepared_fragment::program_output {
+		xml_writer& writer;
+
+		explicit stream_output(xml_writer& writer) : writer(writer) {}
+
+		virtual void open(const xmlpp::Element* src) {
+			writer.open_element(reinterpret_cast<const char*>(src->cobj()->name));
+		}
+
+		virtual void close() {
+			writer.close_element();
+		}
+
+		virtual void discard() {
+			writer.remove_element();
+		}
+
+		virtual void begin_element(const fragment::node_info& info) {
+			const xmlpp::Element* src = info.element;
+			const xmlNs* ns = src->cobj()->ns;
+			if(info.ns == namespace_id::html5)
+				writer.set_namespace_declaration("http://www.w3.org/1999/xhtml");
+			else if(info.ns != namespace_id::xml) {
+				const char* prefix = ns != nullptr && ns->prefix != nullptr ? reinterpret_cast<const char*>(ns->prefix) : "";
+				writer.set_namespace_declaration(ns != nullptr && ns->href != nullptr ? reinterpret_cast<const char*>(ns->href) : "", prefix);
+				writer.set_namespace(prefix);
+			}
+			writer.set_name(reinterpret_cast<const char*>(src->cobj()->name));
+		}
+
+		virtual void set_attribute(const fragment::attribute_info& attribute) {
+			writer.set_attribute(attribute.name.raw(), attribute.value.raw());
+		}
+
+		virtual void attribute(const xmlns& handler, const xmlpp::Attribute* src, const compiled_node* compiled, render::context& rnd) {
+			handler.attribute(writer, src, compiled, rnd);
+		}
+
+		virtual void copy(const xmlpp::Node* node) {
+			writer.copy(node);
+		}
+
+		virtual bool blob(const fragment::program::blob& blob, const fragment& owner) {
+			const int encoding = writer.xhtml5_encoding();
+			// blobs are serialized with values of all attributes
+			if((encoding & fragment_output::HTML5) && (encoding & fragment_output::MINIMIZE_ATTRIBUTES))
+				return false;
+			if(blob.html5)
+				writer.set_namespace_declaration("http://www.w3.org/1999/xhtml");
+			if(encoding & fragment_output::HTML5)
+				writer.serialized(encoding & fragment_output::REMOVE_COMMENTS ? blob.html_without_comments : blob.html_content, &owner);
+			else
+				writer.serialized(encoding & fragment_output::REMOVE_COMMENTS ? blob.without_comments : blob.content, &owner);
+			return true;
+		}
+
+		virtual void tag(const xml::tag& handler, const xmlpp::Element* src, render::context& rnd) {
+			handler.render(writer, src, rnd);
+		}
+
+		virtual void tag(const xmlns& handler, const xmlpp::Element* src, const compiled_node* compiled, render::context& rnd) {
+			handler.tag(writer, src, compiled, rnd);
+		}
+
+		virtual void begin_insertion(const Glib::ustring& id) {
+			writer.defer_attribute("id", id.raw());
+		}
+
+		virtual void end_insertion(const Glib::ustring&) {}
+
+		virtual void repeat_boundary(const bool first) {
+			writer.flush(first ? 1 : writer.flush_threshold());
+		}
+
+		virtual xml_writer* serializer() { return &writer; }
+	};
+
+	/// Output and repeats of running program, shared with inserted fragments
+	struct prepared_fragment::program_state {
+		struct repeat_frame {
+			const fragment::program::repeat* repeat;
+			render::array_base* array;
+			int index;
+			std::unique_ptr<render::repeat_guard> guard;
+		};
+
+		program_output& output;
+		render::context& rnd;
+		std::vector<const xmlpp::Element*> sources; // source of each open output element, current last
+		std::vector<repeat_frame> repeats; // innermost last
+		bool visible; // result of last c:visible-if
+		bool comments; // copy comments of fragments, false for fragment_output::REMOVE_COMMENTS
+
+		program_state(program_output& output, render::context& rnd, const xmlpp::Element* root, const bool comments = true)
+			: output(output), rnd(rnd), sources(1, root), visible(true), comments(comments) {}
+		~program_state() {
+			while(!repeats.empty())
+				repeats.pop_back();
+		}
+
+		void open(const xmlpp::Element* src) {
+			output.open(src);
+			sources.push_back(src);
+		}
+
+		void close() {
+			output.close();
+			sources.pop_back();
+		}
+
+		/// \brief Remove current output element, it must not be root of output
+		void discard() {
+			if(sources.size() == 1)
+				throw std::runtime_error("response resulted in empty document");
+			output.discard();
+			sources.pop_back();
+		}
+	};
+
+	static std::string node_description(const xmlpp::Element* src) {
+		return "node " + src->get_namespace_uri() + ":" + src->get_name() + " at line " + boost::lexical_cast<std::string>(src->get_line());
+	}
+
+	static void rethrow_in_node(const std::exception_ptr& e, const xmlpp::Element* node) {
+		STACKED_EXCEPTIONS_ENTER();
+		std::rethrow_exception(e);
+		STACKED_EXCEPTIONS_LEAVE(node_description(node));
+	}
 
+	/// Program of fragment with inserted fragments resolved, built once for prepared fragment
+	struct prepared_fragment::bound_fragment {
+		struct slot {
+			const bound_fragment* inserted; // fragment of c:insert, or view inserted by id; nullptr if it was not found
+			const view_insertion* view; // view inserted by id of 'insertion' instruction
+		};
+
+		std::shared_ptr<const fragment> source; // kept alive when context reloads it
+		bool views; // view insertions apply to fragment, they do not apply to fragments of c:insert
+		std::vector<slot> slots; // by instruction of program
+	};
+
+	struct prepared_fragment::bindings {
+		view_insertions_t view_insertions;
+		std::deque<bound_fragment> fragments; // first is prepared fragment, deque keeps slots pointing to others valid
+	};
+
+	const prepared_fragment::bound_fragment& prepared_fragment::bind() {
+		if(!bindings_) {
+			// without view insertions, all prepared fragments of fragment are bound the same way
+			const bool shared = view_insertions_.empty();
+			if(shared) {
+				auto i = context_.bindings_.find(&fragment_);
+				if(i != context_.bindings_.end())
+					bindings_ = i->second;
+			}
+			if(!bindings_) {
+				std::shared_ptr<bindings> result = std::make_shared<bindings>();
+				result->view_insertions = view_insertions_;
+				boost::unordered_map<std::pair<const fragment*, bool>, bound_fragment*> bound;
+				// binding can load fragments, which forgets bindings of context
+				bind(*result, bound, fragment_, true);
+				bindings_ = result;
+				if(shared)
+					context_.bindings_[&fragment_] = bindings_;
+			}
+		}
+		return bindings_->fragments.front();
+	}
 
-	/// Load fragment from file 'filename', fragment name is filename
-	fragment::fragment(const Glib::ustring& filename, context& ctx)
-		: name_(filename), context_(ctx){
+	const prepared_fragment::bound_fragment* prepared_fragment::bind(bindings& result, boost::unordered_map<std::pair<const fragment*, bool>, bound_fragment*>& bound,
+			const fragment& source, const bool views) {
+		auto known = bound.find(std::make_pair(&source, views));
+		if(known != bound.end())
+			return known->second;
+		result.fragments.push_back(bound_fragment { source.shared_from_this(), views, {} });
+		bound_fragment* target = &result.fragments.back();
+		bound[std::make_pair(&source, views)] = target;
+
+		// fragment which is not found is left unbound, error is reported if it is inserted
+		auto find = [this](const Glib::ustring& name) -> const fragment* {
+			try {
+				return &context_.get(name).get_fragment();
+			} catch(const std::exception&) {
+				return nullptr;
+			}
+		};
+		typedef fragment::program::opcode op;
+		const fragment::program& program = source.get_program();
+		target->slots.resize(program.code.size(), bound_fragment::slot { nullptr, nullptr });
+		for(std::size_t pc = 0; pc < program.code.size(); ++pc) {
+			const fragment::program::instruction& i = program.code[pc];
+			if(i.op == op::insert) {
+				if(const fragment* inserted = find(program.inserts[i.argument].view))
+					target->slots[pc].inserted = bind(result, bound, *inserted, false);
+			} else if(i.op == op::insertion && views) {
+				auto view = result.view_insertions.find(i.node->id);
+				if(view == result.view_insertions.end())
+					continue;
+				target->slots[pc].view = &view->second;
+				if(const fragment* inserted = find(view->second.view_name))
+					target->slots[pc].inserted = bind(result, bound, *inserted, true);
+			}
+		}
+		return target;
+	}
+
+    fragment_output prepared_fragment::render(render::context& rnd, const int xhtml5_encoding) {
 		STACKED_EXCEPTIONS_ENTER();
-		reader_.set_substitute_entities(false);
-		reader_.set_validate(false);		
-		reader_.parse_file(filename);		
-		reader_.get_document()->get_root_node()->set_namespace_declaration("webpp://control", "webpp_control");
-		apply_stylesheets();
-		STACKED_EXCEPTIONS_LEAVE("parsing file '" + filename + "'");
+        fragment_output result(fragment_.name());
+		const bool comments = !(xhtml5_encoding & fragment_output::REMOVE_COMMENTS);
+		dom_output output(result.document(), create_output(result.document(), comments), comments);
+		program_state state(output, rnd, fragment_.get_document().get_root_node(), comments);
+		run(state, bind());
+		result.xhtml5(xhtml5_encoding & ~fragment_output::REMOVE_COMMENTS);
+		return result;
+        STACKED_EXCEPTIONS_LEAVE("fragment '" + fragment_.name() + "'");
 	}
 
-	/// Load fragment name 'name' from in-memory 'buffer'
-	fragment::fragment(const Glib::ustring& name, const Glib::ustring& buffer, context& ctx)
-		: name_(name), context_(ctx) {
+    fragment_output prepared_fragment::render_dom(render::context& rnd) {
 		STACKED_EXCEPTIONS_ENTER();
-		reader_.set_substitute_entities(false);
-		reader_.set_validate(false);
-		reader_.parse_memory(buffer);
-		reader_.get_document()->get_root_node()->set_namespace_declaration("webpp://control", "webpp_control");
-		apply_stylesheets();
-		STACKED_EXCEPTIONS_LEAVE("parsing memory buffer named '" + name + "':<<XML\n" + buffer + "\nXML\n");
+        fragment_output result(fragment_.name());
+		xmlpp::Element* dst = create_output(result.document());
+        process_node(fragment_.info(fragment_.get_document().get_root_node()), result.document(), dst, rnd);
+		return result;
+        STACKED_EXCEPTIONS_LEAVE("fragment '" + fragment_.name() + "'");
 	}
 
-	void fragment::apply_stylesheets() {
-		if(context_.get_stylesheets().empty())
+    void prepared_fragment::render(render::context& rnd, std::string& buffer, const int xhtml5_encoding) {
+		output_cache* cache = context_.get_output_cache();
+		if(cache == nullptr || rnd.recording_reads()) {
+			xml_writer writer(buffer, xhtml5_encoding);
+			render(writer, rnd);
 			return;
+		}
 
-		xmlDoc *current = reader_.get_document()->cobj(), *prev = nullptr;
-		for(const auto& stylesheet : context_.get_stylesheets()) {
-			const char* params[] = { nullptr };
+		const std::string key = cache_key(xhtml5_encoding);
+		output_cache::cached_output cached;
+		if(cache->find(key, rnd, cached)) {
+			buffer += cached.text;
+			return;
+		}
+		boost::unordered_set<Glib::ustring> reads;
+		std::string output;
+		{
+			render::read_recorder recorder(rnd, reads);
+			xml_writer writer(output, xhtml5_encoding);
+			render(writer, rnd);
+		}
+		buffer += output;
+		cache->store(key, reads, rnd, output_cache::cached_output { std::move(output), {}, true });
+	}
 
-			if(prev != nullptr && prev != reader_.get_document()->cobj())
-				xmlFreeDoc(prev);
+	std::string prepared_fragment::cache_key(const int xhtml5_encoding) const {
+		std::string key = fragment_.name().raw();
+		key.append(1, '\0').append(boost::lexical_cast<std::string>(xhtml5_encoding));
+		for(const auto& i : view_insertions_)
+			key.append(1, '\0').append(i.first.raw()).append(1, '\0').append(i.second.view_name.raw()).append(1, '\0').append(i.second.value_prefix.raw());
+		return key;
+	}
 
-			prev = current;
-			// TODO: handle errors (it is NOT easy, requires global state)
-			current = xsltApplyStylesheet(stylesheet.get(), prev, params);
-			if(current == nullptr) {
-				if(prev != reader_.get_document()->cobj())
-					xmlFreeDoc(prev);
-				throw std::runtime_error("Could not apply XSL stylesheet");
-			}
+	std::string prepared_fragment::cache_key(const bound_fragment& bound, const int xhtml5_encoding) const {
+		std::string key = bound.source->name().raw();
+		key.append(1, '\0').append(boost::lexical_cast<std::string>(xhtml5_encoding));
+		if(bound.views) {
+			for(const auto& i : bindings_->view_insertions)
+				key.append(1, '\0').append(i.first.raw()).append(1, '\0').append(i.second.view_name.raw()).append(1, '\0').append(i.second.value_prefix.raw());
 		}
-		processed_document_.reset(new xmlpp::Document(current));
+		return key;
 	}
 
-	/// Return all nodes in fragment, matching given XPath expression
-/*	xmlpp::NodeSet fragment::find_by_xpath(const Glib::ustring& query) {
-		return reader_.get_document()->get_root_node()->find(query);
+    void prepared_fragment::render(render::context& rnd, std::ostream& output, const int xhtml5_encoding) {
+		chunked_output chunked;
+		render(rnd, chunked, xhtml5_encoding);
+		for(const chunked_output::chunk& c : chunked.chunks())
+			output.write(c.data, c.size);
 	}
-*/
 
-    fragment_output prepared_fragment::render(render::context& rnd) {
-		STACKED_EXCEPTIONS_ENTER();
-        fragment_output result(fragment_.name());
-		xmlpp::Document& output = result.document();
-		xmlpp::Element* src = fragment_.get_document().get_root_node();
+    void prepared_fragment::render(render::context& rnd, chunked_output& output, const int xhtml5_encoding) {
+		xml_writer writer(output, xhtml5_encoding);
+		render(writer, rnd);
+	}
 
-        // copy children prev and next to root element, without processing (comments...)
-		for(xmlNode* i = fragment_.get_document().cobj()->children; i != src->cobj() && i != nullptr; i = i->next) {
-            if(i->type == XML_COMMENT_NODE) {
-                xmlChar* comment = xmlNodeGetContent(i);
-                output.add_comment(Glib::ustring(reinterpret_cast<const char*>(comment)));
-                xmlFree(comment);
-            }
-        }
+    void prepared_fragment::render(render::context& rnd, const xml_writer::sink_t& sink, const std::size_t flush_threshold, const int xhtml5_encoding) {
+		std::string buffer;
+		buffer.reserve(flush_threshold);
+		xml_writer writer(buffer, sink, flush_threshold, xhtml5_encoding);
+		render(writer, rnd);
+		writer.flush();
+	}
 
-        output.create_root_node(src->get_name());
-        xmlpp::Element* dst = output.get_root_node();
+    void prepared_fragment::render(xml_writer& writer, render::context& rnd) {
+		STACKED_EXCEPTIONS_ENTER();
+		const xmlpp::Element* src = fragment_.get_document().get_root_node();
 
-        for(xmlNode* i = src->cobj(); i != nullptr; i = i->next) {
-            if(i->type == XML_COMMENT_NODE) {
-                xmlChar* comment = xmlNodeGetContent(i);
-                output.add_comment(Glib::ustring(reinterpret_cast<const char*>(comment)));
-                xmlFree(comment);
-            }
-        }
+		// comments around root element, as in create_output()
+		for(const xmlNode* i = fragment_.get_document().cobj()->children; i != src->cobj() && i != nullptr; i = i->next) {
+			if(i->type == XML_COMMENT_NODE)
+				writer.comment(i->content != nullptr ? reinterpret_cast<const char*>(i->content) : "");
+		}
 
-        process_node(src, output, dst, rnd);
-		return result;
+		writer.open_element(reinterpret_cast<const char*>(src->cobj()->name));
+		stream_output output(writer);
+		program_state state(output, rnd, src, !(writer.xhtml5_encoding() & fragment_output::REMOVE_COMMENTS));
+		run(state, bind());
+		writer.close_element();
+
+		for(const xmlNode* i = src->cobj(); i != nullptr; i = i->next) {
+			if(i->type == XML_COMMENT_NODE)
+				writer.comment(i->content != nullptr ? reinterpret_cast<const char*>(i->content) : "");
+		}
         STACKED_EXCEPTIONS_LEAVE("fragment '" + fragment_.name() + "'");
-	}		
+	}
+
+	void prepared_fragment::run_inserted(program_state& state, const bound_fragment* inserted, const Glib::ustring& name, const fragment::node_info& node, const Glib::ustring* id) const {
+		if(inserted == nullptr) {
+			// not found when this fragment was bound, context reports error (or fragment was added later)
+			prepared_fragment subdoc = context_.get(name);
+			if(id != nullptr)
+				subdoc.view_insertions_ = bindings_->view_insertions;
+			subdoc.run_inserted(state, &subdoc.bind(), name, node, id);
+			return;
+		}
+		if(!run_cached(state, *inserted, node, id)) {
+			if(id != nullptr)
+				state.output.begin_insertion(*id);
+			run(state, *inserted);
+		}
+	}
+
+	bool prepared_fragment::run_cached(program_state& state, const bound_fragment& inserted, const fragment::node_info& node, const Glib::ustring* id) const {
+		output_cache* cache = context_.get_insert_cache();
+		xml_writer* writer = state.output.serializer();
+		// inserted root replaces current element, it must not have content or namespaces declared by elements
+		if(cache == nullptr || writer == nullptr || writer->root_flushed() || !node.children.empty() || node.element->get_parent() == nullptr)
+			return false;
+
+		std::string key = cache_key(inserted, writer->xhtml5_encoding());
+		key.append(1, '\0').append(writer->current_name());
+		if(id != nullptr)
+			key.append(1, '\0').append(id->raw());
+		render::context& rnd = state.rnd;
+		output_cache::cached_output cached;
+		if(!cache->find(key, rnd, cached)) {
+			boost::unordered_set<Glib::ustring> reads;
+			{
+				render::read_recorder recorder(rnd, reads);
+				xml_writer embedded(cached.text, writer->xhtml5_encoding(), true);
+				embedded.open_element(writer->current_name());
+				stream_output output(embedded);
+				// second source lets inserted root be removed, as in output of this fragment
+				program_state sub(output, rnd, state.sources.front(), state.comments);
+				sub.sources.push_back(state.sources.back());
+				if(id != nullptr)
+					output.begin_insertion(*id);
+				run(sub, inserted);
+				cached.visible = sub.sources.size() == 2;
+				if(cached.visible)
+					embedded.close_element();
+				cached.namespaces = embedded.namespaces();
+			}
+			cache->store(key, reads, rnd, cached);
+		}
+
+		for(const auto& ns : cached.namespaces)
+			writer->set_namespace_declaration(ns.first, ns.second);
+		if(cached.visible) {
+			writer->detach_element();
+			writer->raw(cached.text);
+		} else
+			state.discard();
+		return true;
+	}
+
+	void prepared_fragment::run(program_state& state, const bound_fragment& bound) const {
+		typedef fragment::program::opcode op;
+		const fragment::program& program = bound.source->get_program();
+		render::context& rnd = state.rnd;
+		const std::size_t base = state.sources.size() - 1;
+		std::size_t pc = 0;
+
+		try {
+			while(pc < program.code.size()) {
+				const fragment::program::instruction& i = program.code[pc++];
+				switch(i.op) {
+					case op::open_child:
+						state.open(i.node->element);
+						break;
+					case op::close:
+						state.close();
+						break;
+					case op::test:
+						state.visible = evaluate_test(i.node->attributes[i.argument], rnd);
+						break;
+					case op::test_and: {
+						const bool visible = evaluate_test(i.node->attributes[i.argument], rnd);
+						state.visible = state.visible && visible;
+						break;
+					}
+					case op::discard_if_invisible:
+						if(!state.visible) {
+							state.discard();
+							pc = i.exit;
+						}
+						break;
+					case op::fail:
+						throw std::runtime_error(program.strings[i.argument]);
+					case op::begin_element:
+						state.output.begin_element(*i.node);
+						break;
+					case op::set_attribute:
+						state.output.set_attribute(i.node->attributes[i.argument]);
+						break;
+					case op::xmlns_attribute: {
+						const fragment::attribute_info& attribute = i.node->attributes[i.argument];
+						const xmlns* nshandler = attribute.handler != nullptr ? attribute.handler : context_.find_xmlns(attribute.attribute->get_namespace_uri());
+						if(nshandler == nullptr)
+							throw std::runtime_error("unknown attribute namespace  " + attribute.attribute->get_namespace_uri());
+						state.output.attribute(*nshandler, attribute.attribute, attribute.handler != nullptr ? attribute.compiled.get() : nullptr, rnd);
+						break;
+					}
+					case op::copy:
+						state.output.copy(i.node->children[i.argument]);
+						break;
+					case op::comment:
+						if(state.comments)
+							state.output.copy(i.node->children[i.argument]);
+						break;
+					case op::blob:
+						if(state.output.blob(program.blobs[i.argument], *bound.source))
+							pc = i.exit;
+						break;
+					case op::call_tag: {
+						const xmlpp::Element* src = i.node->element;
+						auto tag = i.node->tag_handler != nullptr ? i.node->tag_handler : context_.find_tag(src->get_namespace_uri(), src->get_name());
+						if(tag == nullptr) {
+							const xmlns* nshandler = i.node->xmlns_handler != nullptr ? i.node->xmlns_handler : context_.find_xmlns(src->get_namespace_uri());
+							if(!nshandler)
+								throw std::runtime_error( (boost::format("required custom tag %s in ns %s (or namespace handler) not found") % src->get_name() % src->get_namespace_uri()).str());
+							state.output.tag(*nshandler, src, i.node->xmlns_handler != nullptr ? i.node->compiled.get() : nullptr, rnd);
+						} else
+							state.output.tag(*tag, src, rnd);
+						break;
+					}
+					case op::insert: {
+						const std::size_t depth = state.sources.size();
+						const fragment::program::insert& insert = program.inserts[i.argument];
+						rnd.push_prefix(insert.prefix);
+						run_inserted(state, bound.slots[pc - 1].inserted, insert.view, *i.node, nullptr);
+						rnd.pop_prefix();
+						if(state.sources.size() < depth)
+							pc = i.exit;
+						break;
+					}
+					case op::insertion: {
+						const bound_fragment::slot& slot = bound.slots[pc - 1];
+						if(slot.view == nullptr)
+							break;
+						const std::size_t depth = state.sources.size();
+						rnd.push_prefix(slot.view->prefix);
+						run_inserted(state, slot.inserted, slot.view->view_name, *i.node, &i.node->id);
+						rnd.pop_prefix();
+						if(state.sources.size() < depth)
+							pc = i.exit;
+						else {
+							state.output.end_insertion(i.node->id);
+							pc = i.target;
+						}
+						break;
+					}
+					case op::begin_inner: {
+						const fragment::program::repeat& repeat = program.repeats[i.argument];
+						render::array_base& array = rnd.get(repeat.array).get_array();
+						array.reset();
+						state.output.repeat_boundary(true);
+						state.repeats.push_back(program_state::repeat_frame { &repeat, &array, -1,
+							std::unique_ptr<render::repeat_guard>(new render::repeat_guard(rnd, repeat.variable)) });
+						break;
+					}
+					case op::next_inner: {
+						program_state::repeat_frame& frame = state.repeats.back();
+						if(frame.index >= 0)
+							state.output.repeat_boundary(false);
+						if(!frame.array->has_next()) {
+							state.repeats.pop_back();
+							pc = i.target;
+							break;
+						}
+						rnd.repeat_item(frame.repeat->variable, frame.array->next(), frame.repeat->index, ++frame.index);
+						break;
+					}
+					case op::skip_repeated:
+						if(state.repeats.back().index > 0)
+							pc = i.target;
+						break;
+					case op::begin_outer: {
+						const fragment::program::repeat& repeat = program.repeats[i.argument];
+						render::array_base& array = rnd.get(repeat.array).get_array();
+						array.reset();
+						if(array.empty()) {
+							state.discard();
+							pc = i.exit;
+							break;
+						}
+						state.output.repeat_boundary(true);
+						state.repeats.push_back(program_state::repeat_frame { &repeat, &array, -1,
+							std::unique_ptr<render::repeat_guard>(new render::repeat_guard(rnd, repeat.variable)) });
+						break;
+					}
+					case op::next_outer: {
+						program_state::repeat_frame& frame = state.repeats.back();
+						rnd.repeat_item(frame.repeat->variable, frame.array->next(), frame.repeat->index, ++frame.index);
+						break;
+					}
+					case op::more_outer:
+						// previous item is closed, current output element is parent of repeated element
+						state.output.repeat_boundary(false);
+						if(state.repeats.back().array->has_next()) {
+							state.open(i.node->element);
+							pc = i.target;
+						} else {
+							state.repeats.pop_back();
+							pc = i.exit;
+						}
+						break;
+					case op::jump:
+						pc = i.target;
+						break;
+				}
+			}
+		} catch(...) {
+			// describe elements of this fragment, as nested process_node calls do
+			std::vector<const xmlpp::Element*> nodes(1, fragment_.get_document().get_root_node());
+			nodes.insert(nodes.end(), state.sources.begin() + base + 1, state.sources.end());
+			state.sources.resize(base + 1);
+			std::exception_ptr e = std::current_exception();
+			for(auto i = nodes.rbegin(); i != nodes.rend(); ++i) {
+				try {
+					rethrow_in_node(e, *i);
+				} catch(...) {
+					e = std::current_exception();
+				}
+			}
+			std::rethrow_exception(e);
+		}
+	}
 
 	/// Construct context; library_directory is directory root for fragment XML files
 	context::context(const std::string& library_directory)
@@ -191,6 +2004,11 @@ namespace webpp { namespace xml {
 	/// Load fragment 'name' from file in library
 	void context::load(const std::string& name) {
 		STACKED_EXCEPTIONS_ENTER();
+		if(output_cache_)
+			output_cache_->clear();
+		if(insert_cache_)
+			insert_cache_->clear();
+		bindings_.clear();
         fragments_.emplace(name, std::make_shared<fragment>( (library_directory_ / name).string() + ".xml", *this));
 		STACKED_EXCEPTIONS_LEAVE("loading file " + name);
 	}
@@ -198,10 +2016,137 @@ namespace webpp { namespace xml {
 	/// Load fragment 'name' from in-memory buffer 'data'
 	void context::put(const Glib::ustring& name, const Glib::ustring& data) {
 		STACKED_EXCEPTIONS_ENTER();
+		if(output_cache_)
+			output_cache_->clear();
+		if(insert_cache_)
+			insert_cache_->clear();
+		bindings_.clear();
 		fragments_[name] = std::make_shared<fragment>( name, data, *this);
 		STACKED_EXCEPTIONS_LEAVE("loading memory buffer " + name);
 	}
 
+	void context::enable_output_cache(const std::size_t max_bytes) {
+		output_cache_.reset(max_bytes != 0 ? new output_cache(max_bytes) : nullptr);
+	}
+
+	void context::enable_insert_cache(const std::size_t max_bytes) {
+		insert_cache_.reset(max_bytes != 0 ? new output_cache(max_bytes) : nullptr);
+	}
+
+	output_cache::output_cache(const std::size_t max_bytes)
+		: max_bytes_(max_bytes), stats_ { 0, 0, 0, 0 } {}
+
+	/// \brief Append 'text' with its length, so concatenated fields can not be read in other way
+	static void append_field(const char tag, boost::string_ref text, std::string& output) {
+		output.append(1, tag).append(boost::lexical_cast<std::string>(text.size())).append(1, ':').append(text.data(), text.size());
+	}
+
+	std::string output_cache::values(const names_t& names, const render::context& rnd) {
+		std::string result, value;
+		for(const render::path& name : names) {
+			value.clear();
+			rnd.get(name).serialize(value);
+			append_field('v', value, result);
+		}
+		return result;
+	}
+
+	bool output_cache::find(const std::string& key, render::context& rnd, cached_output& output) {
+		// values are serialized without lock, sets of their names are immutable and kept alive by this copy
+		std::vector<std::shared_ptr<const names_t>> key_names;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto names = names_.find(key);
+			if(names != names_.end())
+				key_names = names->second;
+		}
+		std::vector<std::string> serialized;
+		serialized.reserve(key_names.size());
+		for(const std::shared_ptr<const names_t>& n : key_names)
+			serialized.push_back(values(*n, rnd));
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for(std::size_t j = 0; j < key_names.size(); ++j) {
+			auto i = index_.find(std::make_pair(key_names[j].get(), boost::hash_value(serialized[j])));
+			if(i != index_.end() && i->second->values == serialized[j]) {
+				entries_.splice(entries_.begin(), entries_, i->second);
+				++stats_.hits;
+				output = i->second->output;
+				return true;
+			}
+		}
+		++stats_.misses;
+		return false;
+	}
+
+	void output_cache::store(const std::string& key, const boost::unordered_set<Glib::ustring>& reads, render::context& rnd, cached_output output) {
+		std::vector<Glib::ustring> sorted(reads.begin(), reads.end());
+		std::sort(sorted.begin(), sorted.end());
+		std::shared_ptr<names_t> names = std::make_shared<names_t>();
+		for(const Glib::ustring& name : sorted)
+			names->emplace_back(name);
+		// equal sets of names have equal serialized values
+		std::string serialized = values(*names, rnd);
+		std::size_t bytes = key.size() + serialized.size() + output.text.size();
+		for(const auto& ns : output.namespaces)
+			bytes += ns.first.size() + ns.second.size();
+		if(bytes > max_bytes_)
+			return;
+		const std::size_t h = boost::hash_value(serialized);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		// renders of key usually read the same values, their set is shared
+		auto& key_names = names_[key];
+		std::shared_ptr<const names_t> shared;
+		for(const std::shared_ptr<const names_t>& n : key_names) {
+			if(n->size() == names->size() && std::equal(n->begin(), n->end(), names->begin(),
+					[](const render::path& a, const render::path& b) { return a.name() == b.name(); }))
+				shared = n;
+		}
+		if(!shared) {
+			shared = names;
+			key_names.push_back(shared);
+		}
+
+		const auto id = std::make_pair(shared.get(), h);
+		auto i = index_.find(id);
+		if(i != index_.end()) {
+			// output of other values with the same hash is kept, these values are not cached
+			entries_.splice(entries_.begin(), entries_, i->second);
+			return;
+		}
+		entries_.push_front(entry { key, shared, h, std::move(serialized), std::move(output), bytes });
+		index_.emplace(id, entries_.begin());
+		++stats_.entries;
+		stats_.bytes += bytes;
+		evict();
+	}
+
+	void output_cache::evict() {
+		while(stats_.bytes > max_bytes_) {
+			const entry& e = entries_.back();
+			index_.erase(std::make_pair(e.names.get(), e.hash));
+			stats_.bytes -= e.bytes;
+			--stats_.entries;
+			// forget set of values, if no other output uses it
+			if(e.names.use_count() == 2) {
+				auto& key_names = names_[e.key];
+				key_names.erase(std::find(key_names.begin(), key_names.end(), e.names));
+				if(key_names.empty())
+					names_.erase(e.key);
+			}
+			entries_.pop_back();
+		}
+	}
+
+	void output_cache::clear() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		entries_.clear();
+		names_.clear();
+		index_.clear();
+		stats_.entries = stats_.bytes = 0;
+	}
+
 	/// find fragment by 'name', load it from library if not loaded yet.
     prepared_fragment context::get(const Glib::ustring& name) {
 		STACKED_EXCEPTIONS_ENTER();
@@ -218,6 +2163,16 @@ namespace webpp { namespace xml {
 		STACKED_EXCEPTIONS_LEAVE("fragment name " + name);
 	}
 
+	void context::taglibs_changed() {
+		for(auto& i : fragments_)
+			i.second->bind_handlers();
+		if(output_cache_)
+			output_cache_->clear();
+		if(insert_cache_)
+			insert_cache_->clear();
+		bindings_.clear();
+	}
+
 	const tag* context::find_tag(const Glib::ustring& ns, const Glib::ustring& name) {
 		auto i = tags_.find(std::make_pair(ns, name));
 		if(i == tags_.end())
@@ -240,8 +2195,9 @@ namespace webpp { namespace xml {
 	}
 
 
-	void prepared_fragment::process_node(const xmlpp::Element* src, xmlpp::Document& output, xmlpp::Element* dst, render::context& rnd, bool already_processing_outer_repeat) {
+	void prepared_fragment::process_node(const fragment::node_info& info, xmlpp::Document& output, xmlpp::Element* dst, render::context& rnd, bool already_processing_outer_repeat) {
 		STACKED_EXCEPTIONS_ENTER();
+		const xmlpp::Element* src = info.element;
 
 		Glib::ustring repeat_variable, repeat_array;
 		enum { inner, outer,none } repeat_type = none;
@@ -249,35 +2205,38 @@ namespace webpp { namespace xml {
         bool nochildren = false;
 
 		// process control attributes first
-		for(auto attribute : src->get_attributes()) {
-			const auto ns = attribute->get_namespace_uri();
-			const auto name = attribute->get_name();
-			const auto value = attribute->get_value();
-
-            if(ns == "webpp://control") {
+		for(const auto& attribute : info.attributes) {
+            if(attribute.ns == namespace_id::control) {
 				// control statements, loops and conditions
 				// foreach loops, outer repeats whole tag and children, inner repeats children only
-				if(name == "repeat") {
-					if(value == "inner")
-						repeat_type = inner;
-					else if(value == "outer")
-						repeat_type = outer;
-					else
-						throw std::runtime_error(
-							(boost::format("repeat must be one of (inner,outer), not '%s' in line '%s', tag '%s'")
-								% value % src->get_line() % src->get_name()).str());
-				} else if(name == "repeat-array") {
-					repeat_array = value;
-				} else if(name == "repeat-variable") {
-					repeat_variable = value;
-				// element visibility
-				} else if(name == "visible-if") {
-					if( repeat_type != outer || already_processing_outer_repeat )
-						visible &= expressions::evaluate_test_expression(value, rnd);
-				} else if(name == "repeat-once") {
-					// handled in process_children
-				} else
-					throw std::runtime_error("webpp://control atribute " + name + " is not implemented");
+				switch(attribute.control) {
+					case control_id::repeat:
+						if(attribute.value == "inner")
+							repeat_type = inner;
+						else if(attribute.value == "outer")
+							repeat_type = outer;
+						else
+							throw std::runtime_error(
+								(boost::format("repeat must be one of (inner,outer), not '%s' in line '%s', tag '%s'")
+									% attribute.value % src->get_line() % src->get_name()).str());
+						break;
+					case control_id::repeat_array:
+						repeat_array = attribute.value;
+						break;
+					case control_id::repeat_variable:
+						repeat_variable = attribute.value;
+						break;
+					// element visibility
+					case control_id::visible_if:
+						if( repeat_type != outer || already_processing_outer_repeat )
+							visible &= evaluate_test(attribute, rnd);
+						break;
+					case control_id::repeat_once:
+						// handled in process_children
+						break;
+					case control_id::unknown:
+						throw std::runtime_error("webpp://control atribute " + attribute.name + " is not implemented");
+				}
 				if(!visible && repeat_type != outer)
 					break;
 			}
@@ -294,64 +2253,66 @@ namespace webpp { namespace xml {
 				parent->remove_child(dst);
 		} else if(repeat_type != outer) {
 			// element is visible AND it is not outer repeat
-            xmlpp::Attribute *id_attribute = src->get_attribute("id");
             view_insertions_t::const_iterator view_insertion_iterator = view_insertions_.end();
-            if(id_attribute != nullptr)
-                view_insertion_iterator = view_insertions_.find(id_attribute->get_value());
+            if(info.has_id && !view_insertions_.empty())
+                view_insertion_iterator = view_insertions_.find(info.id);
 
             if(view_insertion_iterator == view_insertions_.end() &&
-                    (src->get_namespace_uri() == "webpp://html5" || src->get_namespace_uri() == "webpp://xml" || src->get_namespace_uri().find("webpp://") == Glib::ustring::npos) ) {
-                if(src->get_namespace_uri() == "webpp://html5")
+                    info.ns != namespace_id::control && info.ns != namespace_id::custom) {
+                if(info.ns == namespace_id::html5)
                     output.get_root_node()->set_namespace_declaration("http://www.w3.org/1999/xhtml");
-                else if(src->get_namespace_uri() != "webpp://xml") {
+                else if(info.ns != namespace_id::xml) {
                     output.get_root_node()->set_namespace_declaration(src->get_namespace_uri(), src->get_namespace_prefix());
                     dst->set_namespace(src->get_namespace_prefix());
                 }
 				dst->set_name(src->get_name());
 				// normal tag, process attributes                
-				for(auto attribute : src->get_attributes()) {
-					const auto ns = attribute->get_namespace_uri();
-					const auto name = attribute->get_name();
-					const auto value = attribute->get_value();
-
-					if(ns == "") /* default namespace, attributes in XML do NOT HAVE default namespace set via xmlns= in root node */ {
-						// normal attribute
-						dst->set_attribute(name, value);
-					} else if(ns != "webpp://control"){ // if ns == webpp://control
-						const xmlns* nshandler = context_.find_xmlns(ns);
-						if(nshandler == nullptr)
-							throw std::runtime_error("unknown attribute namespace  " + ns);
-						nshandler->attribute(dst, attribute, rnd);
+				for(const auto& attribute : info.attributes) {
+					switch(attribute.ns) {
+						case namespace_id::none: // default namespace, attributes in XML do NOT HAVE default namespace set via xmlns= in root node
+							// normal attribute
+							dst->set_attribute(attribute.name, attribute.value);
+							break;
+						case namespace_id::control:
+							break;
+						default: {
+							const xmlns* nshandler = attribute.handler != nullptr ? attribute.handler : context_.find_xmlns(attribute.attribute->get_namespace_uri());
+							if(nshandler == nullptr)
+								throw std::runtime_error("unknown attribute namespace  " + attribute.attribute->get_namespace_uri());
+							nshandler->attribute(dst, attribute.attribute, rnd);
+						}
 					}
 				}
 			} else {
 				nochildren = true; // custom tags handle their children				
-                if(src->get_namespace_uri() == "webpp://control" || view_insertion_iterator != view_insertions_.end()) {
+                if(info.ns == namespace_id::control || view_insertion_iterator != view_insertions_.end()) {
                     // handle all c: internally
-                    if(src->get_name() == "insert") {
+                    if(info.control_insert) {
                         if(src->get_attribute("name") == nullptr)
                             throw std::runtime_error("webpp://control:insert requires attribute name (inserted view name)");
                         if(src->get_attribute("value-prefix") == nullptr)
                             throw std::runtime_error("webpp://control:insert requires attribute value-prefix (prefix for render context variables)");
                         rnd.push_prefix(src->get_attribute("value-prefix")->get_value());
                         auto subdoc = context_.get(src->get_attribute("name")->get_value());
-						subdoc.process_node(subdoc.get_fragment().get_document().get_root_node(), output, dst, rnd);
+						const fragment& inserted = subdoc.get_fragment();
+						subdoc.process_node(inserted.info(inserted.get_document().get_root_node()), output, dst, rnd);
                         rnd.pop_prefix();
                     } else if(view_insertion_iterator != view_insertions_.end()) {
-                        rnd.push_prefix(view_insertion_iterator->second.value_prefix);
+                        rnd.push_prefix(view_insertion_iterator->second.prefix);
                         auto subdoc = context_.get(view_insertion_iterator->second.view_name);
 						subdoc.view_insertions_ = view_insertions_;
-						subdoc.process_node(subdoc.get_fragment().get_document().get_root_node(), output, dst, rnd);
-						dst->set_attribute("id", id_attribute->get_value());
+						const fragment& inserted = subdoc.get_fragment();
+						subdoc.process_node(inserted.info(inserted.get_document().get_root_node()), output, dst, rnd);
+						dst->set_attribute("id", info.id);
                         rnd.pop_prefix();
                     } else {
                         throw std::runtime_error("unknown webpp://control tag: " + src->get_name());
                     }
                 } else {
                     // look for pair(tagns,tagname) handler
-                    auto tag = context_.find_tag(src->get_namespace_uri(), src->get_name());
+                    auto tag = info.tag_handler != nullptr ? info.tag_handler : context_.find_tag(src->get_namespace_uri(), src->get_name());
                     if(tag == nullptr) {
-                        const xmlns* nshandler = context_.find_xmlns(src->get_namespace_uri());
+                        const xmlns* nshandler = info.xmlns_handler != nullptr ? info.xmlns_handler : context_.find_xmlns(src->get_namespace_uri());
                         if(!nshandler)
                             throw std::runtime_error( (boost::format("required custom tag %s in ns %s (or namespace handler) not found") % src->get_name() % src->get_namespace_uri()).str());
 
@@ -363,7 +2324,7 @@ namespace webpp { namespace xml {
 
 			if(repeat_type == none) {
 				if(!nochildren)
-                    process_children(src, output, dst, rnd);
+                    process_children(info, output, dst, rnd);
 			} else /* if(repeat_type == inner) */ {
 				// repeat_variable, repeat_array;
 				if(repeat_variable.empty() || repeat_array.empty())
@@ -371,11 +2332,12 @@ namespace webpp { namespace xml {
 
 				auto& array = rnd.get(repeat_array).get_array();
 				array.reset();
+				const render::path index_name(repeat_variable + "-index");
 				int index = 0;
+				render::repeat_guard repeat(rnd, repeat_variable);
 				while(array.has_next()) {
-					rnd.get(repeat_variable + "-index").create_value(index);
-					rnd.import_subtree(repeat_variable, array.next());
-					process_children(src, output, dst, rnd, index > 0);
+					rnd.repeat_item(repeat_variable, array.next(), index_name, index);
+					process_children(info, output, dst, rnd, index > 0);
 					++index;
 				}
 			}
@@ -392,12 +2354,13 @@ namespace webpp { namespace xml {
 				dst->get_parent()->remove_child(dst);
 			else {
 				xmlpp::Element* currentdst = dst, *parent = dst->get_parent();
+				const render::path index_name(repeat_variable + "-index");
 				int index = 0;
+				render::repeat_guard repeat(rnd, repeat_variable);
 				while(array.has_next()) {
 					// first setup context variable
-					rnd.import_subtree(repeat_variable, array.next());
-					rnd.get(repeat_variable	 + "-index").create_value(index);
-                    process_node(src, output, currentdst, rnd, true);
+					rnd.repeat_item(repeat_variable, array.next(), index_name, index);
+                    process_node(info, output, currentdst, rnd, true);
 					// move to next source array element, if it is not end, then add next sibling
 					if(array.has_next())
 						currentdst = parent->add_child(src->get_name());
@@ -405,18 +2368,17 @@ namespace webpp { namespace xml {
 				}
 			}
         } // if repeat_type
-        STACKED_EXCEPTIONS_LEAVE("node " + src->get_namespace_uri() + ":" + src->get_name() + " at line " + boost::lexical_cast<std::string>(src->get_line()));
+        STACKED_EXCEPTIONS_LEAVE("node " + info.element->get_namespace_uri() + ":" + info.element->get_name() + " at line " + boost::lexical_cast<std::string>(info.element->get_line()));
 	}
 
-	void prepared_fragment::process_children(const xmlpp::Element* src, xmlpp::Document& output, xmlpp::Element* dst, render::context& rnd, bool direct_inside_inner) {
+	void prepared_fragment::process_children(const fragment::node_info& info, xmlpp::Document& output, xmlpp::Element* dst, render::context& rnd, bool direct_inside_inner) {
 		STACKED_EXCEPTIONS_ENTER();
-		for(auto child : src->get_children()) {
-			const xmlpp::Element* childelement = dynamic_cast<xmlpp::Element*>(child);
-			if(childelement != nullptr) {
-				xmlpp::Attribute* attr = childelement->get_attribute("repeat-once","webpp_control");
-				if(!(direct_inside_inner && attr != nullptr && attr->get_value() == "yes")) {
+		for(std::size_t i = 0; i < info.children.size(); ++i) {
+			const xmlpp::Node* child = info.children[i];
+			if(const fragment::node_info* child_info = info.child_elements[i]) {
+				if(!(direct_inside_inner && child_info->repeat_once)) {
 					xmlpp::Element* e = dst->add_child(child->get_name());
-					process_node(childelement, output, e, rnd);
+					process_node(*child_info, output, e, rnd);
 				}
 			} else {
 				dst->import_node(child);
@@ -446,44 +2408,339 @@ namespace webpp { namespace xml {
 		return elements_.size();
 	}
 
+	render::array_cache* render::array::find_cache(const std::string& key) const {
+		auto i = caches_.find(key);
+		if(i == caches_.end() || i->second.first != *revision_)
+			return nullptr;
+		return i->second.second.get();
+	}
+
+	void render::array::store_cache(const std::string& key, std::unique_ptr<array_cache> cache) const {
+		auto& entry = caches_[key];
+		entry.first = *revision_;
+		entry.second = std::move(cache);
+	}
+
     //! \brief Remove link from this node (used with imported and lazy tree nodes)
     void render::tree_element::remove_link() {
         link_.reset();
+        stamp_ = next_stamp();
+        ++*clock_;
     }
 
     //! \brief Create link from this node (used with imported and lazy tree nodes)
     void render::tree_element::create_link(std::shared_ptr<tree_element> e) {
         link_ = e;
+        stamp_ = next_stamp();
+        ++*clock_;
     }
 
     void render::tree_element::create_permanent_link(std::shared_ptr<tree_element> e) {
         std::swap(permalink_,e);
         link_ = e;
+        stamp_ = next_stamp();
+        ++*clock_;
     }
 
+	static std::atomic<std::size_t> last_tree_stamp(0);
+
+	std::size_t render::tree_element::next_stamp() {
+		return ++last_tree_stamp;
+	}
+
 
     //! \brief Find tree element stored under key in this subtree. Every key exists in tree, but only some of them have associated variables or arrays
     render::tree_element& render::tree_element::find(const Glib::ustring& key) {
-        if(key.empty())
-            return *this;
-        else {
-            const auto position = key.find('.');
-
-            if(position == Glib::ustring::npos) {
-                auto& result = self()->children_[key.substr(0, position)];
-                if(!result)
-					result = std::make_shared<tree_element>();
-                return *result;
-
-            } else {
-                auto& result = self()->children_[key.substr(0, position)];
-                if(!result)
-					result = std::make_shared<tree_element>();
-                return result->find(key.substr(position+1));
-            }
+        // same segments as path(key), but nothing is allocated for existing nodes
+        const boost::string_ref raw(key.raw());
+        tree_element* result = this;
+        std::size_t start = 0;
+        while(start < raw.length()) {
+            std::size_t end = raw.find('.', start);
+            if(end == boost::string_ref::npos)
+                end = raw.length();
+            const boost::string_ref segment = raw.substr(start, end - start);
+            result = &result->child(segment, symbol::hash_of(segment));
+            start = end + 1;
+        }
+        return *result;
+    }
+
+    render::tree_element& render::tree_element::find(const path& key) {
+        tree_element* result = this;
+        for(const symbol& segment : key.segments())
+            result = &result->child(segment.name, segment.hash);
+        return *result;
+    }
+
+	// hash of segment is known, it is not computed again by lookups in children
+	struct precomputed_hash {
+		std::size_t hash;
+		inline std::size_t operator()(boost::string_ref) const { return hash; }
+	};
+
+	struct name_equal {
+		inline bool operator()(boost::string_ref lhs, boost::string_ref rhs) const { return lhs == rhs; }
+	};
+
+    render::tree_element& render::tree_element::child(boost::string_ref name, const std::size_t hash) {
+        const auto target = self();
+        auto i = target->children_.find(name, precomputed_hash { hash }, name_equal());
+        if(i == target->children_.end()) {
+            auto result = std::make_shared<tree_element>(target->clock_);
+            result->revision_ = target->revision_;
+            i = target->children_.emplace(name.to_string(), std::move(result)).first;
+        }
+        return *i->second;
+    }
+
+    const render::tree_element* render::tree_element::lookup(const path& key) const {
+        const tree_element* result = this;
+        for(const symbol& segment : key.segments()) {
+            const children_t& children = result->self()->children_;
+            auto i = children.find(boost::string_ref(segment.name), precomputed_hash { segment.hash }, name_equal());
+            if(i == children.end())
+                return nullptr;
+            result = i->second.get();
         }
+        return result;
     }
 
+	void render::tree_element::serialize(std::string& output) const {
+		const tree_element& node = target();
+		if(node.value_) {
+			const value_base& v = *node.value_;
+			const value_type type = v.type();
+			switch(type) {
+				case value_type::integer: append_field('i', boost::lexical_cast<std::string>(v.get_integer()), output); break;
+				case value_type::real: append_field('r', boost::lexical_cast<std::string>(v.get_real()), output); break;
+				case value_type::boolean: append_field('b', v.is_true() ? "1" : "0", output); break;
+				case value_type::string: append_field('s', v.get_string(), output); break;
+				default: append_field('o', v.output().raw(), output);
+			}
+		}
+		if(node.array_) {
+			// serialized during render too, cursor of array used by enclosing repeat must not move
+			if(const array* a = dynamic_cast<const array*>(node.array_.get())) {
+				append_field('a', boost::lexical_cast<std::string>(a->size()), output);
+				std::string element;
+				for(const auto& e : a->elements()) {
+					element.clear();
+					e->serialize(element);
+					append_field('e', element, output);
+				}
+			} else {
+				// other arrays can be walked only by their cursor, their values never match
+				append_field('u', boost::lexical_cast<std::string>(next_stamp()), output);
+			}
+		}
+		// children are not ordered, empty ones are the same as missing ones (they are created by lookups)
+		std::vector<std::pair<boost::string_ref, std::string>> children;
+		for(const auto& child : node.children_) {
+			std::string serialized;
+			child.second->serialize(serialized);
+			if(!serialized.empty())
+				children.emplace_back(child.first, std::move(serialized));
+		}
+		std::sort(children.begin(), children.end());
+		for(const auto& child : children) {
+			append_field('n', child.first, output);
+			append_field('c', child.second, output);
+		}
+	}
+
+	render::format_spec::format_spec(const Glib::ustring& fmt)
+		: source_(fmt), conversion_(conversion::none), left_(false), plus_(false), zero_(false), alternate_(false), width_(0) {
+		const std::string& raw = fmt.raw();
+		std::string text, directive;
+		bool found = false;
+		for(std::size_t i = 0; i < raw.length(); ++i) {
+			if(raw[i] != '%') {
+				text += raw[i];
+				continue;
+			}
+			if(i + 1 < raw.length() && raw[i+1] == '%') {
+				text += '%';
+				++i;
+				continue;
+			}
+			// second directive, boost::format reports missing argument
+			if(found) {
+				conversion_ = conversion::none;
+				return;
+			}
+			found = true;
+			prefix_.swap(text);
+
+			std::size_t j = i + 1;
+			bool space = false;
+			for(; j < raw.length() && std::strchr("-+ #0", raw[j]) != nullptr; ++j) {
+				switch(raw[j]) {
+					case '-': left_ = true; break;
+					case '+': plus_ = true; break;
+					case ' ': space = true; break;
+					case '#': alternate_ = true; break;
+					case '0': zero_ = true; break;
+				}
+			}
+			const std::size_t width = j;
+			for(; j < raw.length() && std::isdigit(static_cast<unsigned char>(raw[j])); ++j)
+				width_ = width_ * 10 + (raw[j] - '0');
+			if(j - width > 4)
+				return;
+			bool precision = false;
+			const std::size_t precision_start = j;
+			if(j < raw.length() && raw[j] == '.') {
+				precision = true;
+				for(++j; j < raw.length() && std::isdigit(static_cast<unsigned char>(raw[j])); ++j) {}
+				if(j - precision_start > 4)
+					return;
+			}
+			const std::size_t modifiers = j;
+			// length modifiers are ignored by boost::format
+			for(; j < raw.length() && std::strchr("hlLqjzt", raw[j]) != nullptr; ++j) {}
+			if(j == raw.length() || space)
+				return;
+
+			conversion type;
+			switch(raw[j]) {
+				case 'd': case 'i': case 'u': type = conversion::decimal; break;
+				case 'o': type = conversion::octal; break;
+				case 'x': type = conversion::hex; break;
+				case 'X': type = conversion::upper_hex; break;
+				case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': type = conversion::real; break;
+				case 's': type = conversion::string; break;
+				// positional arguments, %|spec| and other boost::format extensions
+				default: return;
+			}
+			// precision of integers and strings is handled differently by boost::format, sign is not shown for unsigned types
+			if((precision || plus_) && type != conversion::real)
+				return;
+			if(type == conversion::string && (width_ != 0 || left_ || plus_ || zero_ || alternate_))
+				return;
+			if(type == conversion::real)
+				real_format_ = raw.substr(i, modifiers - i) + raw[j];
+			conversion_ = type;
+			i = j;
+		}
+		if(!found) {
+			conversion_ = conversion::none;
+			return;
+		}
+		suffix_.swap(text);
+	}
+
+	void render::format_spec::write_integer(const long long value, std::string& output) const {
+		char digits[32];
+		char* end = digits + sizeof(digits), *begin = end;
+		unsigned long long magnitude = value < 0 ? 0ull - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value);
+		const unsigned base = conversion_ == conversion::decimal ? 10 : conversion_ == conversion::octal ? 8 : 16;
+		const char* symbols = conversion_ == conversion::upper_hex ? "0123456789ABCDEF" : "0123456789abcdef";
+		do {
+			*--begin = symbols[magnitude % base];
+			magnitude /= base;
+		} while(magnitude != 0);
+
+		const char* sign = value < 0 ? "-" : "";
+		const char* base_prefix = "";
+		if(alternate_ && value != 0) {
+			if(conversion_ == conversion::octal)
+				base_prefix = "0";
+			else if(conversion_ == conversion::hex)
+				base_prefix = "0x";
+			else if(conversion_ == conversion::upper_hex)
+				base_prefix = "0X";
+		}
+
+		const std::size_t length = std::strlen(sign) + std::strlen(base_prefix) + (end - begin);
+		const std::size_t padding = static_cast<std::size_t>(width_) > length ? width_ - length : 0;
+		if(!left_ && !zero_)
+			output.append(padding, ' ');
+		output += sign;
+		output += base_prefix;
+		if(!left_ && zero_)
+			output.append(padding, '0');
+		output.append(begin, end);
+		if(left_)
+			output.append(padding, ' ');
+	}
+
+	void render::format_spec::write(const value_base& value, std::string& output) const {
+		switch(conversion_ == conversion::none ? value_type::other : value.type()) {
+			case value_type::integer: {
+				if(conversion_ == conversion::real || conversion_ == conversion::string)
+					break;
+				const long long v = value.get_integer();
+				// negative numbers are printed in two's complement of original type
+				if(v < 0 && conversion_ != conversion::decimal)
+					break;
+				output += prefix_;
+				write_integer(v, output);
+				output += suffix_;
+				return;
+			}
+			case value_type::real: {
+				const double v = value.get_real();
+				// boost::format prints non-finite values differently
+				if(conversion_ != conversion::real || !std::isfinite(v))
+					break;
+				char buffer[64];
+				const int length = std::snprintf(buffer, sizeof(buffer), real_format_.c_str(), v);
+				if(length < 0)
+					break;
+				output += prefix_;
+				const std::size_t start = output.length();
+				if(static_cast<std::size_t>(length) < sizeof(buffer)) {
+					output.append(buffer, length);
+				} else {
+					output.resize(start + length + 1);
+					std::snprintf(&output[start], length + 1, real_format_.c_str(), v);
+					output.resize(start + length);
+				}
+				// printf follows LC_NUMERIC, but output does not depend on locale (flags do not allow grouping)
+				const char* point = std::localeconv()->decimal_point;
+				if(std::strcmp(point, ".") != 0) {
+					const std::size_t found = output.find(point, start);
+					if(found != std::string::npos)
+						output.replace(found, std::strlen(point), 1, '.');
+				}
+				output += suffix_;
+				return;
+			}
+			case value_type::string: {
+				if(conversion_ != conversion::string)
+					break;
+				const boost::string_ref v = value.get_string();
+				output += prefix_;
+				output.append(v.data(), v.size());
+				output += suffix_;
+				return;
+			}
+			default:
+				break;
+		}
+		output += value.format(source_).raw();
+	}
+
+	render::path::path(const Glib::ustring& name)
+		: name_(name) {
+		// same segments as splitting on '.', except for trailing empty segment ("a." is "a")
+		const std::string& raw = name.raw();
+		std::size_t start = 0;
+		while(start < raw.length()) {
+			std::size_t end = raw.find('.', start);
+			if(end == std::string::npos)
+				end = raw.length();
+			segments_.emplace_back(boost::string_ref(raw).substr(start, end - start));
+			start = end + 1;
+		}
+	}
+
+	render::path::path(const path& parent, const path& child)
+		: name_(parent.name_.empty() ? child.name_ : parent.name_ + "." + child.name_), segments_(parent.segments_) {
+		segments_.insert(segments_.end(), child.segments_.begin(), child.segments_.end());
+	}
+
 
     const render::value_base& render::tree_element::get_value() const {
         if(!self()->value_)
@@ -526,11 +2783,89 @@ namespace webpp { namespace xml {
         }
     }
 
+	bool render::context::in_repeat_variable(const Glib::ustring& name, const std::size_t from) const {
+		const boost::string_ref first = boost::string_ref(name.raw()).substr(0, name.raw().find('.'));
+		for(std::size_t i = from; i < repeat_scopes_.size(); ++i) {
+			const std::string& variable = repeat_scopes_[i].variable.raw();
+			if(first == variable || (first.size() == variable.size() + 6 && first.starts_with(variable) && first.ends_with("-index")))
+				return true;
+		}
+		return false;
+	}
+
+	void render::context::record_read(const Glib::ustring& prefix, const Glib::ustring& name) const {
+		Glib::ustring full = prefix + name;
+		if(!in_repeat_variable(full, reads_repeats_))
+			reads_->insert(std::move(full));
+	}
+
+	render::read_recorder::~read_recorder() {
+		rnd_.reads_ = outer_;
+		rnd_.reads_repeats_ = outer_repeats_;
+		if(outer_ != nullptr) {
+			for(const Glib::ustring& name : reads_) {
+				if(!rnd_.in_repeat_variable(name, outer_repeats_))
+					outer_->insert(name);
+			}
+		}
+	}
+
     void render::context::import_subtree(const Glib::ustring& key, tree_element& orig) {
         root_->find(key).remove_link();
         root_->find(key).create_link(orig.shared_from_this());
     }
 
+	void render::context::repeat_item(const Glib::ustring& variable, tree_element& item, const path& index_name, const int index) {
+		check_repeat_writes();
+		import_subtree(variable, item);
+		get(index_name).create_value(index);
+		repeat_clock_ = root_->clock();
+		// binding is not a write which invalidates results, even if variable is in other tree
+		for(auto& scope : repeat_scopes_) {
+			for(auto& watched : scope.watched)
+				watched.second = *watched.first;
+		}
+	}
+
+	void render::context::watch_repeat(repeat_scope& scope, const tree_element& node) {
+		const tree_element& target = node.target();
+		auto watch = [&scope](std::shared_ptr<const std::size_t> clock) {
+			for(const auto& watched : scope.watched) {
+				if(watched.first == clock)
+					return;
+			}
+			const std::size_t value = *clock;
+			scope.watched.emplace_back(std::move(clock), value);
+		};
+		if(!owns(target))
+			watch(target.shared_clock());
+		// elements of array are trees of their own, their changes advance revision of array
+		if(target.is_array()) {
+			if(const array* a = dynamic_cast<const array*>(&target.get_array()))
+				watch(a->shared_revision());
+		}
+	}
+
+	void render::context::check_repeat_writes() {
+		if(repeat_clock_ != root_->clock()) {
+			for(auto& scope : repeat_scopes_) {
+				scope.results.clear();
+				scope.watched.clear();
+			}
+			repeat_clock_ = root_->clock();
+			return;
+		}
+		for(auto& scope : repeat_scopes_) {
+			for(const auto& watched : scope.watched) {
+				if(*watched.first != watched.second) {
+					scope.results.clear();
+					scope.watched.clear();
+					break;
+				}
+			}
+		}
+	}
+
 	// FIXME: needs tests.
 	node_iterator::node_iterator(xmlpp::Node* node)
 		: node_(node) {}
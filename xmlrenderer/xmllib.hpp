@@ -13,19 +13,24 @@ extern "C" {
 #include <boost/filesystem.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 #include <boost/type_traits.hpp>
 #include <boost/ptr_container/ptr_list.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/noncopyable.hpp>
 #include <type_traits>
+#include <limits>
 #include <cstdarg>
 #include <iomanip>
 #include <fstream>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <list>
+#include <vector>
 #include <cstring>
 #include <cassert>
 
@@ -42,21 +47,85 @@ namespace boost {
 
 namespace webpp { namespace xml {
 	namespace render {
+		/// type of value stored in render context, used by expressions to compare values without converting them to strings
+		enum class value_type { other, integer, real, boolean, string };
+
 		/// abstract interface for values in render context
 		/// supports output() - lexical cast to string
 		/// and format(fmt), where fmt is argument for boost::format(fmt) % value
+		/// values of basic types are also available directly, see type()
 		class value_base : public boost::noncopyable {
 		public:
 			virtual Glib::ustring format(const Glib::ustring& fmt) const = 0;
 			virtual Glib::ustring output() const = 0;
 			virtual bool is_true() const = 0;
+
+			/// \brief Type of stored value, 'other' values are available only through output() and format()
+			virtual value_type type() const { return value_type::other; }
+			/// \brief Stored integer, only for type() == integer
+			virtual long long get_integer() const { throw std::logic_error("render::value_base::get_integer(): not an integer"); }
+			/// \brief Stored real or integer, only for type() == real or type() == integer
+			virtual double get_real() const { throw std::logic_error("render::value_base::get_real(): not a real"); }
+			/// \brief Stored string, valid as long as value, only for type() == string
+			virtual boost::string_ref get_string() const { throw std::logic_error("render::value_base::get_string(): not a string"); }
+			/// \brief Value refers to variable outside render context, which can change without notice
+			virtual bool is_reference() const { return false; }
             virtual ~value_base() {}
 		};
 
+		/// values without typed access, available only through output()
+		struct untyped_value_traits {
+			template<typename T> static value_type type(const T&) { return value_type::other; }
+			template<typename T> static long long integer(const T&) { throw std::logic_error("render::value: not an integer"); }
+			template<typename T> static double real(const T&) { throw std::logic_error("render::value: not a real"); }
+			template<typename T> static boost::string_ref string(const T&) { throw std::logic_error("render::value: not a string"); }
+		};
+
+		/// typed access to values of type T, see value_base::type()
+		template<typename T, typename Enable = void>
+		struct value_traits : untyped_value_traits {};
+
+		template<typename T>
+		struct is_character : std::integral_constant<bool,
+				std::is_same<T, char>::value || std::is_same<T, signed char>::value || std::is_same<T, unsigned char>::value
+				|| std::is_same<T, wchar_t>::value || std::is_same<T, char16_t>::value || std::is_same<T, char32_t>::value> {};
+
+		// integers, except bool and characters, which are not printed as numbers
+		template<typename T>
+		struct value_traits<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value && !is_character<T>::value>::type>
+			: untyped_value_traits {
+			static value_type type(const T& v) {
+				// unsigned long long above long long range is not an integer for expressions
+				return !std::is_signed<T>::value && static_cast<unsigned long long>(v) > static_cast<unsigned long long>(std::numeric_limits<long long>::max())
+					? value_type::other : value_type::integer;
+			}
+			static long long integer(const T& v) { return static_cast<long long>(v); }
+			static double real(const T& v) { return static_cast<double>(v); }
+		};
+
+		// float and long double are not real, their string representation does not convert back to the same double
+		template<>
+		struct value_traits<double> : untyped_value_traits {
+			static value_type type(const double&) { return value_type::real; }
+			static double real(const double& v) { return v; }
+		};
+
+		template<>
+		struct value_traits<bool> : untyped_value_traits {
+			static value_type type(const bool&) { return value_type::boolean; }
+		};
+
+		template<>
+		struct value_traits<Glib::ustring> : untyped_value_traits {
+			static value_type type(const Glib::ustring&) { return value_type::string; }
+			static boost::string_ref string(const Glib::ustring& v) { return boost::string_ref(v.raw()); }
+		};
+
 		/// default implementations of render_value interface
 		template<typename T>
 		class value : public value_base {
 			const T value_;
+			typedef value_traits<typename std::decay<T>::type> traits;
 		public:
 			value(const T& value)
 				: value_(value) {}
@@ -74,6 +143,12 @@ namespace webpp { namespace xml {
 				throw std::runtime_error("render::value<" + Glib::ustring(typeid(T).name()) + ">::is_true(): '" + output() + "' is not a boolean");
 				STACKED_EXCEPTIONS_LEAVE("");
 			}
+
+			virtual value_type type() const { return traits::type(value_); }
+			virtual long long get_integer() const { return traits::integer(value_); }
+			virtual double get_real() const { return traits::real(value_); }
+			virtual boost::string_ref get_string() const { return traits::string(value_); }
+			virtual bool is_reference() const { return std::is_reference<T>::value; }
 		};
 
 		template<>
@@ -133,13 +208,76 @@ namespace webpp { namespace xml {
 			virtual bool is_true() const {
 				return eval().is_true();
 			}
+
+			virtual value_type type() const { return eval().type(); }
+			virtual long long get_integer() const { return eval().get_integer(); }
+			virtual double get_real() const { return eval().get_real(); }
+			virtual boost::string_ref get_string() const { return eval().get_string(); }
 		};
 
 		template<>
 		bool value<bool>::is_true() const;
 
+		/*! \brief Format "%.2f zl" for value_base::format(), parsed once
+		 *  Formats with one printf directive matching type of value (d/i/u/x/X/o for integers, f/F/e/E/g/G for reals,
+		 *  plain %s for strings) are written directly, everything else is passed to value_base::format(),
+		 *  so output is the same as with boost::format.
+		 */
+		class format_spec {
+		public:
+			format_spec() : conversion_(conversion::none) {}
+			explicit format_spec(const Glib::ustring& fmt);
+
+			inline const Glib::ustring& source() const { return source_; }
+			/// \brief True if some values are written without boost::format
+			inline bool compiled() const { return conversion_ != conversion::none; }
+
+			/// \brief Append 'value' formatted by this spec to 'output', reals always with '.' as decimal point
+			void write(const value_base& value, std::string& output) const;
+		private:
+			enum class conversion { none, decimal, octal, hex, upper_hex, real, string };
+
+			Glib::ustring source_;
+			std::string prefix_, suffix_; // text around directive, with %% unescaped
+			std::string real_format_; // printf format of real conversion, without prefix/suffix
+			conversion conversion_;
+			bool left_, plus_, zero_, alternate_;
+			int width_;
+
+			void write_integer(const long long value, std::string& output) const;
+		};
+
 		class tree_element;
 
+		//! \brief One segment of variable path with its hash computed once, see path
+		struct symbol {
+			std::string name;
+			std::size_t hash;
+
+			symbol() : hash(0) {}
+			explicit symbol(boost::string_ref name) : name(name.to_string()), hash(hash_of(name)) {}
+
+			//! \brief Hash of segment name, used also for keys of tree nodes
+			static inline std::size_t hash_of(boost::string_ref name) { return boost::hash_range(name.begin(), name.end()); }
+		};
+
+		inline bool operator==(const symbol& lhs, const symbol& rhs) { return lhs.hash == rhs.hash && lhs.name == rhs.name; }
+
+		//! \brief Variable name ("user.address.city") split and hashed once, lookups by path do not allocate
+		class path {
+			Glib::ustring name_;
+			std::vector<symbol> segments_;
+		public:
+			path() {}
+			explicit path(const Glib::ustring& name);
+			//! \brief Path 'parent.child', joined without hashing segments again
+			path(const path& parent, const path& child);
+
+			inline const Glib::ustring& name() const { return name_; }
+			inline const std::vector<symbol>& segments() const { return segments_; }
+			inline bool empty() const { return segments_.empty(); }
+		};
+
 		//! \brief Array interface
 		class array_base {
 		public:
@@ -151,20 +289,50 @@ namespace webpp { namespace xml {
             virtual ~array_base() {}
 		};
 
+		//! \brief Data derived from array contents (e.g. index), stored with array until it changes
+		class array_cache {
+		public:
+			virtual ~array_cache() {}
+		};
+
 		//! \brief Store zero or more sub storages (aka subtrees)
 		class array : public array_base {
+		public:
 			typedef std::list<std::shared_ptr<tree_element>> elements_t;
+		private:
 			elements_t elements_;
 			elements_t::iterator it_;
+			std::shared_ptr<std::size_t> revision_; // shared with elements, changed by add() and by modification of any element
+			typedef boost::unordered_map<std::string, std::pair<std::size_t, std::unique_ptr<array_cache>>> caches_t;
+			mutable caches_t caches_;
+		public:
+			array() : it_(elements_.end()), revision_(std::make_shared<std::size_t>(0)) {}
+		private:
+			//! \brief Share revision with new element, defined after tree_element
+			inline void attach(tree_element& element);
 		public:
-			array() : it_(elements_.end()) {}
 
 			template<typename TreeElementT = tree_element, typename... TreeElementParamsT>
 			TreeElementT& add(TreeElementParamsT&&... params) {
-				elements_.emplace_back(new TreeElementT(std::forward<TreeElementParamsT>(params)...));
-				return *dynamic_cast<TreeElementT*>(elements_.back().get());
+				TreeElementT* element = new TreeElementT(std::forward<TreeElementParamsT>(params)...);
+				elements_.emplace_back(element);
+				attach(*element);
+				++*revision_;
+				return *element;
 			}
 
+			//! \brief All elements, iteration does not change state of next()
+			inline const elements_t& elements() const { return elements_; }
+			//! \brief Revision of contents, changed by add() and by modification of any element
+			inline std::shared_ptr<const std::size_t> shared_revision() const { return revision_; }
+
+			/*! \brief Data stored under 'key' by store_cache(), nullptr if there is none or array changed since
+			 *  Keys start with prefix of their user ("in:" is used by 'in' operator), callers check type of found data.
+			 */
+			array_cache* find_cache(const std::string& key) const;
+			//! \brief Store data derived from current contents under 'key', replace previous one
+			void store_cache(const std::string& key, std::unique_ptr<array_cache> cache) const;
+
             virtual tree_element& next();
             virtual bool has_next() const;
             virtual bool empty() const;
@@ -176,14 +344,49 @@ namespace webpp { namespace xml {
 		class tree_element : public std::enable_shared_from_this<tree_element>, boost::noncopyable {
 			std::unique_ptr<value_base> value_;
 			std::unique_ptr<array_base> array_;
-			typedef boost::unordered_map<Glib::ustring, std::shared_ptr<tree_element>> children_t;
+			struct name_hash {
+				inline std::size_t operator()(boost::string_ref name) const { return symbol::hash_of(name); }
+			};
+			typedef boost::unordered_map<std::string, std::shared_ptr<tree_element>, name_hash> children_t;
 			children_t children_;
             std::weak_ptr<tree_element> link_;
             std::shared_ptr<tree_element> permalink_;
+            std::shared_ptr<std::size_t> revision_; // revision of array containing this node, if any
+            std::shared_ptr<std::size_t> clock_; // shared by all nodes of one tree, advanced by every change in it
+            std::size_t stamp_;
+
+            inline void touch() { stamp_ = next_stamp(); ++*clock_; if(revision_) ++*revision_; }
+            friend class array;
 
             inline std::shared_ptr<tree_element> self() { return link_.expired() ? shared_from_this() : link_.lock(); }
             inline std::shared_ptr<const tree_element> self() const { return link_.expired() ? shared_from_this() : link_.lock(); }
 		public:
+			//! \brief Root of new tree
+			tree_element() : clock_(std::make_shared<std::size_t>(1)), stamp_(next_stamp()) {}
+			//! \brief Node of tree with given clock
+			explicit tree_element(std::shared_ptr<std::size_t> clock) : clock_(std::move(clock)), stamp_(next_stamp()) {}
+
+			//! \brief New stamp, stamps are unique and increase monotonically across all nodes
+			static std::size_t next_stamp();
+
+			//! \brief Clock of tree containing this node, changes whenever any node of this tree changes
+			inline std::size_t clock() const { return *clock_; }
+			//! \brief Clock of tree containing this node, shared with all its nodes, \see clock()
+			inline std::shared_ptr<const std::size_t> shared_clock() const { return clock_; }
+			//! \brief True if node belongs to same tree as this node, so its changes advance clock()
+			inline bool same_tree(const tree_element& node) const { return clock_ == node.clock_; }
+
+			//! \brief Stamp of creation or last modification of this node (value, array or link)
+			inline std::size_t stamp() const { return stamp_; }
+
+			/*! \brief Append value, array elements and children of this node to 'output', nothing for node without any of them
+			 *  Nodes with equal data are serialized equally, children in order of names. Cursors of arrays are not used.
+			 *  Arrays other than render::array get unique text, so they never compare equal.
+			 */
+			void serialize(std::string& output) const;
+
+			//! \brief Node which holds data of this node, differs for linked nodes
+			inline const tree_element& target() const { return *self(); }
 
 			//! \brief Remove link from this node (used with imported and lazy tree nodes)
             void remove_link();
@@ -196,6 +399,12 @@ namespace webpp { namespace xml {
 
 			//! \brief Find tree element stored under key in this subtree. Every key exists in tree, but only some of them have associated variables or arrays
             virtual tree_element& find(const Glib::ustring& key);
+			//! \brief Find tree element stored under precompiled key, \see find(const Glib::ustring&)
+            virtual tree_element& find(const path& key);
+			//! \brief Child of this node with 'name' which has hash 'hash', created if it does not exist yet
+            tree_element& child(boost::string_ref name, const std::size_t hash);
+			//! \brief Tree element stored under key, nullptr if it does not exist. Unlike find(), nodes are not created.
+            const tree_element* lookup(const path& key) const;
 
 			//! \brief Get value stored under this tree element. Throw exception if there is no value here.
             virtual const value_base& get_value() const;
@@ -219,6 +428,7 @@ namespace webpp { namespace xml {
 			void create_value(const T& v) {
                 self()->value_.reset(new value<StorageT>(v));
                 self()->array_.reset();
+                self()->touch();
 			}
 
 			//! \brief Put lambda returing value in this tree element. Also, reset previous value or array stored here.
@@ -226,6 +436,7 @@ namespace webpp { namespace xml {
 			void create_lambda(F&& f) {
                 self()->value_.reset(new function<F>(std::forward<F>(f)));
                 self()->array_.reset();
+                self()->touch();
 			}
 
 			//! \brief Put array here. Also, reset previous value or array stored here. Returns array to fill contents.
@@ -233,30 +444,96 @@ namespace webpp { namespace xml {
 			ArrayT& create_array(ArrayParams&&... ap) {
                 self()->value_.reset();
                 self()->array_.reset(new ArrayT(std::forward<ArrayParams>(ap)...));
+                self()->touch();
                 return *dynamic_cast<ArrayT*>(self()->array_.get());
 			}
 
 			virtual void debug(const std::string& prefix = "/", int tab = 0) const;
         };
 
+		inline void array::attach(tree_element& element) {
+			element.revision_ = revision_;
+		}
+
+
+		//! \brief Result of expression remembered in render::context, valid while nodes it depends on are unchanged
+		struct memo_entry {
+			std::vector<std::pair<const tree_element*, std::size_t>> dependencies; // target node and its stamp
+			std::size_t checked; // context::clock() when dependencies were checked, 0 if some of them are in other trees
+			bool has_boolean, has_string;
+			bool boolean;
+			std::string string;
+
+			memo_entry() : checked(0), has_boolean(false), has_string(false), boolean(false) {}
+		};
+
+		//! \brief Results of expressions which do not depend on repeat variable, valid during one repeat
+		struct repeat_scope {
+			Glib::ustring variable, prefix;
+			boost::unordered_map<const void*, memo_entry> results;
+			// clocks of other trees and revisions of arrays which results depend on, with their values when results were valid
+			std::vector<std::pair<std::shared_ptr<const std::size_t>, std::size_t>> watched;
+
+			repeat_scope(const Glib::ustring& variable, const Glib::ustring& prefix) : variable(variable), prefix(prefix) {}
+		};
 
 		//! \brief Frontend for storage tree
 		class context {
 			mutable std::shared_ptr<tree_element> root_; // mutable, because 'read only' operations also create paths
-            std::deque<Glib::ustring> prefixes_;
+            std::vector<std::pair<Glib::ustring, path>> prefixes_; // current_prefix_ and prefix_path_ before each push_prefix()
             Glib::ustring current_prefix_;
+            path prefix_path_;
+			std::size_t prefix_changes_; // names resolve to other nodes after every change of prefix
+			std::size_t repeat_clock_; // clock of tree after last change made by repeats
+			boost::unordered_map<const void*, memo_entry> memo_;
+			std::deque<repeat_scope> repeat_scopes_;
+			boost::unordered_set<Glib::ustring>* reads_; // names found by get(), if they are recorded
+			std::size_t reads_repeats_; // repeats active when recording started, their variables are recorded
+
+			void record_read(const Glib::ustring& prefix, const Glib::ustring& name) const;
+			//! \brief Forget results of active repeats, if tree changed other way than by binding repeat variables
+			void check_repeat_writes();
+			//! \brief 'name' is variable (or its index) of repeat started as 'from'-th or later
+			bool in_repeat_variable(const Glib::ustring& name, const std::size_t from) const;
 		public:
-			context() : root_(std::make_shared<tree_element>()) {}
-			//! \brief Get mutable tree element found under key
+			context() : root_(std::make_shared<tree_element>()), prefix_changes_(0), repeat_clock_(0), reads_(nullptr), reads_repeats_(0) {}
+			//! \brief Get mutable tree element found under key, key is split and hashed on every call
             inline tree_element& get(const Glib::ustring &name) {
-                return root_->find(current_prefix_ + name);
+				if(reads_ != nullptr)
+					record_read(current_prefix_, name);
+                return (prefix_path_.empty() ? *root_ : root_->find(prefix_path_)).find(name);
+			}
+
+			//! \brief Get mutable tree element found under precompiled key
+            inline tree_element& get(const path& name) {
+				if(reads_ != nullptr)
+					record_read(current_prefix_, name.name());
+                return (prefix_path_.empty() ? *root_ : root_->find(prefix_path_)).find(name);
 			}
 
 			//! \brief Get const tree element found under key
             inline const tree_element& get(const Glib::ustring &name) const {
+				if(reads_ != nullptr)
+					record_read(Glib::ustring(), name);
 				return root_->find(name);
 			}
 
+			//! \brief Get const tree element found under precompiled key
+            inline const tree_element& get(const path& name) const {
+				if(reads_ != nullptr)
+					record_read(Glib::ustring(), name.name());
+				return root_->find(name);
+			}
+
+			//! \brief Const tree element found under precompiled key, nullptr if it does not exist, \see tree_element::lookup()
+            inline const tree_element* lookup(const path& name) const {
+				return root_->lookup(name);
+			}
+
+			//! \brief True while read_recorder is active
+			inline bool recording_reads() const { return reads_ != nullptr; }
+			friend class read_recorder;
+
 			//! \brief Store value (copied) under key
 			template<typename T>
 			void create_value(const Glib::ustring& key, const T& value) {
@@ -290,24 +567,92 @@ namespace webpp { namespace xml {
 				root_->find(key).create_link(std::make_shared<T>(std::forward<Args>(args)...));
 			}
 
+			//! \brief Changes whenever any node of this context's tree or prefix changes
+			inline std::size_t clock() const { return root_->clock() + prefix_changes_; }
+
+			//! \brief True if node is in this context's tree (not in imported subtree or array)
+			inline bool owns(const tree_element& node) const { return root_->same_tree(node); }
+
+			//! \brief Results of expressions evaluated with this context, keyed by interned expression
+			inline boost::unordered_map<const void*, memo_entry>& memo() { return memo_; }
+
+			/*! \brief Start repeat over 'variable', expressions which do not use it are evaluated once until pop_repeat()
+			 *  Other changes of context during repeat than repeat_item() make them evaluated again.
+			 */
+			inline void push_repeat(const Glib::ustring& variable) {
+				check_repeat_writes();
+				repeat_scopes_.emplace_back(variable, current_prefix_);
+			}
+
+			//! \brief Bind variable of repeat to item and set its index, results of expressions which do not use them remain valid
+			void repeat_item(const Glib::ustring& variable, tree_element& item, const path& index_name, const int index);
+
+			//! \brief Results of 'scope' depend on 'node', they are forgotten when its tree (if it is not this context's tree) or its array changes
+			void watch_repeat(repeat_scope& scope, const tree_element& node);
+
+			//! \brief End last started repeat
+			inline void pop_repeat() {
+				repeat_scopes_.pop_back();
+			}
+
+			//! \brief Active repeats, innermost last, without results made invalid by changes of context
+			inline std::deque<repeat_scope>& repeat_scopes() {
+				check_repeat_writes();
+				return repeat_scopes_;
+			}
+
+			inline const Glib::ustring& current_prefix() const { return current_prefix_; }
+
             //! \brief All searches after this call will add this (and previous) prefixes joined by "."
             inline void push_prefix(const Glib::ustring& prefix) {
-                prefixes_.push_back(prefix);
+                push_prefix(path(prefix));
+            }
+
+            //! \brief Add precompiled prefix, \see push_prefix(const Glib::ustring&)
+            inline void push_prefix(const path& prefix) {
+                ++prefix_changes_; // names resolve to other nodes now
+                prefixes_.emplace_back(current_prefix_, prefix_path_);
                 if(!prefix.empty()) {
-                    current_prefix_ += prefix + ".";
+                    current_prefix_ += prefix.name() + ".";
+                    prefix_path_ = path(prefix_path_, prefix);
                 }
             }
 
             //! \brief Pop last added prefix
             inline void pop_prefix() {
+                ++prefix_changes_;
+                current_prefix_.swap(prefixes_.back().first);
+                std::swap(prefix_path_, prefixes_.back().second);
                 prefixes_.pop_back();
-                current_prefix_ = "";
-                for(const auto &i : prefixes_)
-                    if(!i.empty())
-                        current_prefix_ += i + ".";
-
             }
 		};
+
+		/*! \brief Adds full names (with prefix) of elements found by context::get() to set, until it is destroyed
+		 *  Variables of repeats started later are not recorded, they are read from recorded arrays. Recorders can be nested,
+		 *  names recorded by inner one are added to outer one too.
+		 */
+		class read_recorder : boost::noncopyable {
+			context& rnd_;
+			boost::unordered_set<Glib::ustring>& reads_;
+			boost::unordered_set<Glib::ustring>* outer_;
+			std::size_t outer_repeats_;
+		public:
+			read_recorder(context& rnd, boost::unordered_set<Glib::ustring>& reads)
+				: rnd_(rnd), reads_(reads), outer_(rnd.reads_), outer_repeats_(rnd.reads_repeats_) {
+				rnd_.reads_ = &reads_;
+				rnd_.reads_repeats_ = rnd_.repeat_scopes_.size();
+			}
+
+			~read_recorder();
+		};
+
+		//! \brief Calls push_repeat() and pop_repeat() when leaving scope
+		class repeat_guard : boost::noncopyable {
+			context& rnd_;
+		public:
+			repeat_guard(context& rnd, const Glib::ustring& variable) : rnd_(rnd) { rnd_.push_repeat(variable); }
+			~repeat_guard() { rnd_.pop_repeat(); }
+		};
 	}
 
 	class node_iterator {
@@ -327,6 +672,27 @@ namespace webpp { namespace xml {
 	};
 
 	class context;
+	class tag;
+	class xmlns;
+	class compiled_node;
+	class fragment;
+	namespace expressions { class compiled_expression; }
+
+	/// \brief Namespaces of elements and attributes, interned when fragment is loaded
+	enum class namespace_id : unsigned char {
+		none, // no namespace
+		xml, // webpp://xml
+		html5, // webpp://html5
+		control, // webpp://control
+		custom, // other webpp:// namespaces, handled by taglibs
+		foreign // other namespaces, copied to output
+	};
+
+	/// \brief Interned namespace URI
+	namespace_id intern_namespace(const Glib::ustring& uri);
+
+	/// \brief webpp://control attributes
+	enum class control_id : unsigned char { repeat, repeat_array, repeat_variable, visible_if, repeat_once, unknown };
 // short macro for checking existance of variable in rendering context
 #define ctx_variable_check(tag, attribute, variablename, rndvalue) if(rndvalue.empty()) throw std::runtime_error((boost::format("variable '%s' required from <%s> at line %d, attribute %s, is missing") % variablename % tag->get_name() % tag->get_line() % attribute).str())
 
@@ -335,10 +701,13 @@ namespace webpp { namespace xml {
 		const Glib::ustring name_; // for exception decorating
 		std::unique_ptr<xmlpp::Document> output_; // mutable, because to_string() is obviously const, and libxml++ thinks different.
         bool remove_xml_declaration_; // usefull for broken browsers		
+        int html5_encoding_; // flags of xhtml5() with HTML5, output is serialized by xml_writer then
 	public:
-		/// \brief Construct empty document
+		/// \brief Construct empty document, taken from documents of this thread which were released by previous outputs
 		fragment_output(const Glib::ustring& name);
 		fragment_output(fragment_output&&);
+		/// \brief Clear document and keep it for next output of this thread
+		~fragment_output();
 
 		/// \brief Find all nodes matching to XPath expression
 		//xmlpp::NodeSet find_by_xpath(const Glib::ustring& query) const;
@@ -349,7 +718,9 @@ namespace webpp { namespace xml {
         enum xhtml5_encoding {
             DOCTYPE = 1, // add xhtml5 doctype
             REMOVE_XML_DECLARATION = 2, // remove <?xml ...
-            REMOVE_COMMENTS = 4 // remove all comments
+            REMOVE_COMMENTS = 4, // remove all comments
+            HTML5 = 8, // serialize as HTML5: no XML declaration, void elements without end tag, raw text in script and style
+            MINIMIZE_ATTRIBUTES = 16 // with HTML5, write empty and boolean attributes of HTML elements without value
         };
 
         //! \brief Convert XML tree to valid HTML5 and add fixes (conditional <html> etc.)
@@ -363,8 +734,175 @@ namespace webpp { namespace xml {
         void remove_comments(xmlpp::Element*);
     };
 
+	/*! \brief Rendered text as sequence of chunks, which can be passed to writev() or sendmsg() without concatenating
+	 *  Static chunks point to serialized static nodes of fragments (\see fragment::program::blob), output keeps these fragments
+	 *  alive until it is cleared, even if they are reloaded. Dynamic chunks point to buffer of this output. Output can be reused for next render.
+	 */
+	class chunked_output : boost::noncopyable {
+	public:
+		/// \brief Chunk of output, with the same members as struct iovec
+		struct chunk {
+			const char* data;
+			std::size_t size;
+		};
+
+		/// static content shorter than this is copied to buffer, it is cheaper than next chunk
+		static const std::size_t min_static_chunk = 128;
+
+		chunked_output();
+
+		/// \brief Chunks of output, invalidated by next render to this output or by clear()
+		const std::vector<chunk>& chunks() const;
+		/// \brief Size of whole output
+		std::size_t size() const;
+		std::string to_string() const;
+		/// \brief Remove all chunks and release fragments they point to, keep allocated buffer
+		void clear();
+	private:
+		struct segment {
+			const char* data; // nullptr for dynamic segment
+			std::size_t offset, size; // offset in buffer_ for dynamic segment
+		};
+
+		std::string buffer_;
+		std::vector<segment> segments_;
+		std::size_t flushed_; // end of buffer_ covered by segments_, rest is last dynamic chunk
+		mutable std::vector<chunk> chunks_;
+		std::vector<std::shared_ptr<const fragment>> fragments_; // owners of static chunks
+
+		friend class xml_writer;
+		/// \brief Add static chunk after what was appended to buffer, 'owner' is kept until output is cleared
+		void add_static(boost::string_ref content, const fragment* owner);
+		/// \brief Fix segments after 'size' bytes were inserted to buffer at 'position'
+		void inserted(const std::size_t position, const std::size_t size);
+	};
+
+	/*! \brief Serializer of rendered output, writes the same text as fragment_output::to_string() without output document
+	 *  Start of element is written when its first child is added or when it is closed, until then it can be removed, renamed
+	 *  or get more attributes. Namespaces are declared at root element, as prepared_fragment::render_dom() does.
+	 *  With fragment_output::HTML5, elements without prefix are written by HTML5 syntax.
+	 */
+	class xml_writer : boost::noncopyable {
+	public:
+		/// \brief Append output to 'buffer', 'xhtml5_encoding' as in fragment_output::xhtml5(), 0 for plain XML
+		explicit xml_writer(std::string& buffer, const int xhtml5_encoding = 0);
+		/// \brief Append output to 'output', serialized() content is not copied
+		explicit xml_writer(chunked_output& output, const int xhtml5_encoding = 0);
+
+		/// \brief Receiver of flushed output
+		typedef std::function<void(boost::string_ref)> sink_t;
+		/*! \brief Collect output in 'buffer' and pass it to 'sink' when flush() is called or 'flush_threshold' bytes are collected
+		 *  Namespaces declared after root start was flushed are declared at element which needs them, so output can differ
+		 *  from output document in placement of namespace declarations.
+		 */
+		xml_writer(std::string& buffer, const sink_t& sink, const std::size_t flush_threshold, const int xhtml5_encoding = 0);
+		/// \brief Pass collected output to sink if there are at least 'threshold' bytes, written start of root can not get more namespaces then
+		void flush(const std::size_t threshold = 1);
+		inline std::size_t flush_threshold() const { return flush_threshold_; }
+		/// \brief Start of root element was passed to sink, namespaces are declared by elements which use them
+		inline bool root_flushed() const { return namespaces_end_ == std::string::npos; }
+
+		/*! \brief Write element which is inserted into other output later, without XML declaration, doctype and namespace
+		 *  declarations, \see namespaces()
+		 */
+		xml_writer(std::string& buffer, const int xhtml5_encoding, const bool embedded);
+		/// \brief Declared namespaces as uri and prefix, in order of declaration
+		std::vector<std::pair<std::string, std::string>> namespaces() const;
+
+		/// \brief Start element as child of current element (or as root element), it becomes current element
+		void open_element(boost::string_ref name);
+		/// \brief End current element, its parent becomes current element
+		void close_element();
+		/// \brief Drop current element which is not written yet, its parent becomes current element
+		void remove_element();
+		/// \brief Drop current element, but keep it current until close_element(), its content is added to its parent
+		void detach_element();
+		/// \brief Number of open elements, 1 inside root element
+		inline std::size_t depth() const { return depth_; }
+		inline const std::string& current_name() { return current().name; }
+		inline int xhtml5_encoding() const { return xhtml5_encoding_; }
+
+		/// \brief Rename current element, its namespace is kept
+		void set_name(boost::string_ref name);
+		/// \brief Move current element to namespace declared with 'prefix'
+		void set_namespace(boost::string_ref prefix);
+		/// \brief Declare namespace at root element, throw if 'prefix' is declared with other uri
+		void set_namespace_declaration(boost::string_ref uri, boost::string_ref prefix = boost::string_ref());
+		/// \brief Set attribute of current element, its children must not be added yet
+		void set_attribute(boost::string_ref name, boost::string_ref value);
+		/// \brief Set attribute of current element when its start is written, after all other attributes. Attributes deferred later are set first.
+		void defer_attribute(boost::string_ref name, boost::string_ref value);
+
+		void text(boost::string_ref content);
+		void comment(boost::string_ref content);
+		void cdata(boost::string_ref content);
+		/// \brief Copy 'node' and its children to current element
+		void copy(const xmlpp::Node* node);
+		/*! \brief Append already serialized nodes to current element, \see fragment::program::blob
+		 *  chunked_output refers to 'content' instead of copying it, so it must outlive output, unless it is owned by
+		 *  fragment 'owner', which output keeps alive.
+		 */
+		void serialized(boost::string_ref content, const fragment* owner = nullptr);
+		/// \brief Append copy of serialized nodes to current element
+		void raw(boost::string_ref content);
+		/// \brief Write all nodes of 'document', there must be no open element
+		void copy_document(const xmlpp::Document& document);
+
+		/// \brief Empty element named as current element in temporary document, for handlers which need DOM, \see copy_element()
+		xmlpp::Element* scratch_element();
+		/*! \brief Copy name, attributes and children of 'element' from scratch_element() to current element
+		 *  Nodes added next to it are written as siblings of current element. If it was removed, current element is detached
+		 *  and everything added instead of it is written to parent.
+		 */
+		void copy_element(const xmlpp::Element* element);
+
+		static void escape_text(boost::string_ref content, std::string& output);
+		static void escape_attribute(boost::string_ref value, std::string& output);
+	private:
+		struct element {
+			std::string prefix, name;
+			std::vector<std::pair<std::string, std::string>> attributes, deferred; // reused, only first attribute_count/deferred_count are set
+			std::size_t attribute_count, deferred_count;
+			std::string trailer; // written after end of element
+			bool written, detached;
+		};
+
+		struct namespace_declaration {
+			std::string prefix, uri;
+			bool has_uri;
+			std::size_t scope; // depth of element which declares namespace after root was flushed, 0 for root
+		};
+
+		std::string& buffer_;
+		chunked_output* chunked_; // nullptr when writing to string
+		bool embedded_;
+		sink_t sink_;
+		std::size_t flush_threshold_;
+		const int xhtml5_encoding_;
+		std::vector<element> elements_; // current element at depth_ - 1, deeper ones are kept for reuse
+		std::size_t depth_, written_; // open elements, first written_ of them are written
+		std::vector<namespace_declaration> namespaces_;
+		std::size_t namespaces_end_; // position for next namespace declaration in buffer, if root is written, npos if it was flushed
+		std::unique_ptr<xmlpp::Document> scratch_;
+		const xmlNode* scratch_node_;
+
+		element& current();
+		/// \brief Text of current element is not escaped, \see fragment_output::HTML5
+		bool raw_text();
+		/// \brief Forget namespaces declared by current element
+		void end_scope();
+		/// \brief Write start of all open elements which are not written yet, except of 'except' innermost ones
+		void write_open_elements(const std::size_t except = 0);
+		void write_start(element& e, const bool root, const bool empty);
+		void write_namespace(const namespace_declaration& ns, std::string& output) const;
+		const namespace_declaration* find_namespace(boost::string_ref prefix) const;
+		/// \brief Write node as child of current element
+		void write_child(const xmlNode* node);
+		void write_node(const xmlNode* node, std::string& output) const;
+	};
+
 	/// \brief Piece of html5/xml, which is stored and then rendered using render::context and its values
-	class fragment : public boost::noncopyable {
+	class fragment : public std::enable_shared_from_this<fragment>, boost::noncopyable {
 		const Glib::ustring name_;
 		context& context_;
 		xmlpp::DomParser reader_;
@@ -379,8 +917,128 @@ namespace webpp { namespace xml {
         inline const Glib::ustring& name() const { return name_; }
 		inline xmlpp::Document& get_document() { return processed_document_ ? *processed_document_ : *reader_.get_document(); }
 		inline const xmlpp::Document& get_document() const { return processed_document_ ? *processed_document_ : *reader_.get_document(); }
+
+		/// \brief Attribute of element, with interned namespace and name
+		struct attribute_info {
+			const xmlpp::Attribute* attribute;
+			Glib::ustring name, value;
+			namespace_id ns;
+			control_id control; // only for ns == control
+			const xmlns* handler; // handler of namespace, nullptr if it was not loaded with fragment
+			std::shared_ptr<const compiled_node> compiled; // handler->compile(attribute)
+			const expressions::compiled_expression* expression; // compiled c:visible-if, nullptr if it does not parse
+		};
+
+		/// \brief Element of fragment with everything render needs to dispatch it, built when fragment is loaded
+		struct node_info {
+			const xmlpp::Element* element;
+			namespace_id ns;
+			const tag* tag_handler; // custom tag, nullptr if it was not loaded with fragment
+			const xmlns* xmlns_handler; // handler of custom element namespace, as above
+			std::shared_ptr<const compiled_node> compiled; // xmlns_handler->compile(element)
+			bool control_insert; // <c:insert>
+			bool repeat_once; // c:repeat-once="yes"
+			bool has_id;
+			bool static_tree; // element and its descendants are copied to output as they are (no ids, handlers or control attributes)
+			Glib::ustring id;
+			std::vector<attribute_info> attributes;
+			std::vector<const xmlpp::Node*> children;
+			std::vector<const node_info*> child_elements; // info of each child, nullptr if it is not element
+		};
+
+		/// \brief Information about element of this fragment
+		const node_info& info(const xmlpp::Element* element) const;
+
+		/// \brief Find handlers of elements and attributes again, when taglib is loaded after this fragment
+		void bind_handlers();
+
+		/*! \brief Fragment flattened into linear list of instructions, built when fragment is loaded
+		 *  Program of element works on current output element created by its parent, root program on root of output.
+		 *  Control attributes are resolved when fragment is compiled, only conditions, repeats and insertions are left for render.
+		 */
+		struct program {
+			enum class opcode : unsigned char {
+				open_child, // add child element to current output element and make it current
+				close, // make parent of current output element current
+				test, // evaluate c:visible-if of 'node', attribute 'argument'
+				test_and, // as above, but element stays invisible if previous test failed
+				discard_if_invisible, // if last test failed, remove current output element and jump to 'exit'
+				fail, // throw std::runtime_error(strings[argument])
+				begin_element, // set name and namespace of current output element to name of 'node'
+				set_attribute, // copy attribute 'argument' of 'node'
+				xmlns_attribute, // let namespace handler process attribute 'argument' of 'node'
+				copy, // copy child 'argument' of 'node' (text, cdata...)
+				comment, // copy comment child 'argument' of 'node', unless comments are removed by render
+				blob, // stream output appends blobs[argument] and jumps to 'exit', document output runs following instructions
+				call_tag, // render custom element 'node' by tag or namespace handler
+				insert, // <c:insert> inserts[argument], jump to 'exit' if inserted root is not visible
+				insertion, // if 'node' has view inserted by id, render it and jump to 'target' ('exit' if it is not visible)
+				begin_inner, // start inner repeat repeats[argument]
+				next_inner, // next item of innermost repeat, jump to 'target' after last one
+				skip_repeated, // jump to 'target' if innermost repeat is not at its first item (c:repeat-once)
+				begin_outer, // start outer repeat repeats[argument], remove current output element and jump to 'exit' if array is empty
+				next_outer, // next item of innermost repeat, which is not empty
+				more_outer, // if repeat has more items, add next output element 'node' and jump to 'target', otherwise end repeat
+				jump // jump to 'target'
+			};
+
+			struct instruction {
+				opcode op;
+				unsigned argument;
+				unsigned target, exit;
+				const node_info* node;
+			};
+
+			struct repeat {
+				Glib::ustring variable;
+				render::path array, index;
+			};
+
+			/// \brief <c:insert name="view" value-prefix="prefix">
+			struct insert {
+				Glib::ustring view;
+				render::path prefix;
+			};
+
+			/// \brief Static children of element, serialized when fragment is loaded
+			struct blob {
+				std::string content, without_comments; // without_comments for fragment_output::REMOVE_COMMENTS
+				std::string html_content, html_without_comments; // the same for fragment_output::HTML5
+				bool html5; // contains webpp://html5 elements, which declare xhtml namespace
+			};
+
+			std::vector<instruction> code;
+			std::vector<Glib::ustring> strings; // error messages
+			std::vector<repeat> repeats;
+			std::vector<insert> inserts;
+			std::vector<blob> blobs;
+		};
+
+		inline const program& get_program() const { return program_; }
 	private:
+		boost::unordered_map<const xmlpp::Element*, node_info> nodes_;
+		program program_;
+
 		void apply_stylesheets();
+		/// \brief Fold c:visible-if expressions using constants from context, drop elements which are never visible
+		void fold_constants(xmlpp::Element* element, bool root);
+		/// \brief Let namespace handlers prepare their elements and attributes, \see xmlns::prepare
+		void prepare_xmlnses(const xmlpp::Element* element);
+		/// \brief Build node_info of element and its descendants
+		void index_nodes(const xmlpp::Element* element);
+		/// \brief Find handlers of element and its attributes and compile them, \see xmlns::compile
+		void resolve_handlers(node_info& info);
+		/// \brief Compile program of whole fragment, \see program
+		void compile();
+		/// \brief Emit program of element, add instructions which jump behind element (it is not visible) to 'exits'
+		void compile_element(const node_info& info, const bool in_outer_repeat, std::vector<std::size_t>& exits);
+		void compile_children(const node_info& info, const bool direct_inside_inner);
+		/// \brief Serialize static children [first, last) of element into blob of instruction 'blob', which jumps behind them
+		void compile_blob(const node_info& info, const std::size_t blob, const unsigned first, const unsigned last);
+		/// \brief Write static element as stream render does, \return true if it contains webpp://html5 elements
+		bool write_static(xml_writer& writer, const node_info& info) const;
+		std::size_t emit(const program::opcode op, const node_info* node = nullptr, const unsigned argument = 0);
+		std::size_t emit_fail(const std::string& message);
     };
 
     /// \brief Prepared fragment
@@ -389,30 +1047,82 @@ namespace webpp { namespace xml {
         context& context_;
         struct view_insertion {
             Glib::ustring view_name, value_prefix;
+            render::path prefix; // value_prefix compiled by insert()
         };
 
         typedef boost::container::flat_map<Glib::ustring, view_insertion> view_insertions_t;
         view_insertions_t view_insertions_;
+        struct bound_fragment;
+        struct bindings;
+        std::shared_ptr<const bindings> bindings_; // built by first render after insert(), shared by copies
+        friend class context;
 
     public:
         prepared_fragment(const fragment& fragment, context& ctx) : fragment_(fragment), context_(ctx) {}
 
-        /// \brief render this fragment, return XML in string
-        fragment_output render(render::context& rnd);
-
-        /// \brief Add view 'view_name' to node with id='id'
+        /*! \brief render this fragment, return XML in string
+         *  Output is converted by fragment_output::xhtml5(xhtml5_encoding), but fragment_output::REMOVE_COMMENTS leaves
+         *  comments of fragments out while rendering, so output does not have to be searched for them.
+         */
+        fragment_output render(render::context& rnd, const int xhtml5_encoding = 0);
+        /// \brief render this fragment by walking its DOM instead of running its program, output is the same as of render()
+        fragment_output render_dom(render::context& rnd);
+        /*! \brief render this fragment as text appended to 'output', without output document
+         *  Result is the same as of render(rnd).xhtml5(xhtml5_encoding).to_string(), or of render(rnd).to_string() when 'xhtml5_encoding' is 0.
+         *  Result is taken from output cache of context, if it is enabled (\see context::enable_output_cache()).
+         */
+        void render(render::context& rnd, std::string& output, const int xhtml5_encoding = 0);
+        /// \brief render this fragment to 'output', \see render(render::context&, std::string&, const int)
+        void render(render::context& rnd, std::ostream& output, const int xhtml5_encoding = 0);
+        /// \brief render this fragment as chunks appended to 'output', static content is not copied, \see chunked_output
+        void render(render::context& rnd, chunked_output& output, const int xhtml5_encoding = 0);
+        /*! \brief render this fragment progressively, passing output to 'sink' whenever 'flush_threshold' bytes are collected
+         *  Content before each repeat is passed before its items are rendered. Namespaces first used after output was
+         *  passed are declared at elements which use them, \see xml_writer.
+         */
+        void render(render::context& rnd, const xml_writer::sink_t& sink, const std::size_t flush_threshold = 16384, const int xhtml5_encoding = 0);
+
+        /*! \brief Add view 'view_name' to node with id='id'
+         *  Views and fragments of c:insert are resolved once, when prepared fragment is rendered first time after insert().
+         *  Prepared fragment can be rendered again without lookups. It keeps fragments it was bound to, so it stays valid when
+         *  they are reloaded, but it renders them as they were; prepared fragment got from context after reload uses new ones.
+         */
         inline prepared_fragment& insert(const Glib::ustring& id, const Glib::ustring& view_name, const Glib::ustring& value_prefix) {
-            view_insertions_[id] = view_insertion { view_name, value_prefix };
+            view_insertions_[id] = view_insertion { view_name, value_prefix, render::path(value_prefix) };
+            bindings_.reset();
             return *this;
         }
 
         inline const fragment& get_fragment() const { return fragment_; }
 
     private:
-        /// \brief Process node 'src' and its children, put generated output into 'dst'
-		void process_node(const xmlpp::Element* src, xmlpp::Document& output, xmlpp::Element* dst, render::context& rnd, bool already_processing_outer_repeat = false);
-        /// \brief Process children of 'src' and put generated output as children of 'dst
-		void process_children(const xmlpp::Element* src, xmlpp::Document& output, xmlpp::Element* dst, render::context& rnd,bool direct_inside_inner = false);
+        struct program_output;
+        struct dom_output;
+        struct stream_output;
+        struct program_state;
+        void render(xml_writer& writer, render::context& rnd);
+        /// \brief Key of output in output_cache
+        std::string cache_key(const int xhtml5_encoding) const;
+        /// \brief Key of fragment inserted into output, \see run_cached()
+        std::string cache_key(const bound_fragment& bound, const int xhtml5_encoding) const;
+        /// \brief Resolve inserted fragments of this fragment, \return bound program of this fragment
+        const bound_fragment& bind();
+        const bound_fragment* bind(bindings& result, boost::unordered_map<std::pair<const fragment*, bool>, bound_fragment*>& bound,
+                const fragment& source, const bool views);
+        /// \brief Create root of output and copy comments around root of fragment
+        xmlpp::Element* create_output(xmlpp::Document& output, const bool comments = true) const;
+        /// \brief Run program of bound fragment on current output element of 'state'
+        void run(program_state& state, const bound_fragment& bound) const;
+        /// \brief Run fragment 'inserted' or fragment 'name' if it was not bound, \see run_cached()
+        void run_inserted(program_state& state, const bound_fragment* inserted, const Glib::ustring& name, const fragment::node_info& node, const Glib::ustring* id) const;
+        /*! \brief Run inserted fragment on current output element of 'state' through insert cache of context
+         *  \return false if cache is not used: it is not enabled, output is not streamed or element 'node' has other content
+         */
+        bool run_cached(program_state& state, const bound_fragment& inserted, const fragment::node_info& node, const Glib::ustring* id) const;
+        /// \brief Process element of 'info' and its children, put generated output into 'dst'
+		void process_node(const fragment::node_info& info, xmlpp::Document& output, xmlpp::Element* dst, render::context& rnd, bool already_processing_outer_repeat = false);
+        /// \brief Process children of element of 'info' and put generated output as children of 'dst
+		void process_children(const fragment::node_info& info, xmlpp::Document& output, xmlpp::Element* dst, render::context& rnd,bool direct_inside_inner = false);
     };
 	
 	
@@ -423,6 +1133,14 @@ namespace webpp { namespace xml {
 	public:
 		/// \brief render as TEXT node to 'dst', using 'src' for attribute source and 'ctx' to value source		
 		virtual void render(xmlpp::Element* dst, const xmlpp::Element* src, render::context& ctx) const = 0;
+		/// \brief render to current element of streamed output, default implementation renders to temporary element
+		virtual void render(xml_writer& dst, const xmlpp::Element* src, render::context& ctx) const;
+	};
+
+	/// \brief Data derived by namespace handler from element or attribute when fragment is loaded, \see xmlns::compile
+	class compiled_node {
+	public:
+		virtual ~compiled_node() {}
 	};
 
 	/*! \brief Handle all attributes and tags in namespace
@@ -434,6 +1152,69 @@ namespace webpp { namespace xml {
 		virtual void tag(xmlpp::Element* dst, const xmlpp::Element* src, render::context& ctx) const = 0;
 		/// Process attribute 'src' and place results (attributes) inside element 'dst'
 		virtual void attribute(xmlpp::Element* dst, const xmlpp::Attribute* src, render::context& ctx) const = 0;
+		/// Streamed variant of tag(), default implementation processes tag in temporary element
+		virtual void tag(xml_writer& dst, const xmlpp::Element* src, render::context& ctx) const;
+		/// Streamed variant of attribute(), as above
+		virtual void attribute(xml_writer& dst, const xmlpp::Attribute* src, render::context& ctx) const;
+		/// Called once when fragment is loaded, for every element in namespace or with attributes in namespace. Errors should be reported by tag()/attribute().
+		virtual void prepare(const xmlpp::Element*) const {}
+		/// Called once when fragment is loaded, for every element and attribute in namespace. Result is kept with fragment and passed to variants below.
+		virtual std::shared_ptr<const compiled_node> compile(const xmlpp::Node*) const { return nullptr; }
+		/// tag() with result of compile(src), which is nullptr if handler was not loaded with fragment. Default ignores it.
+		virtual void tag(xmlpp::Element* dst, const xmlpp::Element* src, const compiled_node*, render::context& ctx) const { tag(dst, src, ctx); }
+		virtual void attribute(xmlpp::Element* dst, const xmlpp::Attribute* src, const compiled_node*, render::context& ctx) const { attribute(dst, src, ctx); }
+		virtual void tag(xml_writer& dst, const xmlpp::Element* src, const compiled_node*, render::context& ctx) const { tag(dst, src, ctx); }
+		virtual void attribute(xml_writer& dst, const xmlpp::Attribute* src, const compiled_node*, render::context& ctx) const { attribute(dst, src, ctx); }
+	};
+
+	/*! \brief Rendered text of fragments, reused when all render values read by previous render are the same
+	 *  Values are compared by hash (\see render::tree_element::hash()), so tags must not depend on anything else than render
+	 *  context (time, random numbers...). Least recently used outputs are dropped when outputs and their keys exceed the size limit.
+	 */
+	class output_cache : boost::noncopyable {
+	public:
+		struct statistics {
+			std::size_t hits, misses, entries, bytes;
+		};
+
+		/// \brief Rendered text, inserted fragments also need namespaces declared at root of output
+		struct cached_output {
+			std::string text;
+			std::vector<std::pair<std::string, std::string>> namespaces; // uri and prefix
+			bool visible; // false if inserted root was removed
+		};
+
+		explicit output_cache(const std::size_t max_bytes);
+
+		/// \brief Copy output stored for 'key' and values in 'rnd' to 'output', false if there is none
+		bool find(const std::string& key, render::context& rnd, cached_output& output);
+		/// \brief Store 'output' of 'key', rendered from values 'reads' in 'rnd'
+		void store(const std::string& key, const boost::unordered_set<Glib::ustring>& reads, render::context& rnd, cached_output output);
+		void clear();
+
+		inline const statistics& stats() const { return stats_; }
+		inline std::size_t max_bytes() const { return max_bytes_; }
+	private:
+		typedef std::vector<render::path> names_t;
+		struct entry {
+			std::string key;
+			std::shared_ptr<const names_t> names;
+			std::size_t hash;
+			std::string values; // serialized values of names, hashes of different values can be equal
+			cached_output output;
+			std::size_t bytes;
+		};
+		typedef std::list<entry> entries_t; // most recently used first
+
+		const std::size_t max_bytes_;
+		std::mutex mutex_; // cache is shared by renders in all threads
+		statistics stats_;
+		entries_t entries_;
+		boost::unordered_map<std::string, std::vector<std::shared_ptr<const names_t>>> names_; // sets of values read by renders of key
+		boost::unordered_map<std::pair<const names_t*, std::size_t>, entries_t::iterator> index_;
+
+		static std::string values(const names_t& names, const render::context& rnd);
+		void evict();
 	};
 
 	/*! \class context
@@ -448,6 +1229,15 @@ namespace webpp { namespace xml {
 		boost::unordered_map<Glib::ustring, std::unique_ptr<xmlns>> xmlnses_;
 		typedef std::list<std::shared_ptr<xsltStylesheet>> stylesheets_t;
 		stylesheets_t stylesheets_;
+		/// values known when fragments are loaded
+		render::context constants_;
+		std::unique_ptr<output_cache> output_cache_, insert_cache_;
+		/// inserted fragments resolved for fragments without view insertions, shared by their prepared fragments until fragments change
+		boost::unordered_map<const fragment*, std::shared_ptr<const prepared_fragment::bindings>> bindings_;
+		friend class prepared_fragment;
+
+		/// \brief Loaded fragments must not use replaced handlers, and cached outputs could be rendered by them
+		void taglibs_changed();
 	public:		
 		/*! \brief Construct context
 		 * 	\param library_directory directory with fragment files
@@ -459,6 +1249,16 @@ namespace webpp { namespace xml {
 		 */
 		void attach_xslt(const std::string& name);
 
+		/*! \brief Store constant value (copied) under key. Only future loaded fragments will be affected.
+		 *  c:visible-if expressions using only literals and constants are evaluated when fragment is loaded, elements which
+		 *  are never visible are removed from fragment. In c:visible-if, constants take precedence over render values with
+		 *  the same name; #{} expressions and webpp://format attributes use only render values.
+		 */
+		template<typename T>
+		void create_constant(const Glib::ustring& key, const T& value) {
+			constants_.create_value(key, value);
+		}
+
 		/*! \brief Load fragment from library
 		 * 	\param name fragment path in library
 		 */
@@ -473,6 +1273,7 @@ namespace webpp { namespace xml {
 		template<typename _Tgt>
 		void load_taglib() {
 			_Tgt::process(tags_, xmlnses_);
+			taglibs_changed();
 		}
 
 		/// \brief Find or load fragment named 'name', throw exception if not found
@@ -487,7 +1288,22 @@ namespace webpp { namespace xml {
 		/// \brief Find xmlns handler for uri 'ns', returns nullptr if not found
 		const xmlns* find_xmlns(const Glib::ustring& ns);
 
+		/*! \brief Cache text rendered by prepared_fragment::render(render::context&, std::string&, const int), \see output_cache
+		 *  Cache is cleared when fragments are loaded. 'max_bytes' 0 disables cache.
+		 */
+		void enable_output_cache(const std::size_t max_bytes);
+		/// \brief Output cache, nullptr if it is not enabled
+		inline output_cache* get_output_cache() { return output_cache_.get(); }
+		/*! \brief Cache text of fragments inserted by c:insert and by prepared_fragment::insert() into streamed output
+		 *  Inserted element is rendered once for values it reads (usually under its value prefix) and then copied.
+		 *  Only elements without other content are cached. 'max_bytes' 0 disables cache.
+		 */
+		void enable_insert_cache(const std::size_t max_bytes);
+		/// \brief Insert cache, nullptr if it is not enabled
+		inline output_cache* get_insert_cache() { return insert_cache_.get(); }
+
 		inline const stylesheets_t& get_stylesheets() { return stylesheets_; }
+		inline render::context& get_constants() { return constants_; }
 	};
 }}
 
@@ -3,5 +3,6 @@
 
 #include "xmllib.hpp"
 #include "taglib.hpp"
+#include "static_expression.hpp"
 
 #endif // WEBPP_XMLRENDERER_XMLRENDERER_HPP